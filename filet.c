@@ -6,24 +6,39 @@
  */
 
 #include <ctype.h>
+#include <errno.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <dirent.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <ftw.h>
+#include <grp.h>
 #include <libgen.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <spawn.h>
+#include <sys/file.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/statvfs.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifdef __GNUC__
@@ -40,22 +55,902 @@
 #define SIGWINCH 28
 #endif /* SIGWINCH */
 
-#define ENT_ALLOC_NUM 64
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif /* RENAME_NOREPLACE */
+
+#define ENT_ALLOC_NUM   64
+#define ENT_KEEP_MAX    (16 * 1024) // larger element arrays are freed on clear
+#define ARENA_MIN       (64 * 1024)
+#define ARENA_MAX       (4 * 1024 * 1024)
+#define ARENA_MMAP      (256 * 1024) // blocks this big are mapped directly
+#define FC_RESTART      16
+#define COMPACT_DEFAULT 100000
+#define MEMORY_DEFAULT_MB 256
+#define RAW_CHUNK        512
+#define RAW_WINDOW       4
+#define LOADER_BATCH     4096
+#define LOADER_CACHE     16
+#define LOADER_THREADS   16
+#define STAT_DEADLINE_MS 250
+#define STAT_TICK_MS     10
+#define STAT_MAX_WORKERS 32
+#define SLOW_MAX         16
+#define SLOW_RETRY_S     30
+#define LINK_CACHE_SIZE  (64 * 1024)
+#define GIT_MAX_IGNORES  128
+#define FSINFO_CACHE     16
+#define FSINFO_REFRESH_S 5
+#define MAX_THREADS     64
+#define STATUS_SIZE     256
+#define HASH_BUFFER     (64 * 1024) // per hashing thread, on its stack
+#define DUP_PARTIAL     4096
+#define DUP_COMPARE     (64 * 1024)
+#define BINARY_CHECK    512
+#define SEARCH_BUFFER   (64 * 1024) // per walk thread, on its stack
+#define POLL_MS         100
+#define LS_BUFFER       (1024 * 1024)
+#define LS_TROUBLE      2 // exit status of ls(1) for unlistable arguments
+#define FPS_DEFAULT     60
+#define PACE_OUTQ       512  // bytes the terminal may lag behind
+#define PACE_SLOW_MS    20   // frames taking longer mean the link is full
+#define PACE_TICK_MS    10
+#define PACE_GIVEUP_MS  3000 // terminals not answering by then never do
+#define PACE_SETTLE_MS  200
+#define KEY_CPR         0x100 // cursor position report, see pacer_flush
+#define ESC_MS          50
+
+#define INDEX_MAGIC       "filetix1"
+#define INDEX_NONE        UINT64_MAX
+#define INDEX_MAX_RESULTS 1000
+
+#define FRECENCY_MAGIC       "filetfr1"
+#define FRECENCY_MAX_RANK    10000
+#define FRECENCY_MAX_ENTRIES 1000
+#define FRECENCY_AGING       0.9
+#define FRECENCY_FLUSH_S     30
+
+#define ATTR_MAX_CLAUSES 8
+
+#define JOURNAL_MAGIC "filetjn1"
+#define JOURNAL_MAX   (4 * 1024 * 1024) // started over once it grows beyond
+
+#define SHA256_SIZE 32
+#define SUM_BUFFER  (1024 * 1024)
+#define SUM_ALIGN   4096
+
+#define TAR_BLOCK        512
+#define TAR_RECORD       (20 * TAR_BLOCK)
+#define TAR_BUFFER       (1024 * 1024)
+#define TAR_SENDFILE_MIN (64 * 1024) // smaller files go through the buffer
+
+#define HASH_PRIME1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME3 0x165667B19E3779F9ULL
+
+/**
+ * What memory is accounted to, see mem_alloc
+ */
+enum mem_kind {
+    MEM_ENTRIES, // element arrays
+    MEM_NAMES,   // arenas and front coded names
+    MEM_LINKS,   // the link target cache
+    MEM_JOBS,    // buffers and results of background jobs
+    MEM_KINDS,
+};
+
+struct memstat {
+    atomic_size_t allocs;
+    atomic_size_t bytes; // in use right now
+    atomic_size_t peak;
+};
 
 struct direlement {
     enum {
         TYPE_DIR,
         TYPE_SYML,
         TYPE_SYML_TO_DIR,
+        TYPE_SYML_BROKEN,
         TYPE_EXEC,
         TYPE_NORM,
+        TYPE_UNKNOWN, // stat still pending
     } type;
 
-    char name[NAME_MAX + 1];
+    enum {
+        CMP_NONE,
+        CMP_ONLY_LEFT,
+        CMP_ONLY_RIGHT,
+        CMP_DIFFERS,
+        CMP_SAME,
+    } cmp;
+
+    enum {
+        GIT_NONE,
+        GIT_MODIFIED,
+        GIT_UNTRACKED,
+    } git;
+
+    uint32_t du; // 1 + item in the directory sizes of the listing, if any
+
+    char *name;
+    const char *target; // of links, read lazily by listing_target
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
     bool is_selected;
+    bool no_stat;    // d_type was trusted, size and mtime are unknown
+    bool unreadable; // listed by a manifest check that couldn't read it
+};
+
+/**
+ * A link target, valid as long as the link wasn't changed since mtime
+ */
+struct linkcache {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    char *target;
+};
+
+/**
+ * An entry of the git index. Only the stat data needed to tell whether the
+ * file was modified is kept.
+ */
+struct gitentry {
+    size_t path; // offset into paths
+    uint32_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint32_t size;
+    unsigned stage;
+    bool gitlink; // a submodule, which is a directory in the work tree
+};
+
+/**
+ * The parsed index of the last repository looked at, sorted by path like the
+ * index itself
+ */
+struct gitindex {
+    char gitdir[PATH_MAX];
+    struct timespec mtime;
+    off_t size;
+    struct gitentry *ents;
+    size_t n;
+    char *paths;
+    size_t paths_used;
+    size_t paths_size;
+};
+
+struct gitignore {
+    char pat[512];
+    bool anchored; // matched against the path in the repository
+    bool dir_only;
+};
+
+struct gitignores {
+    struct gitignore pats[GIT_MAX_IGNORES];
+    size_t n;
+};
+
+/**
+ * Space and type of a filesystem, as shown in the header
+ */
+struct fsinfo {
+    dev_t dev;
+    struct timespec at; // when it was read
+    unsigned long long avail;
+    unsigned long long total;
+    const char *fsname;
+    bool valid; // false once it is known to be outdated
+};
+
+/**
+ * A lookup of filesystem info on a worker thread. A dead mount can hang the
+ * worker for good, so the request is shared with the main thread and freed
+ * by whoever lets go of it last.
+ */
+struct fsreq {
+    pthread_mutex_t lock;
+    int refs;
+    bool done;
+    char *path;
+    struct timespec since;
+    struct fsinfo fi;
+};
+
+/**
+ * Tracks how well the terminal keeps up with the output, so frames can be
+ * dropped over slow links instead of queueing up. After each frame the
+ * terminal is asked for the cursor position; it only answers once it has
+ * drawn everything before, which is what tells a lagging link apart.
+ */
+struct pacer {
+    struct timespec last; // of the last full redraw
+    long interval_ms;     // from FILET_FPS
+    long flush_ms;        // how long the last flush blocked
+    struct timespec probe_sent;
+    bool probing;  // waiting for a cursor position report
+    bool answers;  // the terminal answered at least once
+    bool disabled; // it didn't, so don't ask any more
+    bool dirty;    // something was drawn since the last flush
+};
+
+/**
+ * Options and output buffer of --ls
+ */
+struct lsout {
+    bool show_hidden;
+    bool classify; // append / @ * like ls -F
+    bool unsorted;
+    char sep;
+    char *buf;
+    size_t len;
+};
+
+/**
+ * A block of an arena. Arenas hand out memory by bumping used and are only
+ * freed as a whole. Blocks double in size up to ARENA_MAX and big ones are
+ * mapped, so their memory goes back to the system once the arena is freed.
+ */
+struct arenablock {
+    struct arenablock *next;
+    size_t used;
+    size_t size; // of data
+    bool mapped;
+    char *data;
+};
+
+/**
+ * Front coded names of a sorted listing. Every name is stored as the length
+ * of the prefix it shares with the previous one and the remaining suffix
+ * (both lengths as varints). Every FC_RESTART names the prefix is reset, so
+ * a name can be decoded starting at the closest restart point.
+ */
+struct fcnames {
+    unsigned char *data;
+    size_t *restarts;
+    size_t n;
+    size_t bytes; // accounted to MEM_NAMES
+
+    // last decoded name, makes sequential access cheap
+    size_t cur;
+    size_t cur_next; // offset of the name after cur
+    char cur_name[NAME_MAX + 1];
+};
+
+/**
+ * A listing kept in temporary files because it did not fit into the memory
+ * budget. The elements and the offsets of their names are plain arrays, so
+ * only the pages that are looked at have to be read.
+ */
+struct spill {
+    struct direlement *ents;
+    uint64_t *offs;
+    char *names;
+    size_t ents_size;
+    size_t offs_size;
+    size_t names_size;
+};
+
+/**
+ * Sorted runs of a spilled listing, all in one file. Run i spans bounds[i]
+ * to bounds[i + 1].
+ */
+struct spillruns {
+    FILE *file;
+    off_t *bounds;
+    size_t n;
+};
+
+/**
+ * Read position in a run while merging
+ */
+struct spillrun {
+    off_t pos;
+    off_t end;
+    unsigned char *buf;
+    size_t cap;
+    size_t len;
+    size_t at;
+    struct direlement de;
+    char name[NAME_MAX + 1];
+};
+
+/**
+ * Running totals of the marked elements of a listing. Marked directories
+ * count with the size of their contents once that has been counted.
+ */
+struct marks {
+    size_t n;
+    size_t dirs;
+    off_t bytes;
+    size_t pending; // marked directories that are still being counted
+};
+
+/**
+ * A directory listing. Names, link targets and everything else kept per
+ * element are allocated from arena, which is freed as a whole when the
+ * listing is reloaded. Huge listings are compacted, in which case the names
+ * live in fc, or spilled to disk, in which case everything lives in spill.
+ * Either way names have to be read through listing_name.
+ */
+struct listing {
+    struct direlement *ents;
+    size_t n;
+    size_t size;
+    size_t gen; // changes whenever the elements are replaced
+    struct arenablock *arena;
+    struct fcnames *fc;
+    struct spill *spill;
+    struct statjob *late; // stats that hung while loading
+    dev_t dev;            // of the directory, if the elements have inodes
+    struct marks marks;
+    struct dusizes *du;
+    bool sorted;    // by direlemcmp, so late elements can be sorted in
+    bool has_dirfd; // dirfd is open on the directory to read link targets
+    int dirfd;
+};
+
+/**
+ * A directory expanded in the tree view. Its listing is kept once collapsed,
+ * so expanding it again is free.
+ */
+struct treenode {
+    char *dir;               // full path
+    const char *rel;         // the same, relative to the current directory
+    struct treenode *parent; // NULL if expanded from the current directory
+    size_t idx;              // of its element in the parent listing
+    unsigned depth;
+    struct listing list;
+};
+
+/**
+ * A range of elements of one listing, shown as consecutive rows
+ */
+struct treeseg {
+    struct treenode *node; // NULL for the current directory
+    size_t from;
+    size_t to;
+    size_t row; // of the element at from
+};
+
+/**
+ * The rows of the tree view as ranges of the listings involved. Expanding a
+ * directory splits the range it's in around the range of its own listing,
+ * so no listing is copied or sorted again.
+ */
+struct tree {
+    struct treeseg *segs;
+    size_t nsegs;
+    size_t segs_size;
+    size_t rows;
+    struct treenode **nodes; // every directory loaded so far
+    size_t nnodes;
+    size_t gen; // of the listing of the current directory
+    size_t n;
+};
+
+/**
+ * Where a row of the tree view comes from
+ */
+struct treerow {
+    struct listing *list;
+    size_t i;
+    const char *dir;
+    struct treenode *node;
+    size_t seg;
+};
+
+enum loader_kind {
+    LOADER_STAT,  // stat batches of entries on one or more worker threads
+    LOADER_DTYPE, // trust d_type, stat only links and unknown entries
+};
+
+/**
+ * How directories on a filesystem are loaded
+ */
+struct loader {
+    unsigned long fstype;
+    const char *fsname;
+    enum loader_kind kind;
+    size_t threads;
+};
+
+struct statresult {
+    const char *name;
+    struct direlement de;
+    bool ok;
+    bool done;
+    bool pending; // hung while loading, still to be filled in
+};
+
+struct statworker {
+    bool busy;
+    struct timespec since; // start of the current stat
+};
+
+/**
+ * Stats of a batch of entries, done by worker threads so a hanging mount
+ * only ever blocks them. Workers that hang are left behind and finish in the
+ * background, the last one to drop its reference frees the job.
+ */
+struct statjob {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t refs;
+    int fd;
+    char *dir;
+    char *names;
+    struct statresult *res;
+    size_t n;
+    size_t next;     // next entry to stat
+    size_t finished; // entries whose stat returned
+    size_t nwait;    // leading entries the loader waits for, the rest hung
+    size_t waited;   // of those, entries whose stat returned
+    struct statworker workers[STAT_MAX_WORKERS];
+    size_t nworkers;
+    size_t starting; // threads created that didn't take a slot yet
+    struct statjob *late_next;
+};
+
+/**
+ * An entry whose stat hung, along with the time it was last tried
+ */
+struct slowpath {
+    char path[PATH_MAX];
+    time_t since;
+};
+
+/**
+ * A directory shown in directory order. Only a window of chunks of RAW_CHUNK
+ * directory entries is kept in the listing, the positions of all chunks seen
+ * so far are remembered to get back to them.
+ */
+struct rawdir {
+    DIR *dir;
+    char *path;
+    struct loader ld;
+    bool show_hidden;
+    long *pos; // telldir at the start of every chunk read so far
+    size_t npos;
+    size_t end;     // number of chunks, SIZE_MAX until the end was seen
+    size_t first;   // first chunk in the listing
+    size_t *counts; // number of elements of each chunk in the listing
+    size_t nchunks;
+    size_t size;
+    size_t gen; // generation of the listing holding the window
+};
+
+struct parallel_ctx {
+    void (*fn)(void *arg, size_t i);
+    void *arg;
+    size_t count;
+    atomic_size_t next;
+};
+
+struct walk_dir {
+    struct walk_dir *next;
+    char path[];
+};
+
+struct walk {
+    int rootfd;
+    bool show_hidden;
+    void (*visit)(
+        void *arg,
+        int dirfd,
+        const char *relpath,
+        const struct stat *sb);
+    void *arg;
+    const atomic_bool *cancel;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct walk_dir *queue;
+    size_t active; // directories queued or being read
+};
+
+struct cmp_ctx {
+    int lfd;
+    int rfd;
+    struct direlement *ents;
+    const size_t *cands;
+};
+
+struct dupfile {
+    char *path;
+    off_t size;
+    mode_t mode;
+    struct timespec mtime;
+    dev_t dev;
+    ino_t ino;
+    uint64_t hash;
+    size_t head; // first file with the same size and hash
+    bool ok;
+};
+
+struct dup_ctx {
+    int rootfd;
+    pthread_mutex_t lock;
+    struct dupfile *files;
+    size_t n;
+    size_t size;
+};
+
+/**
+ * A match of a search. Walker threads push them onto search.hits and the ui
+ * takes the whole list at once, so neither side ever waits for the other.
+ */
+struct searchhit {
+    struct searchhit *next;
+    struct direlement de;
+    char name[];
+};
+
+struct search {
+    pthread_t thread;
+    int rootfd;
+    bool show_hidden;
+    char needle[NAME_MAX + 1];
+    size_t needle_len;
+
+    atomic_bool cancel;
+    atomic_bool done;
+    atomic_size_t files;
+    atomic_size_t bytes;
+
+    _Atomic(struct searchhit *) hits; // found but not yet handed to the ui
+};
+
+/*
+ * The path index file consists of the header, the root path, the directory
+ * table, the entry table, the trigram table, the posting lists and the names.
+ * Entries are laid out directory by directory with every directory linking
+ * to its own entry in the parent, so a path is stored as one name per entry.
+ */
+struct ixheader {
+    char magic[8];
+    uint64_t root_len;
+    uint64_t ndirs;
+    uint64_t nents;
+    uint64_t names_size;
+    uint64_t ntris;
+    uint64_t postings_size;
+};
+
+struct ixdirrec {
+    uint64_t first; // first entry in this directory
+    uint64_t count;
+    int64_t sec; // mtime when the directory was read
+    int64_t nsec;
+    uint64_t self; // entry of this directory in its parent
+};
+
+struct ixtri {
+    uint32_t tri;
+    uint32_t count;
+    uint64_t off; // delta and varint encoded entries in the posting lists
+};
+
+struct pathindex {
+    void *map;
+    size_t map_size;
+    struct ixheader hdr;
+    const char *root;
+    const struct ixdirrec *dirs;
+    const uint64_t *ents; // name offset << 1 | is_dir
+    const struct ixtri *tris;
+    const unsigned char *postings;
+    const char *names; // type byte ('d' or 'f') followed by the name
+};
+
+struct ixqueue {
+    struct ixqueue *next;
+    uint64_t old; // directory in the old index
+    char path[];
+};
+
+struct ixscandir {
+    char *path;
+    struct timespec mtime;
+    char *block;
+    char **names;
+    size_t n;
+};
+
+struct ixscan {
+    int rootfd;
+    const struct pathindex *old;
+    uint64_t *old_child; // old entry -> old directory
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct ixqueue *queue;
+    size_t active;
+    struct ixscandir *dirs;
+    size_t ndirs;
+    size_t dirs_size;
+
+    atomic_size_t scanned;
+    atomic_size_t reused;
+    struct job *job; // for progress and cancelling
+};
+
+/*
+ * The frecency database is a header followed by records, each of them
+ * followed by the path padded to 8 bytes
+ */
+struct frheader {
+    char magic[8];
+    uint32_t count;
+    uint32_t pad;
+};
+
+struct frrecord {
+    double rank;
+    int64_t last;
+    uint32_t len;
+    uint32_t pad;
+};
+
+struct frentry {
+    char *path;
+    double rank;
+    time_t last;
+};
+
+struct frecency {
+    struct frentry *ents;
+    size_t n;
+    size_t size;
+};
+
+struct renameop {
+    const char *from;
+    char *to;
+    char tmp[64]; // set while from is parked under a temporary name
+    size_t idx;   // element in the listing
+    enum {
+        RENAME_NEW,
+        RENAME_STACKED,
+        RENAME_DONE,
+    } state;
+    bool ok;
+    int err;
+};
+
+/*
+ * The undo journal is a magic followed by records, each of them followed by
+ * its names padded to 8 bytes. A JOURNAL_DIR record starts a batch and names
+ * the directory, the JOURNAL_RENAME records after it hold the old and the new
+ * name, separated by a NUL byte, and the inode the entry had.
+ */
+enum {
+    JOURNAL_DIR = 1,
+    JOURNAL_RENAME,
+};
+
+struct jnrecord {
+    uint32_t kind;
+    uint32_t len;
+    uint64_t dev;
+    uint64_t ino;
+};
+
+struct jnbatch {
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+/**
+ * A background job. run is called on its own thread and finish on the main
+ * thread once it's done, which is where the listing may be touched.
+ */
+struct job {
+    pthread_t thread;
+    const char *what;
+    atomic_size_t total; // number of steps, if known
+    void (*run)(struct job *job);
+    void (*finish)(struct job *job, struct listing *list);
+
+    atomic_bool cancel;
+    atomic_bool done;
+    atomic_size_t progress;
+};
+
+struct duitem {
+    const char *name; // in the arena of the listing
+    size_t idx; // element in the listing
+    off_t bytes;
+};
+
+/**
+ * Counts the sizes of the marked directories of a listing, one after another
+ * on a thread of its own. Items before next are done.
+ */
+struct dusizes {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int dirfd;
+    struct duitem *items;
+    size_t n;
+    size_t size;
+    atomic_size_t next; // read by the main thread without taking the lock
+    size_t seen;        // items already added to the marks, main thread only
+
+    atomic_bool cancel;
+};
+
+struct modeclause {
+    mode_t who;
+    mode_t perm;
+    char op;
+    bool cond_exec; // X
+    bool masked;    // no who given, so the umask applies like in chmod(1)
+};
+
+struct attrop {
+    enum {
+        ATTR_CHMOD,
+        ATTR_CHOWN,
+        ATTR_TOUCH,
+    } kind;
+    bool recursive;
+
+    bool is_octal;
+    mode_t octal;
+    struct modeclause clauses[ATTR_MAX_CLAUSES];
+    size_t nclauses;
+    mode_t umask;
+
+    uid_t uid;
+    gid_t gid;
+};
+
+struct attritem {
+    char *name;
+    size_t idx;
+    bool changed;
+    bool descend;   // a directory to walk once all items are done
+    struct stat sb; // after the change
+};
+
+struct attrjob {
+    struct job job;
+    char what[NAME_MAX + 1];
+    struct attrop op;
+    int dirfd;
+    struct attritem *items;
+    size_t n;
+    size_t gen;
+
+    atomic_size_t changed;
+    atomic_size_t failed;
+};
+
+struct sha256 {
+    uint32_t h[8];
+    uint64_t len;
+    unsigned char buf[64];
+    size_t used;
+};
+
+struct sumfile {
+    char *path;
+    unsigned char sum[SHA256_SIZE];
+    unsigned char want[SHA256_SIZE]; // when verifying
+    bool ok;                         // could be read
+};
+
+/**
+ * A job writing or verifying a manifest in the format of sha256sum
+ */
+struct sumjob {
+    struct job job;
+    char dir[PATH_MAX];
+    char manifest[PATH_MAX];
+    bool verify;
+    bool show_hidden;
+    int dirfd;
+    char **roots; // marked entries to hash, everything if there are none
+    size_t nroots;
+    dev_t skip_dev; // the manifest, which isn't hashed itself
+    ino_t skip_ino;
+
+    pthread_mutex_t lock;
+    struct sumfile *files;
+    size_t n;
+    size_t size;
+    size_t malformed;
+    int err; // of reading or writing the manifest
+
+    atomic_size_t next;
+};
+
+/**
+ * Prefix of the paths of the files walk_tree finds below a root
+ */
+struct sumwalk {
+    struct sumjob *sj;
+    const char *prefix;
+};
+
+/**
+ * A directory being packed: the names of its entries, read up front so no
+ * directory stays open while its children are packed
+ */
+struct tarlevel {
+    char *names; // NUL terminated, one after another
+    size_t len;
+    size_t at;      // next name to pack
+    size_t pathlen; // of the directory in tarjob.path
+};
+
+/**
+ * A file with several hard links, packed with the first path it was found at
+ */
+struct tarlink {
+    dev_t dev;
+    ino_t ino;
+    char *path;
+};
+
+/**
+ * A job writing the marked entries to a tar archive, optionally through a
+ * compressor picked by the suffix of the archive
+ */
+struct indexjob {
+    struct job job;
+    char root[PATH_MAX]; // the path to index, then the root of its index
+    char file[PATH_MAX];
+    size_t scanned;
+    size_t reused;
+    int err;
+    const char *failed; // root or file, whichever err is about
+};
+
+struct tarjob {
+    struct job job;
+    char archive[PATH_MAX];
+    int dirfd;
+    char **roots;
+    size_t nroots;
+    dev_t skip_dev; // the archive, which isn't packed itself
+    ino_t skip_ino;
+    char path[PATH_MAX]; // of the entry being packed, relative to dirfd
+    struct tarlink *links;
+    size_t nlinks;
+    size_t links_size;
+
+    int out; // the archive or a pipe to the compressor
+    pid_t compressor;
+    bool use_sendfile;
+    char *buf;
+    size_t len;
+    off_t written;
+    size_t failed;
+    int err;
 };
 
+extern char **environ;
+
 static struct termios g_old_termios;
+static char g_status[STATUS_SIZE];
+static struct slowpath g_slow[SLOW_MAX];
+static size_t g_nslow;
+static struct linkcache g_links[LINK_CACHE_SIZE];
+static size_t g_nlinks;
+static struct fsinfo g_fsinfo[FSINFO_CACHE];
+static size_t g_nfsinfo;
+static struct fsreq *g_fsreq; // lookup in flight
+static char g_fsasked[PATH_MAX];
+static time_t g_fsasked_at;
+static struct pacer g_pacer;
+static struct memstat g_mem[MEM_KINDS];
+static size_t g_mem_budget; // in bytes, 0 for none
+static struct frecency g_visits; // not written to the database yet
+static time_t g_visits_flushed;
 static volatile sig_atomic_t g_needs_redraw = false;
 static volatile sig_atomic_t g_quit         = false;
 
@@ -86,412 +981,8763 @@ getenv_or(const char *name, const char *fallback)
 }
 
 /**
- * Natural compare function respecting numbers, instead of just checking digits
+ * Natural compare function respecting numbers, instead of just checking
+ * digits. Numbers are compared digit by digit, so they can be of any length,
+ * and names that only differ in leading zeros are ordered by strcmp.
  */
 static int
 strnatcmp(const char *s1, const char *s2)
 {
-    for (;;) {
-        if (*s2 == '\0') {
-            return *s1 != '\0';
+    const unsigned char *p1 = (const unsigned char *)s1;
+    const unsigned char *p2 = (const unsigned char *)s2;
+
+    for (;;) {
+        if (*p2 == '\0') {
+            return *p1 != '\0' ? 1 : strcmp(s1, s2);
+        }
+
+        if (*p1 == '\0') {
+            return -1;
+        }
+
+        if (!(isdigit(*p1) && isdigit(*p2))) {
+            if (*p1 != *p2) {
+                return (int)*p1 - (int)*p2;
+            }
+            ++p1;
+            ++p2;
+        } else {
+            while (*p1 == '0') {
+                ++p1;
+            }
+            while (*p2 == '0') {
+                ++p2;
+            }
+            size_t len1 = 0;
+            size_t len2 = 0;
+            while (isdigit(p1[len1])) {
+                ++len1;
+            }
+            while (isdigit(p2[len2])) {
+                ++len2;
+            }
+            if (len1 != len2) {
+                return len1 > len2 ? 1 : -1;
+            }
+            int diff = memcmp(p1, p2, len1);
+            if (diff != 0) {
+                return diff;
+            }
+            p1 += len1;
+            p2 += len2;
+        }
+    }
+}
+
+/**
+ * Whether the size and mtime of de are known
+ */
+static bool
+has_stat(const struct direlement *de)
+{
+    return de->type != TYPE_UNKNOWN && !de->no_stat;
+}
+
+/**
+ * Comparison function for direlements
+ */
+static int
+direlemcmp(const void *va, const void *vb)
+{
+    const struct direlement *a = va;
+    const struct direlement *b = vb;
+
+    bool a_is_dir = a->type == TYPE_DIR || a->type == TYPE_SYML_TO_DIR;
+    bool b_is_dir = b->type == TYPE_DIR || b->type == TYPE_SYML_TO_DIR;
+
+    if (a_is_dir != b_is_dir) {
+        return a_is_dir ? -1 : 1;
+    }
+
+    return strnatcmp(a->name, b->name);
+}
+
+static uint64_t
+rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t
+load64(const unsigned char *p)
+{
+    uint64_t w;
+    memcpy(&w, p, sizeof(w));
+    return w;
+}
+
+static uint64_t
+hash_round(uint64_t acc, uint64_t w)
+{
+    return rotl64(acc + w * HASH_PRIME2, 31) * HASH_PRIME1;
+}
+
+/**
+ * Fast non-cryptographic 64 bit hash (xxh64 style, four independent lanes).
+ * Pass the result of a previous call as seed to hash discontinuous data.
+ */
+static uint64_t
+hash_bytes(const void *data, size_t len, uint64_t seed)
+{
+    const unsigned char *p = data;
+    uint64_t h             = seed + HASH_PRIME3 + len;
+
+    if (len >= 32) {
+        uint64_t v[4] = {
+            seed + HASH_PRIME1 + HASH_PRIME2,
+            seed + HASH_PRIME2,
+            seed,
+            seed - HASH_PRIME1,
+        };
+
+        for (; len >= 32; p += 32, len -= 32) {
+            v[0] = hash_round(v[0], load64(p));
+            v[1] = hash_round(v[1], load64(p + 8));
+            v[2] = hash_round(v[2], load64(p + 16));
+            v[3] = hash_round(v[3], load64(p + 24));
+        }
+
+        h += rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12) +
+             rotl64(v[3], 18);
+    }
+
+    for (; len >= 8; p += 8, len -= 8) {
+        h = rotl64(h ^ hash_round(0, load64(p)), 27) * HASH_PRIME1;
+    }
+
+    if (len > 0) {
+        uint64_t w = 0;
+        memcpy(&w, p, len);
+        h = rotl64(h ^ hash_round(0, w), 27) * HASH_PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= HASH_PRIME2;
+    h ^= h >> 29;
+    h *= HASH_PRIME3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+/**
+ * Hashes the whole content of a file. It is read rather than mapped, so a
+ * file truncated meanwhile fails the hash instead of raising SIGBUS.
+ */
+static bool
+hash_file(int dirfd, const char *name, uint64_t *hash)
+{
+    int fd = openat(dirfd, name, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // the buffer is filled up before it is hashed, so the hash doesn't
+    // depend on how the reads happen to be split
+    unsigned char buf[HASH_BUFFER];
+    uint64_t h = 0;
+    size_t len = 0;
+    ssize_t n;
+    while ((n = read(fd, buf + len, HASH_BUFFER - len)) != 0) {
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            break;
+        }
+        len += n;
+        if (len == HASH_BUFFER) {
+            h   = hash_bytes(buf, len, h);
+            len = 0;
+        }
+    }
+    close(fd);
+
+    if (n < 0) {
+        return false;
+    }
+    *hash = hash_bytes(buf, len, h);
+    return true;
+}
+
+static void *
+parallel_worker(void *arg)
+{
+    struct parallel_ctx *ctx = arg;
+
+    size_t i;
+    while ((i = atomic_fetch_add(&ctx->next, 1)) < ctx->count) {
+        ctx->fn(ctx->arg, i);
+    }
+
+    return NULL;
+}
+
+/**
+ * Runs fn(arg) on nthreads threads, including the calling one, and waits for
+ * all of them to return
+ */
+static void
+run_threads(void *(*fn)(void *arg), void *arg, size_t nthreads)
+{
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu > 0 && nthreads > (size_t)ncpu) {
+        nthreads = ncpu;
+    }
+    if (nthreads > MAX_THREADS) {
+        nthreads = MAX_THREADS;
+    }
+
+    pthread_t threads[MAX_THREADS];
+    size_t started = 0;
+    while (started + 1 < nthreads) {
+        if (pthread_create(&threads[started], NULL, fn, arg) != 0) {
+            break;
+        }
+        ++started;
+    }
+
+    fn(arg); // the calling thread helps out
+
+    for (size_t i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+/**
+ * Calls fn(arg, i) for every i in [0, count) using one thread per online cpu
+ * and waits for all of them to finish
+ */
+static void
+parallel_for(size_t count, void (*fn)(void *arg, size_t i), void *arg)
+{
+    struct parallel_ctx ctx = {.fn = fn, .arg = arg, .count = count};
+    atomic_init(&ctx.next, 0);
+
+    run_threads(parallel_worker, &ctx, count > 0 ? count : 1);
+}
+
+static void *
+walk_worker(void *arg)
+{
+    struct walk *w = arg;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (!w->queue && w->active > 0) {
+            pthread_cond_wait(&w->cond, &w->lock);
+        }
+
+        struct walk_dir *wd = w->queue;
+        if (!wd) {
+            break; // nothing queued and nobody working, so we're done
+        }
+        w->queue = wd->next;
+        pthread_mutex_unlock(&w->lock);
+
+        int fd = openat(
+            w->rootfd,
+            wd->path[0] ? wd->path : ".",
+            O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        DIR *dir = fd < 0 ? NULL : fdopendir(fd);
+        if (!dir && fd >= 0) {
+            close(fd);
+        }
+
+        struct dirent *ent;
+        while (dir && !(w->cancel && atomic_load(w->cancel)) &&
+               (ent = readdir(dir))) {
+            const char *name = ent->d_name;
+            char relpath[PATH_MAX];
+            struct stat sb;
+
+            if (name[0] == '.' &&
+                (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+
+            if (!w->show_hidden && name[0] == '.') {
+                continue;
+            }
+
+            int len = snprintf(
+                relpath,
+                sizeof(relpath),
+                "%s%s%s",
+                wd->path,
+                wd->path[0] ? "/" : "",
+                name);
+            if (len < 0 || (size_t)len >= sizeof(relpath)) {
+                continue;
+            }
+
+            if (fstatat(dirfd(dir), name, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
+                continue;
+            }
+
+            w->visit(w->arg, dirfd(dir), relpath, &sb);
+
+            if (S_ISDIR(sb.st_mode)) {
+                struct walk_dir *sub = malloc(sizeof(*sub) + len + 1);
+                if (!sub) {
+                    continue;
+                }
+                memcpy(sub->path, relpath, len + 1);
+
+                pthread_mutex_lock(&w->lock);
+                sub->next = w->queue;
+                w->queue  = sub;
+                ++w->active;
+                pthread_cond_signal(&w->cond);
+                pthread_mutex_unlock(&w->lock);
+            }
+        }
+
+        if (dir) {
+            closedir(dir);
+        }
+        free(wd);
+
+        pthread_mutex_lock(&w->lock);
+        if (--w->active == 0) {
+            pthread_cond_broadcast(&w->cond);
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return NULL;
+}
+
+/**
+ * Walks the tree below rootfd on all cpus, calling visit for every entry with
+ * its path relative to rootfd. Symlinks aren't followed. visit gets called
+ * concurrently and has to do its own locking.
+ */
+static void
+walk_tree(
+    int rootfd,
+    bool show_hidden,
+    void (*visit)(
+        void *arg,
+        int dirfd,
+        const char *relpath,
+        const struct stat *sb),
+    void *arg,
+    const atomic_bool *cancel)
+{
+    struct walk w = {
+        .rootfd      = rootfd,
+        .show_hidden = show_hidden,
+        .visit       = visit,
+        .arg         = arg,
+        .cancel      = cancel,
+        .active      = 1,
+    };
+
+    w.queue = calloc(1, sizeof(*w.queue) + 1);
+    if (!w.queue) {
+        return;
+    }
+
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.cond, NULL);
+
+    run_threads(walk_worker, &w, MAX_THREADS);
+
+    pthread_cond_destroy(&w.cond);
+    pthread_mutex_destroy(&w.lock);
+
+    // only left over when cancelled
+    while (w.queue) {
+        struct walk_dir *next = w.queue->next;
+        free(w.queue);
+        w.queue = next;
+    }
+}
+
+/**
+ * Formats size in a human readable way
+ */
+static const char *
+format_size(off_t size, char *buf, size_t bufsize)
+{
+    static const char units[] = "BKMGTPE";
+
+    double val = size;
+    size_t u   = 0;
+    while (val >= 1024 && u + 1 < sizeof(units) - 1) {
+        val /= 1024;
+        ++u;
+    }
+
+    if (u == 0) {
+        snprintf(buf, bufsize, "%ldB", (long)size);
+    } else {
+        snprintf(buf, bufsize, "%.1f%c", val, units[u]);
+    }
+
+    return buf;
+}
+
+static const char *mem_kinds[] = {
+    [MEM_ENTRIES] = "entries",
+    [MEM_NAMES]   = "names",
+    [MEM_LINKS]   = "links",
+    [MEM_JOBS]    = "jobs",
+};
+
+/**
+ * Accounts an allocation of bytes to kind. Only the allocations that grow
+ * with the size of directories or jobs are accounted, small fixed ones
+ * aren't.
+ */
+static void
+mem_alloc(enum mem_kind kind, size_t bytes)
+{
+    struct memstat *m = &g_mem[kind];
+    size_t now        = atomic_fetch_add(&m->bytes, bytes) + bytes;
+    size_t peak       = atomic_load(&m->peak);
+
+    atomic_fetch_add(&m->allocs, 1);
+    while (now > peak && !atomic_compare_exchange_weak(&m->peak, &peak, now)) {
+    }
+}
+
+static void
+mem_free(enum mem_kind kind, size_t bytes)
+{
+    atomic_fetch_sub(&g_mem[kind].bytes, bytes);
+}
+
+/**
+ * Reads the memory budget from FILET_MEMORY, once at startup
+ */
+static void
+mem_init(void)
+{
+    const char *env = getenv("FILET_MEMORY");
+    size_t mb       = env ? strtoul(env, NULL, 10) : MEMORY_DEFAULT_MB;
+
+    g_mem_budget = mb * 1024 * 1024;
+}
+
+/**
+ * Returns the bytes accounted to all kinds but skip, which may be MEM_KINDS
+ */
+static size_t
+mem_used(enum mem_kind skip)
+{
+    size_t total = 0;
+    for (size_t i = 0; i < MEM_KINDS; ++i) {
+        total += i == skip ? 0 : atomic_load(&g_mem[i].bytes);
+    }
+
+    return total;
+}
+
+/**
+ * Returns whether caches have to make room to keep filet within its budget
+ * once another bytes are allocated
+ */
+static bool
+mem_over_budget(size_t bytes)
+{
+    return g_mem_budget > 0 && mem_used(MEM_KINDS) + bytes > g_mem_budget;
+}
+
+/**
+ * Describes the memory in use, and at most, per kind for FILET_TRACE
+ */
+static void
+mem_describe(char *buf, size_t size)
+{
+    size_t len = 0;
+    for (size_t i = 0; i < MEM_KINDS && len < size; ++i) {
+        char now[16];
+        char peak[16];
+        int n = snprintf(
+            buf + len,
+            size - len,
+            "%s%s %s/%s",
+            i > 0 ? ", " : "",
+            mem_kinds[i],
+            format_size(atomic_load(&g_mem[i].bytes), now, sizeof(now)),
+            format_size(atomic_load(&g_mem[i].peak), peak, sizeof(peak)));
+        len += n > 0 ? (size_t)n : 0;
+    }
+}
+
+/**
+ * Writes the memory accounting as a single line of json
+ */
+static void
+mem_json(FILE *f)
+{
+    fprintf(f, "{");
+    for (size_t i = 0; i < MEM_KINDS; ++i) {
+        fprintf(
+            f,
+            "%s\"%s\": {\"allocs\": %zu, \"bytes\": %zu, \"peak\": %zu}",
+            i > 0 ? ", " : "",
+            mem_kinds[i],
+            atomic_load(&g_mem[i].allocs),
+            atomic_load(&g_mem[i].bytes),
+            atomic_load(&g_mem[i].peak));
+    }
+    fprintf(f, "}\n");
+}
+
+/**
+ * Allocates len bytes aligned to align (a power of two up to 8) from arena
+ */
+static void *
+arena_alloc(struct arenablock **arena, size_t len, size_t align)
+{
+    struct arenablock *head = *arena;
+    size_t at               = 0;
+    if (head) {
+        at = (head->used + align - 1) & ~(align - 1);
+    }
+
+    if (!head || at > head->size || head->size - at < len) {
+        size_t size = head ? head->size * 2 : ARENA_MIN;
+        size        = size > ARENA_MAX ? ARENA_MAX : size;
+        size        = size < len ? len : size;
+
+        struct arenablock *block;
+        if (sizeof(*block) + size >= ARENA_MMAP) {
+            block = mmap(
+                NULL,
+                sizeof(*block) + size,
+                PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS,
+                -1,
+                0);
+            block = block == MAP_FAILED ? NULL : block;
+        } else {
+            block = malloc(sizeof(*block) + size);
+        }
+        if (!block) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        mem_alloc(MEM_NAMES, sizeof(*block) + size);
+
+        block->next   = head;
+        block->used   = 0;
+        block->size   = size;
+        block->mapped = sizeof(*block) + size >= ARENA_MMAP;
+        block->data   = (char *)(block + 1);
+        *arena        = block;
+        head          = block;
+        at            = 0;
+    }
+
+    head->used = at + len;
+    return head->data + at;
+}
+
+static void
+arena_free(struct arenablock **arena)
+{
+    while (*arena) {
+        struct arenablock *next = (*arena)->next;
+        mem_free(MEM_NAMES, sizeof(**arena) + (*arena)->size);
+        if ((*arena)->mapped) {
+            munmap(*arena, sizeof(**arena) + (*arena)->size);
+        } else {
+            free(*arena);
+        }
+        *arena = next;
+    }
+}
+
+/**
+ * Copies name into the arena of list
+ */
+static char *
+listing_add_name(struct listing *list, const char *name)
+{
+    size_t len = strlen(name) + 1;
+    char *res  = arena_alloc(&list->arena, len, 1);
+
+    return memcpy(res, name, len);
+}
+
+static void
+du_visit(
+    void *arg,
+    int UNUSED(dirfd),
+    const char *UNUSED(relpath),
+    const struct stat *sb)
+{
+    atomic_fetch_add((atomic_llong *)arg, sb->st_size);
+}
+
+static void *
+du_worker(void *arg)
+{
+    struct dusizes *du = arg;
+
+    pthread_mutex_lock(&du->lock);
+    for (;;) {
+        size_t next = atomic_load(&du->next);
+        while (next == du->n && !atomic_load(&du->cancel)) {
+            pthread_cond_wait(&du->cond, &du->lock);
+        }
+        if (atomic_load(&du->cancel)) {
+            break;
+        }
+        const char *name = du->items[next].name;
+        pthread_mutex_unlock(&du->lock);
+
+        atomic_llong bytes;
+        atomic_init(&bytes, 0);
+        int fd = openat(du->dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if (fd >= 0) {
+            walk_tree(fd, true, du_visit, &bytes, &du->cancel);
+            close(fd);
+        }
+
+        pthread_mutex_lock(&du->lock);
+        du->items[next].bytes = atomic_load(&bytes);
+        atomic_store(&du->next, next + 1);
+    }
+    pthread_mutex_unlock(&du->lock);
+
+    return NULL;
+}
+
+static void
+du_free(struct dusizes *du)
+{
+    if (!du) {
+        return;
+    }
+
+    pthread_mutex_lock(&du->lock);
+    atomic_store(&du->cancel, true);
+    pthread_cond_signal(&du->cond);
+    pthread_mutex_unlock(&du->lock);
+    pthread_join(du->thread, NULL);
+
+    free(du->items);
+    close(du->dirfd);
+    pthread_cond_destroy(&du->cond);
+    pthread_mutex_destroy(&du->lock);
+    free(du);
+}
+
+/**
+ * Returns the size counting worker of list, which is in path, starting it if
+ * there is none yet. Returns NULL if it can't be started.
+ */
+static struct dusizes *
+du_open(struct listing *list, const char *path)
+{
+    if (list->du) {
+        return list->du;
+    }
+
+    int fd = open(path, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct dusizes *du = calloc(1, sizeof(*du));
+    if (!du) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    du->dirfd = fd;
+    pthread_mutex_init(&du->lock, NULL);
+    pthread_cond_init(&du->cond, NULL);
+    atomic_init(&du->next, 0);
+    atomic_init(&du->cancel, false);
+
+    if (pthread_create(&du->thread, NULL, du_worker, du) != 0) {
+        pthread_cond_destroy(&du->cond);
+        pthread_mutex_destroy(&du->lock);
+        close(fd);
+        free(du);
+        return NULL;
+    }
+    list->du = du;
+
+    return du;
+}
+
+/**
+ * Appends item to du and returns its slot for direlement.du. Items that are
+ * done already have to come before all others.
+ */
+static uint32_t
+du_push(struct dusizes *du, struct duitem item, bool done)
+{
+    pthread_mutex_lock(&du->lock);
+    if (du->n == du->size) {
+        du->size = du->size ? du->size * 2 : 16;
+        struct duitem *tmp = realloc(du->items, du->size * sizeof(*tmp));
+        if (!tmp) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        du->items = tmp;
+    }
+    du->items[du->n] = item;
+    uint32_t slot    = ++du->n;
+    if (done) {
+        atomic_store(&du->next, du->n);
+        du->seen = du->n;
+    } else {
+        pthread_cond_signal(&du->cond);
+    }
+    pthread_mutex_unlock(&du->lock);
+
+    return slot;
+}
+
+/**
+ * Queues directory i of list, which is in path, to have its size counted.
+ * Returns its slot for direlement.du or 0 if it can't be counted.
+ */
+static uint32_t
+du_queue(struct listing *list, const char *path, size_t i, const char *name)
+{
+    struct dusizes *du = du_open(list, path);
+    if (!du || du->n == UINT32_MAX) {
+        return 0;
+    }
+
+    const char *copy = listing_add_name(list, name);
+    return du_push(du, (struct duitem){.name = copy, .idx = i}, false);
+}
+
+/**
+ * Adds directory i of list, which is in path, with the size that was counted
+ * before its listing got replaced. Returns its slot for direlement.du or 0 if
+ * it has to be counted again.
+ */
+static uint32_t
+du_carry(struct listing *list, const char *path, size_t i, off_t bytes)
+{
+    struct dusizes *du = du_open(list, path);
+    if (!du || du->n == UINT32_MAX || atomic_load(&du->next) != du->n) {
+        return 0;
+    }
+
+    return du_push(du, (struct duitem){.idx = i, .bytes = bytes}, true);
+}
+
+/**
+ * Returns a copy of the sizes du counted so far, by slot - 1, and sets n to
+ * their number, so they survive the listing being replaced
+ */
+static off_t *
+du_results(struct dusizes *du, size_t *n)
+{
+    *n = 0;
+    if (!du) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&du->lock);
+    size_t done  = atomic_load(&du->next);
+    off_t *sizes = malloc((done + 1) * sizeof(*sizes));
+    if (!sizes) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t k = 0; k < done; ++k) {
+        sizes[k] = du->items[k].bytes;
+    }
+    pthread_mutex_unlock(&du->lock);
+
+    *n = done;
+    return sizes;
+}
+
+static const unsigned char *
+read_varint(const unsigned char *p, uint64_t *val)
+{
+    uint64_t res = 0;
+    int shift    = 0;
+
+    do {
+        res |= (uint64_t)(*p & 0x7f) << shift;
+        shift += 7;
+    } while (*p++ & 0x80);
+
+    *val = res;
+    return p;
+}
+
+static unsigned char *
+write_varint(unsigned char *p, uint64_t val)
+{
+    while (val >= 0x80) {
+        *p++ = (val & 0x7f) | 0x80;
+        val >>= 7;
+    }
+    *p++ = val;
+
+    return p;
+}
+
+/**
+ * Appends a zeroed element to list and returns it
+ */
+static struct direlement *
+listing_push(struct listing *list)
+{
+    if (list->n == list->size) {
+        list->size += ENT_ALLOC_NUM;
+        struct direlement *tmp =
+            realloc(list->ents, list->size * sizeof(*tmp));
+        if (!tmp) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        list->ents = tmp;
+        mem_alloc(MEM_ENTRIES, ENT_ALLOC_NUM * sizeof(*tmp));
+    }
+
+    list->ents[list->n] = (struct direlement){0};
+    return &list->ents[list->n++];
+}
+
+/**
+ * Decodes name i of fc into fc->cur_name
+ */
+static const char *
+fc_decode(struct fcnames *fc, size_t i)
+{
+    if (i == fc->cur) {
+        return fc->cur_name;
+    }
+
+    size_t pos;
+    size_t j;
+    if (i > fc->cur && i / FC_RESTART == fc->cur / FC_RESTART) {
+        pos = fc->cur_next; // continue from the last name
+        j   = fc->cur + 1;
+    } else {
+        pos = fc->restarts[i / FC_RESTART];
+        j   = i - i % FC_RESTART;
+    }
+
+    for (; j <= i; ++j) {
+        uint64_t shared;
+        uint64_t len;
+        const unsigned char *p = read_varint(fc->data + pos, &shared);
+        p                      = read_varint(p, &len);
+
+        memcpy(fc->cur_name + shared, p, len);
+        fc->cur_name[shared + len] = '\0';
+        pos                        = p + len - fc->data;
+    }
+
+    fc->cur      = i;
+    fc->cur_next = pos;
+
+    return fc->cur_name;
+}
+
+/**
+ * Returns the name of element i or an empty string if there is none. Names
+ * of compacted listings are only valid until the next call.
+ */
+static const char *
+listing_name(const struct listing *list, size_t i)
+{
+    if (i >= list->n) {
+        return "";
+    }
+
+    if (list->spill) {
+        return list->spill->names + list->spill->offs[i];
+    }
+
+    return list->fc ? fc_decode(list->fc, i) : list->ents[i].name;
+}
+
+/**
+ * Marks or unmarks element i of list in path, keeping list->marks up to date
+ */
+static void
+listing_mark(struct listing *list, const char *path, size_t i, bool on)
+{
+    struct direlement *de = &list->ents[i];
+    struct marks *m       = &list->marks;
+    if (de->is_selected == on) {
+        return;
+    }
+    de->is_selected = on;
+    m->n            = on ? m->n + 1 : m->n - 1;
+
+    if (de->type != TYPE_DIR) {
+        m->bytes += on ? de->size : -de->size;
+        return;
+    }
+    m->dirs = on ? m->dirs + 1 : m->dirs - 1;
+
+    if (de->du == 0 && on) {
+        de->du = du_queue(list, path, i, listing_name(list, i));
+    }
+    if (de->du == 0) {
+        return;
+    }
+
+    if (de->du > list->du->seen) {
+        m->pending = on ? m->pending + 1 : m->pending - 1;
+    } else {
+        off_t bytes = list->du->items[de->du - 1].bytes;
+        m->bytes += on ? bytes : -bytes;
+    }
+}
+
+/**
+ * Recounts the marks of list after its elements were replaced wholesale.
+ * If the elements were copied along with their du slots, the nsizes sizes
+ * from du_results are carried over instead of counting them again.
+ */
+static void
+listing_count_marks(
+    struct listing *list,
+    const char *path,
+    const off_t *sizes,
+    size_t nsizes)
+{
+    du_free(list->du);
+    list->du    = NULL;
+    list->marks = (struct marks){0};
+
+    // carried sizes first, since items before those to count have to be done
+    for (size_t i = 0; i < list->n; ++i) {
+        struct direlement *de = &list->ents[i];
+        uint32_t slot         = de->du;
+        de->du                = 0;
+        if (de->is_selected && de->type == TYPE_DIR && slot > 0 &&
+            slot <= nsizes) {
+            de->du = du_carry(list, path, i, sizes[slot - 1]);
+        }
+    }
+
+    for (size_t i = 0; i < list->n; ++i) {
+        struct direlement *de = &list->ents[i];
+        if (de->is_selected) {
+            de->is_selected = false;
+            listing_mark(list, path, i, true);
+        }
+    }
+}
+
+/**
+ * Adds the sizes of directories that were counted since the last call to the
+ * marks of list. Returns whether any were.
+ */
+static bool
+listing_poll_marks(struct listing *list)
+{
+    struct dusizes *du = list->du;
+    if (!du) {
+        return false;
+    }
+
+    size_t done  = atomic_load(&du->next);
+    bool changed = du->seen < done;
+    for (; du->seen < done; ++du->seen) {
+        const struct duitem *item = &du->items[du->seen];
+        if (list->ents[item->idx].is_selected) {
+            list->marks.bytes += item->bytes;
+            --list->marks.pending;
+        }
+    }
+
+    return changed;
+}
+
+/**
+ * Frees the element array of list, which must not be mapped from disk
+ */
+static void
+listing_free_ents(struct listing *list)
+{
+    mem_free(MEM_ENTRIES, list->size * sizeof(*list->ents));
+    free(list->ents);
+    list->ents = NULL;
+    list->size = 0;
+}
+
+static void
+fc_free(struct fcnames *fc)
+{
+    if (fc) {
+        mem_free(MEM_NAMES, fc->bytes);
+        free(fc->data);
+        free(fc->restarts);
+        free(fc);
+    }
+}
+
+/**
+ * Moves the names of a sorted listing into front coded storage
+ */
+static void
+listing_compact(struct listing *list)
+{
+    struct fcnames *fc = calloc(1, sizeof(*fc));
+    size_t nrestarts   = (list->n + FC_RESTART - 1) / FC_RESTART;
+    size_t size        = 0;
+    size_t cap         = list->n * 8 + 64;
+    if (fc) {
+        fc->restarts = malloc((nrestarts + 1) * sizeof(*fc->restarts));
+        fc->data     = malloc(cap);
+    }
+    if (!fc || !fc->restarts || !fc->data) {
+        fc_free(fc);
+        return; // stay uncompacted
+    }
+
+    const char *prev = "";
+    for (size_t i = 0; i < list->n; ++i) {
+        const char *name = list->ents[i].name;
+        size_t shared    = 0;
+
+        if (i % FC_RESTART == 0) {
+            fc->restarts[i / FC_RESTART] = size;
+        } else {
+            while (prev[shared] && prev[shared] == name[shared]) {
+                ++shared;
+            }
+        }
+
+        size_t len = strlen(name + shared);
+        if (size + len + 20 > cap) {
+            cap                = cap * 2 + len + 20;
+            unsigned char *tmp = realloc(fc->data, cap);
+            if (!tmp) {
+                fc_free(fc);
+                return;
+            }
+            fc->data = tmp;
+        }
+
+        unsigned char *p = write_varint(fc->data + size, shared);
+        p                = write_varint(p, len);
+        memcpy(p, name + shared, len);
+        size = p + len - fc->data;
+        prev = name;
+    }
+
+    unsigned char *data = realloc(fc->data, size ? size : 1);
+    if (data) {
+        fc->data = data;
+    }
+    fc->n     = list->n;
+    fc->cur   = SIZE_MAX;
+    fc->bytes = sizeof(*fc) + size + (nrestarts + 1) * sizeof(*fc->restarts);
+    mem_alloc(MEM_NAMES, fc->bytes);
+
+    arena_free(&list->arena);
+    for (size_t i = 0; i < list->n; ++i) {
+        list->ents[i].name   = NULL;
+        list->ents[i].target = NULL;
+    }
+    list->fc = fc;
+}
+
+/**
+ * Moves the names of a compacted listing back into plain storage, for
+ * operations that need all of them at once.
+ *
+ * Returns false for spilled listings, which are too large for that.
+ */
+static bool
+listing_expand(struct listing *list)
+{
+    struct fcnames *fc = list->fc;
+    if (list->spill) {
+        return false;
+    }
+    if (!fc) {
+        return true;
+    }
+
+    list->fc = NULL;
+    for (size_t i = 0; i < list->n; ++i) {
+        list->ents[i].name = listing_add_name(list, fc_decode(fc, i));
+    }
+    fc_free(fc);
+
+    return true;
+}
+
+/**
+ * Finds the element called name using binary search. For compacted listings
+ * only restart points get compared until the block is known.
+ *
+ * Returns the index or list->n if there is no such element.
+ */
+static size_t
+listing_find(const struct listing *list, const char *name, bool is_dir)
+{
+    size_t stride = list->fc ? FC_RESTART : 1;
+    size_t lo     = 0;
+    size_t hi     = (list->n + stride - 1) / stride;
+
+    // first block whose head sorts after name
+    while (lo < hi) {
+        size_t mid                  = lo + (hi - lo) / 2;
+        const struct direlement *de = &list->ents[mid * stride];
+        bool de_is_dir = de->type == TYPE_DIR || de->type == TYPE_SYML_TO_DIR;
+
+        int diff;
+        if (is_dir != de_is_dir) {
+            diff = is_dir ? -1 : 1;
+        } else {
+            diff = strnatcmp(name, listing_name(list, mid * stride));
+        }
+
+        if (diff < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    if (lo == 0) {
+        return list->n;
+    }
+
+    size_t end = lo * stride < list->n ? lo * stride : list->n;
+    for (size_t i = (lo - 1) * stride; i < end; ++i) {
+        if (strcmp(listing_name(list, i), name) == 0) {
+            return i;
+        }
+    }
+
+    return list->n;
+}
+
+static void
+spill_free(struct spill *sp)
+{
+    if (!sp) {
+        return;
+    }
+
+    if (sp->ents) {
+        munmap(sp->ents, sp->ents_size);
+    }
+    if (sp->offs) {
+        munmap(sp->offs, sp->offs_size);
+    }
+    if (sp->names) {
+        munmap(sp->names, sp->names_size);
+    }
+    free(sp);
+}
+
+static void
+statjob_release(struct statjob *job)
+{
+    pthread_mutex_lock(&job->lock);
+    bool last = --job->refs == 0;
+    pthread_mutex_unlock(&job->lock);
+
+    if (last) {
+        close(job->fd);
+        pthread_mutex_destroy(&job->lock);
+        pthread_cond_destroy(&job->cond);
+        free(job->res);
+        free(job->names);
+        free(job->dir);
+        free(job);
+    }
+}
+
+/**
+ * Removes all elements and names from list, keeping the element array unless
+ * it was mapped from disk or is big enough to be worth giving back
+ */
+static void
+listing_clear(struct listing *list)
+{
+    if (list->spill) {
+        spill_free(list->spill);
+        list->spill = NULL;
+        list->ents  = NULL;
+        list->size  = 0;
+    } else if (list->size > ENT_KEEP_MAX) {
+        listing_free_ents(list);
+    }
+
+    // the worker counting sizes reads names from the arena
+    du_free(list->du);
+    list->du    = NULL;
+    list->marks = (struct marks){0};
+
+    arena_free(&list->arena);
+
+    while (list->late) {
+        struct statjob *next = list->late->late_next;
+        statjob_release(list->late);
+        list->late = next;
+    }
+
+    if (list->has_dirfd) {
+        close(list->dirfd);
+        list->has_dirfd = false;
+    }
+
+    fc_free(list->fc);
+    list->fc     = NULL;
+    list->n      = 0;
+    list->sorted = false;
+    ++list->gen;
+}
+
+/**
+ * Creates an unlinked temporary file to spill listings to. It goes into
+ * TMPDIR or /var/tmp, since /tmp is often kept in memory.
+ */
+static FILE *
+spill_tmpfile(void)
+{
+    const char *dir = getenv("TMPDIR");
+    char tmpl[PATH_MAX];
+    snprintf(
+        tmpl, sizeof(tmpl), "%s/filet-XXXXXX", dir && *dir ? dir : "/var/tmp");
+
+    int fd = mkstemp(tmpl);
+    if (fd < 0) {
+        return NULL;
+    }
+    unlink(tmpl);
+
+    FILE *f = fdopen(fd, "w+");
+    if (!f) {
+        close(fd);
+    }
+
+    return f;
+}
+
+/**
+ * Returns the number of bytes a listing may take before it gets spilled, 0
+ * for no limit. That's what is left of the memory budget, counting the link
+ * cache as free since it is dropped to make room, but at least a quarter of
+ * it so runs don't shrink to nothing.
+ */
+static size_t
+spill_budget(void)
+{
+    size_t budget = g_mem_budget;
+    size_t others = mem_used(MEM_LINKS);
+    size_t least  = budget / 4;
+
+    return others + least < budget ? budget - others : least;
+}
+
+/**
+ * Sorts the elements of list, appends them to the run file as a new run and
+ * clears list
+ */
+static bool
+spill_add_run(struct listing *list, struct spillruns *runs)
+{
+    if (!runs->file && !(runs->file = spill_tmpfile())) {
+        return false;
+    }
+
+    off_t *tmp = realloc(runs->bounds, (runs->n + 2) * sizeof(*tmp));
+    if (!tmp) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    runs->bounds = tmp;
+    if (runs->n == 0) {
+        runs->bounds[0] = 0;
+    }
+
+    qsort(list->ents, list->n, sizeof(*list->ents), direlemcmp);
+    for (size_t i = 0; i < list->n; ++i) {
+        uint16_t len = strlen(list->ents[i].name);
+        fwrite(&list->ents[i], sizeof(list->ents[i]), 1, runs->file);
+        fwrite(&len, sizeof(len), 1, runs->file);
+        fwrite(list->ents[i].name, 1, len, runs->file);
+    }
+    if (fflush(runs->file) != 0) {
+        return false;
+    }
+
+    runs->bounds[++runs->n] = ftello(runs->file);
+    listing_clear(list);
+
+    return true;
+}
+
+static void
+spill_runs_free(struct spillruns *runs)
+{
+    if (runs->file) {
+        fclose(runs->file);
+    }
+    free(runs->bounds);
+    *runs = (struct spillruns){0};
+}
+
+/**
+ * Reads len bytes of run through its buffer
+ */
+static bool
+spill_run_read(int fd, struct spillrun *run, void *dst, size_t len)
+{
+    unsigned char *out = dst;
+
+    while (len > 0) {
+        if (run->at == run->len) {
+            size_t want = run->cap;
+            if ((off_t)want > run->end - run->pos) {
+                want = run->end - run->pos;
+            }
+
+            ssize_t got = want > 0 ? pread(fd, run->buf, want, run->pos) : 0;
+            if (got <= 0) {
+                return false;
+            }
+            run->pos += got;
+            run->len = got;
+            run->at  = 0;
+        }
+
+        size_t n = run->len - run->at < len ? run->len - run->at : len;
+        memcpy(out, run->buf + run->at, n);
+        run->at += n;
+        out += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+/**
+ * Moves run to its next element. Returns false once it is exhausted.
+ */
+static bool
+spill_run_next(int fd, struct spillrun *run)
+{
+    uint16_t len;
+    if (!spill_run_read(fd, run, &run->de, sizeof(run->de)) ||
+        !spill_run_read(fd, run, &len, sizeof(len)) || len > NAME_MAX ||
+        !spill_run_read(fd, run, run->name, len)) {
+        return false;
+    }
+
+    run->name[len] = '\0';
+    run->de.name   = run->name;
+
+    return true;
+}
+
+/**
+ * Restores the heap order of the run indices in heap below i
+ */
+static void
+spill_sift(const struct spillrun *runs, size_t *heap, size_t n, size_t i)
+{
+    for (;;) {
+        size_t min = i;
+        size_t l   = 2 * i + 1;
+        size_t r   = 2 * i + 2;
+
+        if (l < n && direlemcmp(&runs[heap[l]].de, &runs[heap[min]].de) < 0) {
+            min = l;
+        }
+        if (r < n && direlemcmp(&runs[heap[r]].de, &runs[heap[min]].de) < 0) {
+            min = r;
+        }
+        if (min == i) {
+            return;
+        }
+
+        size_t tmp = heap[i];
+        heap[i]    = heap[min];
+        heap[min]  = tmp;
+        i          = min;
+    }
+}
+
+/**
+ * Maps len bytes of f. The elements are mapped copy-on-write so they can be
+ * marked without touching the file.
+ */
+static void *
+spill_map(FILE *f, size_t len, bool writable)
+{
+    void *p = mmap(
+        NULL,
+        len,
+        writable ? PROT_READ | PROT_WRITE : PROT_READ,
+        MAP_PRIVATE,
+        fileno(f),
+        0);
+
+    return p == MAP_FAILED ? NULL : p;
+}
+
+/**
+ * Merges all runs into one sorted listing on disk and maps it into list. The
+ * merge buffers share the memory budget, everything else is left to the page
+ * cache.
+ */
+static bool
+spill_merge(struct listing *list, struct spillruns *runs, size_t budget)
+{
+    int fd             = fileno(runs->file);
+    struct spill *sp   = calloc(1, sizeof(*sp));
+    struct spillrun *r = calloc(runs->n, sizeof(*r));
+    size_t *heap       = malloc(runs->n * sizeof(*heap));
+    if (!sp || !r || !heap) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t cap = budget / runs->n;
+    cap        = cap < 4096 ? 4096 : cap;
+    size_t hn  = 0;
+    for (size_t i = 0; i < runs->n; ++i) {
+        r[i].pos = runs->bounds[i];
+        r[i].end = runs->bounds[i + 1];
+        r[i].cap = cap;
+        r[i].buf = malloc(cap);
+        if (!r[i].buf) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        if (spill_run_next(fd, &r[i])) {
+            heap[hn++] = i;
+        }
+    }
+    for (size_t i = hn / 2; i-- > 0;) {
+        spill_sift(r, heap, hn, i);
+    }
+
+    FILE *ents  = spill_tmpfile();
+    FILE *offs  = spill_tmpfile();
+    FILE *names = spill_tmpfile();
+    size_t n    = 0;
+    uint64_t at = 0;
+    bool ok     = ents && offs && names;
+
+    while (ok && hn > 0) {
+        struct spillrun *top = &r[heap[0]];
+        struct direlement de = top->de;
+        size_t len           = strlen(top->name) + 1;
+
+        de.name   = NULL;
+        de.target = NULL;
+        fwrite(&de, sizeof(de), 1, ents);
+        fwrite(&at, sizeof(at), 1, offs);
+        fwrite(top->name, 1, len, names);
+        at += len;
+        ++n;
+
+        if (!spill_run_next(fd, top)) {
+            heap[0] = heap[--hn];
+        }
+        spill_sift(r, heap, hn, 0);
+    }
+
+    ok = ok && fflush(ents) == 0 && fflush(offs) == 0 && fflush(names) == 0;
+    if (ok && n > 0) {
+        sp->ents_size  = n * sizeof(*sp->ents);
+        sp->offs_size  = n * sizeof(*sp->offs);
+        sp->names_size = at;
+        sp->ents       = spill_map(ents, sp->ents_size, true);
+        sp->offs       = spill_map(offs, sp->offs_size, false);
+        sp->names      = spill_map(names, sp->names_size, false);
+        ok             = sp->ents && sp->offs && sp->names;
+    }
+
+    for (size_t i = 0; i < runs->n; ++i) {
+        free(r[i].buf);
+    }
+    free(r);
+    free(heap);
+    FILE *files[] = {ents, offs, names};
+    for (size_t i = 0; i < 3; ++i) {
+        if (files[i]) {
+            fclose(files[i]);
+        }
+    }
+
+    if (!ok || n == 0) {
+        spill_free(sp);
+        return ok;
+    }
+
+    listing_clear(list);
+    listing_free_ents(list);
+    list->ents  = sp->ents;
+    list->size  = 0;
+    list->n     = n;
+    list->spill = sp;
+
+    return true;
+}
+
+/**
+ * Spills the remaining elements of list as the last run and replaces list
+ * with the merge of all runs
+ */
+static bool
+spill_finish(struct listing *list, struct spillruns *runs, size_t budget)
+{
+    bool ok = spill_add_run(list, runs);
+
+    // the element array is not needed until the merged listing is mapped
+    listing_free_ents(list);
+
+    ok = ok && spill_merge(list, runs, budget);
+    spill_runs_free(runs);
+
+    return ok;
+}
+
+/**
+ * Sets the terminal size on row
+ */
+static bool
+get_term_size(int *row, int *col)
+{
+    struct winsize wsize;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &wsize) < 0) {
+        perror("ioctl");
+        return false;
+    }
+
+    *row = wsize.ws_row;
+    *col = wsize.ws_col;
+
+    return true;
+}
+
+/**
+ * Used as SIGWINCH (terminal resize handler)
+ */
+static void
+handle_winch(int UNUSED(sig))
+{
+    g_needs_redraw = true;
+}
+
+/**
+ * Used for SIGINT and SIGTERM to pass the exit signal to main()
+ */
+static void
+handle_exit(int UNUSED(sig))
+{
+    g_quit = true;
+}
+
+/**
+ * Saves the current session (current path and selected file)
+ * to /tmp/filet_dir and /tmp/filet_sel
+ */
+static void
+save_session(const char *path, const char *sel_name)
+{
+    FILE *f = fopen("/tmp/filet_dir", "w");
+    if (f) {
+        fprintf(f, "%s\n", path);
+        fclose(f);
+    }
+    f = fopen("/tmp/filet_sel", "w");
+    if (f) {
+        fprintf(f, "%s/%s\n", path, sel_name);
+        fclose(f);
+    }
+}
+
+/**
+ * Resets the terminal to its prior state
+ */
+static void
+restore_terminal(void)
+{
+    // let the answer to a pending probe arrive, so it is flushed below
+    if (g_pacer.probing) {
+        struct pollfd pfd = {.fd = STDIN_FILENO, .events = POLLIN};
+        poll(&pfd, 1, PACE_SETTLE_MS);
+        g_pacer.probing = false;
+    }
+
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &g_old_termios) < 0) {
+        perror("tcsetattr");
+    }
+
+    printf(
+        "\033[?7h"    // enable line wrapping
+        "\033[?25h"   // unhide cursor
+        "\033[;r"     // reset scroll region
+        "\033[?1049l" // restore main screen
+    );
+}
+
+/**
+ * Saves old terminal configuration to reset on SIGINT or SIGTERM
+ * restore_terminal will use this to restore the settings.
+ */
+static bool
+get_termios(void)
+{
+    if (tcgetattr(STDIN_FILENO, &g_old_termios) < 0) {
+        perror("tcgetattr");
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Sets up the terminal for TUI use (read every char, differentiate \r and \n,
+ * don't echo, hide the cursor, fix a scroll region, switch to a second screen)
+ */
+static bool
+setup_terminal(int row)
+{
+    setvbuf(stdout, NULL, _IOFBF, 0);
+
+    struct termios raw = g_old_termios;
+    raw.c_oflag &= ~OPOST;
+    raw.c_lflag &= ~(ECHO | ICANON);
+
+    if (tcsetattr(STDIN_FILENO, TCSANOW, &raw) < 0) {
+        perror("tcsetattr");
+        return false;
+    }
+
+    printf(
+        "\033[?1049h" // use alternative screen buffer
+        "\033[?7l"    // diable line wrapping
+        "\033[?25l"   // hide cursor
+        "\033[2J"     // clear screen
+        "\033[3;%dr", // limit scrolling to scrolling area
+        row);
+
+    return true;
+}
+
+/**
+ * Whether the entry name belongs into a listing
+ */
+static bool
+is_listed(const char *name, bool show_hidden)
+{
+    if (name[0] == '.' &&
+        (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+        return false;
+    }
+
+    return show_hidden || name[0] != '.';
+}
+
+/**
+ * Fills in type, size and mtime of de from the entry name of the directory
+ * fd. Returns false if it vanished.
+ */
+static bool
+stat_element(int fd, const char *name, struct direlement *de)
+{
+    struct stat sb;
+    if (fstatat(fd, name, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
+        return false;
+    }
+
+    de->size  = sb.st_size;
+    de->mtime = sb.st_mtim;
+    de->ino   = sb.st_ino;
+
+    if (S_ISDIR(sb.st_mode)) {
+        de->type = TYPE_DIR;
+    } else if (S_ISLNK(sb.st_mode)) {
+        // needed anyway to sort links to directories with the directories
+        if (fstatat(fd, name, &sb, 0) < 0) {
+            de->type = TYPE_SYML_BROKEN;
+        } else if (S_ISDIR(sb.st_mode)) {
+            de->type = TYPE_SYML_TO_DIR;
+        } else {
+            de->type = TYPE_SYML;
+        }
+    } else {
+        if (sb.st_mode & S_IXUSR) {
+            de->type = TYPE_EXEC;
+        } else {
+            de->type = TYPE_NORM;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Appends an element called name to list, leaving type, size and mtime to
+ * the caller
+ */
+static struct direlement *
+new_element(struct listing *list, const char *name)
+{
+    struct direlement *de = listing_push(list);
+    de->name              = listing_add_name(list, name);
+    de->is_selected       = false;
+    de->cmp               = CMP_NONE;
+
+    return de;
+}
+
+/**
+ * Returns the type d_type tells, TYPE_UNKNOWN if the entry has to be stat'ed
+ */
+static int
+dtype_type(unsigned char d_type)
+{
+    switch (d_type) {
+    case DT_DIR:
+        return TYPE_DIR;
+    case DT_LNK: // FALLTHROUGH
+    case DT_UNKNOWN:
+        return TYPE_UNKNOWN;
+    default:
+        return TYPE_NORM;
+    }
+}
+
+/**
+ * Joins dir and name without touching the filesystem, unlike resolve_path
+ */
+static bool
+join_path(const char *dir, const char *name, char *joined)
+{
+    int len = snprintf(
+        joined, PATH_MAX, "%s/%s", strcmp(dir, "/") == 0 ? "" : dir, name);
+
+    return len > 0 && len < PATH_MAX;
+}
+
+/**
+ * Appends ent to list. The stat is left to load_batch, unless d_type is
+ * enough for the loader.
+ */
+static void
+new_pending(
+    struct listing *list, const struct dirent *ent, const struct loader *ld)
+{
+    struct direlement *de = new_element(list, ent->d_name);
+    de->size              = 0;
+    de->mtime             = (struct timespec){0};
+    de->type              = TYPE_UNKNOWN;
+    if (ld->kind == LOADER_DTYPE) {
+        de->type    = dtype_type(ent->d_type);
+        de->no_stat = de->type != TYPE_UNKNOWN;
+    }
+}
+
+/**
+ * Returns the slow entry path or NULL
+ */
+static struct slowpath *
+slow_find(const char *path)
+{
+    for (size_t i = 0; i < g_nslow; ++i) {
+        if (strcmp(g_slow[i].path, path) == 0) {
+            return &g_slow[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Remembers the entry name of dir as hanging
+ */
+static void
+slow_add(const char *dir, const char *name)
+{
+    char path[PATH_MAX];
+    if (!join_path(dir, name, path) || slow_find(path)) {
+        return;
+    }
+
+    // when full, the latest entry gets replaced
+    struct slowpath *sp = &g_slow[g_nslow < SLOW_MAX ? g_nslow++ : g_nslow - 1];
+    strcpy(sp->path, path);
+    sp->since = time(NULL);
+}
+
+static void
+slow_remove(const char *dir, const char *name)
+{
+    char path[PATH_MAX];
+    struct slowpath *sp;
+    if (join_path(dir, name, path) && (sp = slow_find(path))) {
+        *sp = g_slow[--g_nslow];
+    }
+}
+
+/**
+ * Whether path is a hanging entry or below one
+ */
+static bool
+slow_below(const char *path)
+{
+    for (size_t i = 0; i < g_nslow; ++i) {
+        size_t len = strlen(g_slow[i].path);
+        if (strncmp(path, g_slow[i].path, len) == 0 &&
+            (path[len] == '\0' || path[len] == '/')) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Whether the hanging entry name of dir should be left alone for now
+ */
+static bool
+slow_skip(const char *dir, const char *name)
+{
+    char path[PATH_MAX];
+    struct slowpath *sp;
+    if (!join_path(dir, name, path) || !(sp = slow_find(path))) {
+        return false;
+    }
+
+    if (time(NULL) - sp->since < SLOW_RETRY_S) {
+        return true;
+    }
+    sp->since = time(NULL); // give it another chance
+
+    return false;
+}
+
+static void *
+statjob_worker(void *arg)
+{
+    struct statjob *job = arg;
+
+    pthread_mutex_lock(&job->lock);
+    struct statworker *w = &job->workers[job->nworkers++];
+    --job->starting;
+    while (job->next < job->n) {
+        struct statresult *r = &job->res[job->next++];
+        w->busy              = true;
+        clock_gettime(CLOCK_MONOTONIC, &w->since);
+        pthread_mutex_unlock(&job->lock);
+
+        struct direlement de;
+        bool ok = stat_element(job->fd, r->name, &de);
+
+        pthread_mutex_lock(&job->lock);
+        r->de   = de;
+        r->ok   = ok;
+        r->done = true;
+        w->busy = false;
+        ++job->finished;
+        if ((size_t)(r - job->res) < job->nwait &&
+            ++job->waited == job->nwait) {
+            pthread_cond_broadcast(&job->cond); // the waiter ticks otherwise
+        }
+    }
+    pthread_mutex_unlock(&job->lock);
+
+    statjob_release(job);
+
+    return NULL;
+}
+
+/**
+ * Starts another worker for job. Returns false if there are enough.
+ */
+static bool
+statjob_spawn(struct statjob *job)
+{
+    if (job->nworkers + job->starting >= STAT_MAX_WORKERS) {
+        return false;
+    }
+
+    pthread_t thread;
+    ++job->refs;
+    ++job->starting;
+    if (pthread_create(&thread, NULL, statjob_worker, job) != 0) {
+        --job->refs;
+        --job->starting;
+        return false;
+    }
+    pthread_detach(thread);
+
+    return true;
+}
+
+/**
+ * Waits until every entry of job before nwait is stat'ed or hangs in a
+ * worker for longer than STAT_DEADLINE_MS. Hanging workers are replaced, so
+ * the remaining entries still get their turn. Entries that hung before are
+ * left to the workers once the others are done.
+ */
+static void
+statjob_wait(struct statjob *job, size_t nthreads)
+{
+    pthread_mutex_lock(&job->lock);
+    for (size_t i = 0; i < nthreads && i < job->n; ++i) {
+        statjob_spawn(job);
+    }
+
+    while (job->waited < job->nwait) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        // workers that are still starting or making progress
+        size_t live = job->starting;
+        for (size_t i = 0; i < job->nworkers; ++i) {
+            struct statworker *w = &job->workers[i];
+            long ms              = (now.tv_sec - w->since.tv_sec) * 1000 +
+                      (now.tv_nsec - w->since.tv_nsec) / 1000000;
+            live += w->busy && ms < STAT_DEADLINE_MS;
+        }
+
+        if (live == 0 && (job->next >= job->nwait || !statjob_spawn(job))) {
+            break; // everything left hangs
+        }
+
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += STAT_TICK_MS * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_nsec -= 1000000000L;
+            ++until.tv_sec;
+        }
+        pthread_cond_timedwait(&job->cond, &job->lock, &until);
+    }
+    pthread_mutex_unlock(&job->lock);
+}
+
+/**
+ * Creates a job for stat'ing up to cap entries of the directory fd, whose
+ * names take up to names bytes
+ */
+static struct statjob *
+statjob_new(const char *dir, int fd, size_t cap, size_t names)
+{
+    struct statjob *job = calloc(1, sizeof(*job));
+    if (!job || !(job->res = calloc(cap, sizeof(*job->res))) ||
+        !(job->names = malloc(names)) || !(job->dir = strdup(dir))) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->cond, NULL);
+    job->fd   = dup(fd);
+    job->refs = 1;
+
+    return job;
+}
+
+/**
+ * Stats the pending elements of list from *start on in worker threads and
+ * drops the ones that vanished. Elements whose stat hangs stay pending and
+ * are finished in the background by listing_poll_late.
+ */
+static void
+load_batch(
+    struct listing *list,
+    const char *path,
+    int fd,
+    size_t *start,
+    const struct loader *ld)
+{
+    size_t names = 0;
+    for (size_t i = *start; i < list->n; ++i) {
+        if (list->ents[i].type == TYPE_UNKNOWN) {
+            names += strlen(list->ents[i].name) + 1;
+        }
+    }
+    if (names == 0) {
+        *start = list->n;
+        return;
+    }
+
+    size_t cap          = list->n - *start;
+    struct statjob *job = statjob_new(path, fd, cap, names);
+    size_t *idx         = malloc(cap * sizeof(*idx));
+    if (!idx) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    // the names are copied, workers may outlive the listing. Entries that
+    // hung before are gathered at the end and aren't waited for.
+    char *p     = job->names;
+    size_t back = cap;
+    for (size_t i = *start; i < list->n; ++i) {
+        const char *name = list->ents[i].name;
+        if (list->ents[i].type == TYPE_UNKNOWN) {
+            size_t j         = slow_skip(path, name) ? --back : job->n++;
+            job->res[j].name = strcpy(p, name);
+            idx[j]           = i;
+            p += strlen(name) + 1;
+        }
+    }
+    job->nwait = job->n;
+    memmove(
+        job->res + job->n, job->res + back, (cap - back) * sizeof(*job->res));
+    memmove(idx + job->n, idx + back, (cap - back) * sizeof(*idx));
+    job->n += cap - back;
+
+    statjob_wait(job, ld->threads);
+
+    pthread_mutex_lock(&job->lock);
+    size_t late = 0;
+    for (size_t j = 0; j < job->n; ++j) {
+        struct statresult *r  = &job->res[j];
+        struct direlement *de = &list->ents[idx[j]];
+        if (!r->done) {
+            r->pending = true;
+            slow_add(path, r->name);
+            ++late;
+        } else if (r->ok) {
+            de->type  = r->de.type;
+            de->size  = r->de.size;
+            de->mtime = r->de.mtime;
+            de->ino   = r->de.ino;
+        } else {
+            de->name = NULL; // vanished
+        }
+    }
+    pthread_mutex_unlock(&job->lock);
+    free(idx);
+
+    size_t kept = *start;
+    for (size_t i = *start; i < list->n; ++i) {
+        if (list->ents[i].name) {
+            list->ents[kept++] = list->ents[i];
+        }
+    }
+    list->n = kept;
+    *start  = kept;
+
+    if (late > 0) {
+        job->late_next = list->late;
+        list->late     = job;
+    } else {
+        statjob_release(job);
+    }
+}
+
+/**
+ * Moves element i of a sorted list to where it belongs now that its type is
+ * known, keeping the directory sizes pointing at their elements
+ */
+static void
+listing_resort(struct listing *list, size_t i)
+{
+    struct direlement de = list->ents[i];
+    size_t to            = i;
+    while (to > 0 && direlemcmp(&list->ents[to - 1], &de) > 0) {
+        --to;
+    }
+    while (to + 1 < list->n && direlemcmp(&list->ents[to + 1], &de) < 0) {
+        ++to;
+    }
+    if (to == i) {
+        return;
+    }
+
+    if (to < i) {
+        memmove(&list->ents[to + 1], &list->ents[to], (i - to) * sizeof(de));
+    } else {
+        memmove(&list->ents[i], &list->ents[i + 1], (to - i) * sizeof(de));
+    }
+    list->ents[to] = de;
+
+    struct dusizes *du = list->du;
+    if (!du) {
+        return;
+    }
+    pthread_mutex_lock(&du->lock);
+    for (size_t k = 0; k < du->n; ++k) {
+        size_t *idx = &du->items[k].idx;
+        if (*idx == i) {
+            *idx = to;
+        } else if (to < i && *idx >= to && *idx < i) {
+            ++*idx;
+        } else if (to > i && *idx > i && *idx <= to) {
+            --*idx;
+        }
+    }
+    pthread_mutex_unlock(&du->lock);
+}
+
+/**
+ * Fills in elements of list whose stat hung once it returned and sorts them
+ * in if resort is set. Jobs whose workers hold the lock right now are left
+ * for the next call. Returns whether anything changed.
+ */
+static bool
+listing_poll_late(struct listing *list, bool resort)
+{
+    bool changed = false;
+
+    for (struct statjob **jp = &list->late; *jp;) {
+        struct statjob *job = *jp;
+
+        if (pthread_mutex_trylock(&job->lock) != 0) {
+            jp = &job->late_next;
+            continue;
+        }
+        for (size_t j = 0; j < job->n; ++j) {
+            struct statresult *r = &job->res[j];
+            if (!r->pending || !r->done) {
+                continue;
+            }
+            r->pending = false;
+
+            // elements may have moved while sorting, but there are few
+            for (size_t i = 0; !list->spill && i < list->n; ++i) {
+                struct direlement *de = &list->ents[i];
+                if (de->type == TYPE_UNKNOWN &&
+                    strcmp(listing_name(list, i), r->name) == 0) {
+                    bool marked = de->is_selected;
+                    listing_mark(list, job->dir, i, false);
+                    de->type    = r->ok ? r->de.type : TYPE_NORM;
+                    de->size    = r->ok ? r->de.size : 0;
+                    de->mtime   = r->ok ? r->de.mtime : (struct timespec){0};
+                    de->ino     = r->ok ? r->de.ino : 0;
+                    de->no_stat = !r->ok;
+                    listing_mark(list, job->dir, i, marked);
+                    if (resort && list->sorted && !list->fc) {
+                        listing_resort(list, i);
+                    }
+                    changed = true;
+                    break;
+                }
+            }
+            slow_remove(job->dir, r->name);
+        }
+        bool all = job->finished == job->n;
+        pthread_mutex_unlock(&job->lock);
+
+        if (all) {
+            *jp = job->late_next;
+            statjob_release(job);
+        } else {
+            jp = &job->late_next;
+        }
+    }
+
+    return changed;
+}
+
+static const char *loader_kinds[] = {
+    [LOADER_STAT]  = "stat",
+    [LOADER_DTYPE] = "dtype",
+};
+
+/**
+ * Returns the loader for filesystems of type fstype, as told by statfs
+ */
+static struct loader
+loader_match(unsigned long fstype)
+{
+    static const struct loader fstypes[] = {
+        {0xEF53, "ext4", LOADER_STAT, 1},
+        {0x58465342, "xfs", LOADER_STAT, 1},
+        {0x9123683E, "btrfs", LOADER_STAT, 1},
+        {0x01021994, "tmpfs", LOADER_STAT, 1},
+        // READDIRPLUS already fetched the attributes in readdir order
+        {0x6969, "nfs", LOADER_STAT, 1},
+        {0x65735546, "fuse", LOADER_STAT, LOADER_THREADS},
+        {0x00C36400, "ceph", LOADER_STAT, LOADER_THREADS},
+        {0xFE534D42, "smb2", LOADER_STAT, 8},
+        {0xFF534D42, "cifs", LOADER_STAT, 8},
+        {0x01021997, "9p", LOADER_STAT, 8},
+        {0x9FA0, "proc", LOADER_DTYPE, 1},
+        {0x62656572, "sysfs", LOADER_DTYPE, 1},
+        {0x64626720, "debugfs", LOADER_DTYPE, 1},
+        {0x27E0EB, "cgroup", LOADER_DTYPE, 1},
+        {0x63677270, "cgroup2", LOADER_DTYPE, 1},
+    };
+
+    struct loader ld = {fstype, "unknown", LOADER_STAT, 1};
+    for (size_t i = 0; i < sizeof(fstypes) / sizeof(*fstypes); ++i) {
+        if (fstypes[i].fstype == fstype) {
+            ld = fstypes[i];
+            break;
+        }
+    }
+
+    return ld;
+}
+
+/**
+ * Looks up the loader for the filesystem of the directory fd. Choices are
+ * cached per device.
+ */
+static struct loader
+loader_lookup(int fd)
+{
+    static struct {
+        dev_t dev;
+        struct loader ld;
+    } cache[LOADER_CACHE];
+    static size_t ncached;
+
+    struct stat sb;
+    if (fstat(fd, &sb) < 0) {
+        return (struct loader){0, "unknown", LOADER_STAT, 1};
+    }
+
+    for (size_t i = 0; i < ncached && i < LOADER_CACHE; ++i) {
+        if (cache[i].dev == sb.st_dev) {
+            return cache[i].ld;
+        }
+    }
+
+    struct loader ld = {0, "unknown", LOADER_STAT, 1};
+    struct statfs fs;
+    if (fstatfs(fd, &fs) == 0) {
+        ld = loader_match(fs.f_type);
+    }
+
+    cache[ncached % LOADER_CACHE].dev = sb.st_dev;
+    cache[ncached % LOADER_CACHE].ld  = ld;
+    ++ncached;
+
+    return ld;
+}
+
+/**
+ * Picks the loader for the directory fd. FILET_LOADER can force one as
+ * "kind" or "kind:threads", the filesystem's number of threads is kept
+ * otherwise.
+ */
+static struct loader
+loader_for(int fd)
+{
+    struct loader ld = loader_lookup(fd);
+
+    const char *env = getenv("FILET_LOADER");
+    for (size_t i = 0; env && i < sizeof(loader_kinds) / sizeof(*loader_kinds);
+         ++i) {
+        size_t len = strlen(loader_kinds[i]);
+        if (strncmp(env, loader_kinds[i], len) != 0 ||
+            (env[len] != '\0' && env[len] != ':')) {
+            continue;
+        }
+
+        ld.kind = i;
+        if (env[len] == ':') {
+            ld.threads = strtoul(env + len + 1, NULL, 10);
+            ld.threads = ld.threads > 0 ? ld.threads : 1;
+        }
+    }
+
+    return ld;
+}
+
+static uint32_t
+load_be32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+           p[3];
+}
+
+/**
+ * Finds the repository path is in. Returns false if there is none.
+ */
+static bool
+git_find(const char *path, char *root, char *gitdir)
+{
+    snprintf(root, PATH_MAX, "%s", path);
+
+    for (;;) {
+        struct stat sb;
+        if (join_path(root, ".git", gitdir) && stat(gitdir, &sb) == 0) {
+            if (S_ISDIR(sb.st_mode)) {
+                return true;
+            }
+
+            // worktrees and submodules point to their git directory
+            char line[PATH_MAX];
+            FILE *f = fopen(gitdir, "r");
+            bool ok = f && fgets(line, sizeof(line), f) &&
+                      strncmp(line, "gitdir: ", 8) == 0;
+            if (f) {
+                fclose(f);
+            }
+            if (ok) {
+                line[strcspn(line, "\n")] = '\0';
+                if (line[8] == '/') {
+                    snprintf(gitdir, PATH_MAX, "%s", line + 8);
+                } else if (!join_path(root, line + 8, gitdir)) {
+                    return false;
+                }
+                return true;
+            }
+        }
+
+        char *slash = strrchr(root, '/');
+        if (!slash || slash == root) {
+            return false;
+        }
+        *slash = '\0';
+    }
+}
+
+static void
+git_free(struct gitindex *gi)
+{
+    free(gi->ents);
+    free(gi->paths);
+    *gi = (struct gitindex){0};
+}
+
+/**
+ * Appends path to the paths of gi and returns its offset
+ */
+static size_t
+git_add_path(struct gitindex *gi, const char *path, size_t len)
+{
+    if (gi->paths_used + len + 1 > gi->paths_size) {
+        gi->paths_size = (gi->paths_size + len + 1) * 2;
+        char *tmp      = realloc(gi->paths, gi->paths_size);
+        if (!tmp) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        gi->paths = tmp;
+    }
+
+    size_t off = gi->paths_used;
+    memcpy(gi->paths + off, path, len);
+    gi->paths[off + len] = '\0';
+    gi->paths_used += len + 1;
+
+    return off;
+}
+
+/**
+ * Parses the entries of the index file of gitdir (versions 2 to 4) into gi
+ */
+static bool
+git_parse(struct gitindex *gi, const char *gitdir, size_t hashlen)
+{
+    char file[PATH_MAX];
+    struct stat sb;
+    if (!join_path(gitdir, "index", file)) {
+        return false;
+    }
+
+    int fd = open(file, O_RDONLY);
+    if (fd < 0 || fstat(fd, &sb) < 0 || sb.st_size < 12) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+
+    const unsigned char *data =
+        mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+
+    uint32_t version = load_be32(data + 4);
+    uint32_t count   = load_be32(data + 8);
+    bool ok          = memcmp(data, "DIRC", 4) == 0 && version >= 2 &&
+              version <= 4 && count <= (size_t)sb.st_size / 40;
+
+    gi->ents = malloc(count * sizeof(*gi->ents) + 1);
+    if (!gi->ents) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    const unsigned char *p   = data + 12;
+    const unsigned char *end = data + sb.st_size;
+    char path[PATH_MAX]      = "";
+    size_t len               = 0;
+    size_t fixed             = 62 - 20 + hashlen; // stat data, hash, flags
+
+    for (uint32_t i = 0; ok && i < count; ++i) {
+        if ((size_t)(end - p) < fixed + 2) {
+            ok = false;
+            break;
+        }
+
+        uint16_t flags       = p[fixed - 2] << 8 | p[fixed - 1];
+        const unsigned char *name = p + fixed + (flags & 0x4000 ? 2 : 0);
+
+        size_t strip = 0;
+        if (version == 4) {
+            // prefix of the previous path to drop, as an offset varint
+            unsigned char c = *name++;
+            strip           = c & 0x7f;
+            while (c & 0x80 && name < end) {
+                c     = *name++;
+                strip = ((strip + 1) << 7) | (c & 0x7f);
+            }
+            len = strip <= len ? len - strip : 0;
+        } else {
+            len = 0;
+        }
+
+        const unsigned char *nul = memchr(name, '\0', end - name);
+        if (!nul || len + (nul - name) >= sizeof(path)) {
+            ok = false;
+            break;
+        }
+        memcpy(path + len, name, nul - name);
+        len += nul - name;
+        path[len] = '\0';
+
+        gi->ents[gi->n++] = (struct gitentry){
+            .path       = git_add_path(gi, path, len),
+            .mtime_sec  = load_be32(p + 8),
+            .mtime_nsec = load_be32(p + 12),
+            .size       = load_be32(p + 36),
+            .stage      = (flags >> 12) & 3,
+            .gitlink    = load_be32(p + 24) >> 12 == 016,
+        };
+
+        if (version == 4) {
+            p = nul + 1;
+        } else {
+            // entries are padded with NULs to a multiple of eight bytes
+            p += (nul - p + 8) & ~(size_t)7;
+        }
+    }
+
+    munmap((void *)data, sb.st_size);
+    return ok;
+}
+
+/**
+ * Returns the first index entry whose path is not less than path
+ */
+static size_t
+git_lower_bound(const struct gitindex *gi, const char *path)
+{
+    size_t lo = 0;
+    size_t hi = gi->n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(gi->paths + gi->ents[mid].path, path) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+/**
+ * Reads the ignore patterns in file, which apply below base
+ */
+static void
+git_read_ignores(struct gitignores *ig, const char *file, const char *base)
+{
+    FILE *f = fopen(file, "r");
+    if (!f) {
+        return;
+    }
+
+    char *line  = NULL;
+    size_t size = 0;
+    while (ig->n < GIT_MAX_IGNORES && getline(&line, &size, f) > 0) {
+        line[strcspn(line, "\r\n")] = '\0';
+        size_t len                  = strlen(line);
+        while (len > 0 && line[len - 1] == ' ') {
+            line[--len] = '\0';
+        }
+        if (len == 0 || line[0] == '#' || line[0] == '!') {
+            continue; // negations are not supported
+        }
+
+        struct gitignore *g = &ig->pats[ig->n];
+        g->dir_only         = line[len - 1] == '/';
+        if (g->dir_only) {
+            line[--len] = '\0';
+        }
+
+        // patterns with a slash inside are relative to base
+        const char *pat = line[0] == '/' ? line + 1 : line;
+        g->anchored     = strchr(line, '/') != NULL;
+        int res         = snprintf(
+            g->pat,
+            sizeof(g->pat),
+            "%s%s",
+            g->anchored ? base : "",
+            pat);
+        if (res > 0 && (size_t)res < sizeof(g->pat)) {
+            ++ig->n;
+        }
+    }
+
+    free(line);
+    fclose(f);
+}
+
+/**
+ * Whether the entry relpath of the repository, called name, is ignored
+ */
+static bool
+git_ignored(
+    const struct gitignores *ig,
+    const char *relpath,
+    const char *name,
+    bool is_dir)
+{
+    for (size_t i = 0; i < ig->n; ++i) {
+        const struct gitignore *g = &ig->pats[i];
+        if (g->dir_only && !is_dir) {
+            continue;
+        }
+        if (g->anchored ? fnmatch(g->pat, relpath, FNM_PATHNAME) == 0
+                        : fnmatch(g->pat, name, 0) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Marks the elements of the listing of path that are modified or untracked
+ * according to the git index. The index is only parsed again once it
+ * changed.
+ */
+static void
+git_mark(const char *path, struct listing *list)
+{
+    static struct gitindex gi;
+
+    char root[PATH_MAX];
+    char gitdir[PATH_MAX];
+    char index[PATH_MAX];
+    struct stat sb;
+    if (list->spill || !git_find(path, root, gitdir) ||
+        !join_path(gitdir, "index", index) || stat(index, &sb) < 0) {
+        return;
+    }
+
+    if (strcmp(gi.gitdir, gitdir) != 0 ||
+        gi.mtime.tv_sec != sb.st_mtim.tv_sec ||
+        gi.mtime.tv_nsec != sb.st_mtim.tv_nsec || gi.size != sb.st_size) {
+        git_free(&gi);
+
+        // sha256 repositories have longer hashes in the index
+        char config[PATH_MAX];
+        char line[256];
+        size_t hashlen = 20;
+        FILE *f = join_path(gitdir, "config", config) ? fopen(config, "r")
+                                                      : NULL;
+        while (f && fgets(line, sizeof(line), f)) {
+            if (strstr(line, "objectformat") && strstr(line, "sha256")) {
+                hashlen = 32;
+            }
+        }
+        if (f) {
+            fclose(f);
+        }
+
+        if (!git_parse(&gi, gitdir, hashlen)) {
+            git_free(&gi);
+            return;
+        }
+        snprintf(gi.gitdir, sizeof(gi.gitdir), "%s", gitdir);
+        gi.mtime = sb.st_mtim;
+        gi.size  = sb.st_size;
+    }
+
+    // path of the listed directory inside the repository, with a slash
+    char prefix[PATH_MAX] = "";
+    size_t rootlen        = strlen(root);
+    if (path[rootlen] == '/') {
+        snprintf(prefix, sizeof(prefix), "%s/", path + rootlen + 1);
+    }
+
+    struct gitignores ig = {0};
+    char file[PATH_MAX];
+    if (join_path(root, ".gitignore", file)) {
+        git_read_ignores(&ig, file, "");
+    }
+    if (join_path(gitdir, "info/exclude", file)) {
+        git_read_ignores(&ig, file, "");
+    }
+    if (prefix[0] != '\0' && join_path(path, ".gitignore", file)) {
+        git_read_ignores(&ig, file, prefix);
+    }
+
+    for (size_t i = 0; i < list->n; ++i) {
+        struct direlement *de = &list->ents[i];
+        const char *name      = listing_name(list, i);
+        bool is_dir           = de->type == TYPE_DIR;
+
+        char rel[PATH_MAX];
+        int len = snprintf(
+            rel, sizeof(rel), "%s%s%s", prefix, name, is_dir ? "/" : "");
+        if (len <= 0 || (size_t)len >= sizeof(rel) ||
+            strcmp(name, ".git") == 0 || de->type == TYPE_UNKNOWN) {
+            continue; // the type of late elements is still unknown
+        }
+
+        size_t j = git_lower_bound(&gi, rel);
+        if (is_dir) {
+            // directories are tracked if anything below them is, or if they
+            // are a submodule, whose entry has no slash and sorts before
+            bool tracked = j < gi.n && strncmp(gi.paths + gi.ents[j].path,
+                                               rel,
+                                               len) == 0;
+            rel[len - 1] = '\0';
+            size_t sub   = git_lower_bound(&gi, rel);
+            tracked |= sub < gi.n && gi.ents[sub].gitlink &&
+                       strcmp(gi.paths + gi.ents[sub].path, rel) == 0;
+            if (!tracked && !git_ignored(&ig, rel, name, true)) {
+                de->git = GIT_UNTRACKED;
+            }
+            continue;
+        }
+
+        if (j == gi.n || strcmp(gi.paths + gi.ents[j].path, rel) != 0) {
+            if (!git_ignored(&ig, rel, name, false)) {
+                de->git = GIT_UNTRACKED;
+            }
+            continue;
+        }
+
+        // the index keeps the low 32 bits of the stat data, which can only
+        // be compared if the element was stat'ed
+        const struct gitentry *e = &gi.ents[j];
+        bool differs             = e->size != (uint32_t)de->size ||
+                       e->mtime_sec != (uint32_t)de->mtime.tv_sec ||
+                       (e->mtime_nsec != 0 &&
+                        e->mtime_nsec != (uint32_t)de->mtime.tv_nsec);
+        if (e->stage != 0 || (has_stat(de) && differs)) {
+            de->git = GIT_MODIFIED;
+        }
+    }
+}
+
+/**
+ * Read a directory into list.
+ *
+ * Returns the number of elements in the dir.
+ */
+static size_t
+read_dir(const char *path, struct listing *list, bool show_hidden)
+{
+    listing_clear(list);
+
+    size_t budget         = spill_budget();
+    size_t used           = 0;
+    struct spillruns runs = {0};
+    bool spill_ok         = true;
+
+    DIR *dir;
+    dir = opendir(path);
+    if (dir) {
+        int fd           = dirfd(dir);
+        struct loader ld = loader_for(fd);
+        struct stat sb;
+        if (fstat(fd, &sb) == 0) {
+            list->dev = sb.st_dev;
+        }
+        if (slow_below(path)) {
+            ld.kind = LOADER_DTYPE; // don't stat more than needed below a hang
+        }
+        size_t batch     = 0; // first element that wasn't stat'ed yet
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        struct dirent *ent;
+        while ((ent = readdir(dir))) {
+            const char *name = ent->d_name;
+            if (!is_listed(name, show_hidden)) {
+                continue;
+            }
+
+            new_pending(list, ent, &ld);
+            if (list->n - batch >= LOADER_BATCH) {
+                load_batch(list, path, fd, &batch, &ld);
+            }
+
+            used += sizeof(struct direlement) + strlen(name) + 1;
+            if (budget > 0 && used >= budget) {
+                load_batch(list, path, fd, &batch, &ld);
+                if (!(spill_ok = spill_add_run(list, &runs))) {
+                    break;
+                }
+                used  = 0;
+                batch = 0;
+            }
+        }
+        load_batch(list, path, fd, &batch, &ld);
+        closedir(dir);
+
+        if (spill_ok && runs.n > 0) {
+            spill_ok = spill_finish(list, &runs, budget);
+        } else {
+            spill_runs_free(&runs);
+        }
+        if (!spill_ok) {
+            snprintf(
+                g_status,
+                sizeof(g_status),
+                "can't spill listing: %s",
+                strerror(errno));
+            listing_clear(list);
+        }
+
+        if (!list->spill) {
+            qsort(list->ents, list->n, sizeof(*list->ents), direlemcmp);
+            list->sorted = true;
+        }
+
+        if (getenv("FILET_TRACE")) {
+            struct timespec end;
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            snprintf(
+                g_status,
+                sizeof(g_status),
+                "%s (%#lx): %s loader, %zu threads, %zu entries in %.1f ms",
+                ld.fsname,
+                ld.fstype,
+                loader_kinds[ld.kind],
+                ld.threads,
+                list->n,
+                (end.tv_sec - start.tv_sec) * 1e3 +
+                    (end.tv_nsec - start.tv_nsec) / 1e6);
+        }
+    }
+
+    const char *compact = getenv("FILET_COMPACT");
+    size_t threshold =
+        compact ? strtoul(compact, NULL, 10) : COMPACT_DEFAULT;
+    if (!list->spill && threshold > 0 && list->n >= threshold) {
+        listing_compact(list);
+    }
+
+    git_mark(path, list);
+
+    return list->n;
+}
+
+static void
+raw_close(struct rawdir *raw)
+{
+    if (raw->dir) {
+        closedir(raw->dir);
+    }
+    free(raw->pos);
+    free(raw->counts);
+    free(raw->path);
+    *raw = (struct rawdir){0};
+}
+
+/**
+ * Replaces the elements of list with count elements of src starting at from,
+ * appended to the elements of dst. dst is consumed.
+ */
+static void
+listing_replace(
+    struct listing *list,
+    struct listing *dst,
+    const struct listing *src,
+    size_t from,
+    size_t count)
+{
+    for (size_t i = from; i < from + count; ++i) {
+        struct direlement *de = listing_push(dst);
+        *de                   = src->ents[i];
+        de->name              = listing_add_name(dst, listing_name(src, i));
+        de->target            = NULL;
+    }
+
+    dst->late  = list->late; // pending stats may still be in there
+    list->late = NULL;
+    listing_clear(list);
+    listing_free_ents(list);
+    dst->gen = list->gen;
+    dst->dev = list->dev;
+    *list    = *dst;
+}
+
+/**
+ * Reads chunk k of the directory stream of raw and appends its elements to
+ * list, or only steps over it when list is NULL. Returns the number of
+ * elements added.
+ */
+static size_t
+raw_read_chunk(struct rawdir *raw, struct listing *list, size_t k)
+{
+    size_t n     = list ? list->n : 0;
+    size_t start = n;
+
+    seekdir(raw->dir, raw->pos[k]);
+    for (size_t i = 0; i < RAW_CHUNK; ++i) {
+        struct dirent *ent = readdir(raw->dir);
+        if (!ent) {
+            raw->end = k + 1;
+            break;
+        }
+        if (list && is_listed(ent->d_name, raw->show_hidden)) {
+            new_pending(list, ent, &raw->ld);
+        }
+    }
+    if (list) {
+        load_batch(list, raw->path, dirfd(raw->dir), &start, &raw->ld);
+    }
+
+    if (k + 1 == raw->npos) {
+        long *tmp = realloc(raw->pos, (raw->npos + 1) * sizeof(*tmp));
+        if (!tmp) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        raw->pos              = tmp;
+        raw->pos[raw->npos++] = telldir(raw->dir);
+    }
+
+    return list ? list->n - n : 0;
+}
+
+/**
+ * Makes room for one more chunk count in the window of raw
+ */
+static void
+raw_grow(struct rawdir *raw)
+{
+    if (raw->nchunks == raw->size) {
+        raw->size += RAW_WINDOW;
+        size_t *tmp = realloc(raw->counts, raw->size * sizeof(*tmp));
+        if (!tmp) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        raw->counts = tmp;
+    }
+}
+
+/**
+ * Whether any of the count elements of list starting at from is marked
+ */
+static bool
+listing_any_marked(const struct listing *list, size_t from, size_t count)
+{
+    for (size_t i = from; list->marks.n > 0 && i < from + count; ++i) {
+        if (list->ents[i].is_selected) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Drops leading chunks that end before top while the window of raw is too
+ * large. Chunks holding marked elements are kept, so is everything after
+ * them. Returns the number of elements dropped.
+ */
+static size_t
+raw_drop_front(struct rawdir *raw, struct listing *list, size_t top)
+{
+    size_t drop   = 0;
+    size_t chunks = 0;
+    while (raw->nchunks - chunks > RAW_WINDOW &&
+           drop + raw->counts[chunks] <= top &&
+           !listing_any_marked(list, drop, raw->counts[chunks])) {
+        drop += raw->counts[chunks++];
+    }
+
+    if (chunks > 0) {
+        size_t nsizes       = 0;
+        off_t *sizes        = du_results(list->du, &nsizes);
+        struct listing rest = {0};
+        listing_replace(list, &rest, list, drop, list->n - drop);
+        listing_count_marks(list, raw->path, sizes, nsizes);
+        free(sizes);
+        memmove(
+            raw->counts,
+            raw->counts + chunks,
+            (raw->nchunks - chunks) * sizeof(*raw->counts));
+        raw->first += chunks;
+        raw->nchunks -= chunks;
+    }
+
+    return drop;
+}
+
+/**
+ * Reads ahead until list extends past bottom or the directory ends and drops
+ * leading chunks that end before top while the window is too large. Chunks
+ * are dropped as they are read, so reading far ahead keeps only the window.
+ *
+ * Returns the number of elements dropped from the front.
+ */
+static size_t
+raw_forward(struct rawdir *raw, struct listing *list, size_t top, size_t bottom)
+{
+    size_t drop = raw_drop_front(raw, list, top);
+
+    while (list->n + drop <= bottom && raw->first + raw->nchunks < raw->end) {
+        raw_grow(raw);
+        raw->counts[raw->nchunks] =
+            raw_read_chunk(raw, list, raw->first + raw->nchunks);
+        ++raw->nchunks;
+        drop += raw_drop_front(raw, list, top < drop ? 0 : top - drop);
+    }
+    raw->gen = list->gen;
+
+    return drop;
+}
+
+/**
+ * Reads the chunk before the window and drops trailing chunks that start
+ * after bottom while the window is too large.
+ *
+ * Returns the number of elements added to the front.
+ */
+static size_t
+raw_back(struct rawdir *raw, struct listing *list, size_t bottom)
+{
+    if (raw->first == 0) {
+        return 0;
+    }
+
+    struct listing prev = {0};
+    size_t added        = raw_read_chunk(raw, &prev, raw->first - 1);
+
+    size_t keep = list->n;
+    while (raw->nchunks + 1 > RAW_WINDOW &&
+           keep - raw->counts[raw->nchunks - 1] > bottom &&
+           !listing_any_marked(
+               list,
+               keep - raw->counts[raw->nchunks - 1],
+               raw->counts[raw->nchunks - 1])) {
+        keep -= raw->counts[--raw->nchunks];
+    }
+
+    size_t nsizes = 0;
+    off_t *sizes  = du_results(list->du, &nsizes);
+    listing_replace(list, &prev, list, 0, keep);
+    listing_count_marks(list, raw->path, sizes, nsizes);
+    free(sizes);
+    raw_grow(raw);
+    memmove(
+        raw->counts + 1, raw->counts, raw->nchunks * sizeof(*raw->counts));
+    raw->counts[0] = added;
+    ++raw->nchunks;
+    --raw->first;
+    raw->gen = list->gen;
+
+    return added;
+}
+
+/**
+ * Moves the window of raw to the end of the directory. Chunks that are not
+ * listed are only stepped over to learn where the last ones start. With
+ * marks in the window it is read ahead instead, to keep them.
+ *
+ * Returns whether the window moved.
+ */
+static bool
+raw_end(struct rawdir *raw, struct listing *list, size_t rows)
+{
+    size_t k = raw->first + raw->nchunks;
+    for (k = k < raw->npos - 1 ? raw->npos - 1 : k;
+         list->marks.n == 0 && k < raw->end;
+         ++k) {
+        raw_read_chunk(raw, NULL, k);
+    }
+    if (list->marks.n > 0 || raw->end <= raw->first + RAW_WINDOW) {
+        size_t n = list->n;
+        return raw_forward(raw, list, SIZE_MAX, SIZE_MAX) > 0 || list->n != n;
+    }
+
+    listing_clear(list);
+    raw->first   = raw->end - RAW_WINDOW;
+    raw->nchunks = 0;
+    raw_forward(raw, list, 0, SIZE_MAX);
+    while (list->n < rows && raw->first > 0) {
+        // the last chunks were mostly hidden entries
+        raw_back(raw, list, SIZE_MAX);
+    }
+
+    return true;
+}
+
+/**
+ * Lists path in directory order, reading only as far as needed to fill rows
+ * lines
+ */
+static bool
+raw_open(
+    struct rawdir *raw,
+    const char *path,
+    struct listing *list,
+    bool show_hidden,
+    size_t rows)
+{
+    raw_close(raw);
+    listing_clear(list);
+
+    if (!(raw->dir = opendir(path))) {
+        return false;
+    }
+
+    raw->pos = malloc(sizeof(*raw->pos));
+    if (!raw->pos) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    raw->pos[0]      = telldir(raw->dir);
+    raw->npos        = 1;
+    raw->end         = SIZE_MAX;
+    raw->show_hidden = show_hidden;
+    raw->ld          = loader_for(dirfd(raw->dir));
+
+    struct stat sb;
+    if (fstat(dirfd(raw->dir), &sb) == 0) {
+        list->dev = sb.st_dev;
+    }
+    if (!(raw->path = strdup(path))) {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+    raw_forward(raw, list, 0, rows);
+
+    return true;
+}
+
+/**
+ * Goes back to the start of the directory stream
+ */
+static void
+raw_rewind(struct rawdir *raw, struct listing *list, size_t rows)
+{
+    listing_clear(list);
+    raw->first   = 0;
+    raw->nchunks = 0;
+    raw_forward(raw, list, 0, rows);
+}
+
+/**
+ * Whether list still holds the window of raw
+ */
+static bool
+raw_active(const struct rawdir *raw, const struct listing *list)
+{
+    return raw->dir && raw->gen == list->gen;
+}
+
+/**
+ * Whether path is large enough to be listed unsorted right away. The size of
+ * a directory is a rough measure of the number of entries in it.
+ */
+static bool
+raw_wanted(const char *path)
+{
+    const char *env = getenv("FILET_RAW");
+    struct stat sb;
+    if (!env || stat(path, &sb) < 0) {
+        return false;
+    }
+
+    size_t mb = strtoul(env, NULL, 10);
+    return mb > 0 && (size_t)sb.st_size >= mb * 1024 * 1024;
+}
+
+/**
+ * Spawns a new process, waits for it and returns
+ */
+static void
+spawn(const char *path, const char *cmd, const char *argv1, int row)
+{
+    int status;
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        return;
+    }
+
+    restore_terminal();
+    fflush(stdout);
+
+    if (pid == 0) {
+        if (chdir(path) < 0) {
+            _exit(EXIT_FAILURE);
+        }
+        execlp(cmd, cmd, argv1, NULL);
+        // NOTREACHED
+        _exit(EXIT_FAILURE);
+    } else {
+        do {
+            waitpid(pid, &status, WUNTRACED);
+        } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+    }
+
+    setup_terminal(row);
+}
+
+/**
+ * Gets the parent dir of a given path (without trailing /) and writes it back
+ */
+static void
+parent_dir(char *path)
+{
+    if (path[1] != '\0') {
+        char *end = strrchr(path, '/');
+        if (path == end) {
+            ++end;
+        }
+        *end = '\0';
+    }
+}
+
+/**
+ * Looks up the target of the link (dev, ino) that was last changed at mtime
+ */
+static const char *
+link_cache_get(dev_t dev, ino_t ino, struct timespec mtime)
+{
+    size_t mask = LINK_CACHE_SIZE - 1;
+    for (size_t i = (ino * HASH_PRIME1 ^ dev) & mask; g_links[i].target;
+         i = (i + 1) & mask) {
+        struct linkcache *lc = &g_links[i];
+        if (lc->dev == dev && lc->ino == ino) {
+            return lc->mtime.tv_sec == mtime.tv_sec &&
+                           lc->mtime.tv_nsec == mtime.tv_nsec
+                       ? lc->target
+                       : NULL;
+        }
+    }
+
+    return NULL;
+}
+
+static void
+link_cache_clear(void)
+{
+    for (size_t i = 0; i < LINK_CACHE_SIZE; ++i) {
+        if (g_links[i].target) {
+            mem_free(MEM_LINKS, strlen(g_links[i].target) + 1);
+            free(g_links[i].target);
+        }
+    }
+    memset(g_links, 0, sizeof(g_links));
+    g_nlinks = 0;
+}
+
+/**
+ * Caches target for the link (dev, ino) and returns the cached copy. The
+ * cache starts over once it is three quarters full or filet would go over
+ * its memory budget.
+ */
+static const char *
+link_cache_put(dev_t dev, ino_t ino, struct timespec mtime, const char *target)
+{
+    size_t mask = LINK_CACHE_SIZE - 1;
+    size_t len  = strlen(target) + 1;
+    if (g_nlinks >= LINK_CACHE_SIZE / 4 * 3 || mem_over_budget(len)) {
+        link_cache_clear();
+    }
+
+    size_t i = (ino * HASH_PRIME1 ^ dev) & mask;
+    while (g_links[i].target &&
+           !(g_links[i].dev == dev && g_links[i].ino == ino)) {
+        i = (i + 1) & mask;
+    }
+
+    char *copy = strdup(target);
+    if (!copy) {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+
+    if (g_links[i].target) {
+        mem_free(MEM_LINKS, strlen(g_links[i].target) + 1);
+        free(g_links[i].target);
+    } else {
+        ++g_nlinks;
+    }
+    mem_alloc(MEM_LINKS, len);
+    g_links[i] = (struct linkcache){dev, ino, mtime, copy};
+
+    return copy;
+}
+
+/**
+ * Returns where the link i of list in the directory path points, reading it
+ * only the first time it is shown. Returns NULL if it can't be read.
+ */
+static const char *
+listing_target(struct listing *list, const char *path, size_t i)
+{
+    struct direlement *de = &list->ents[i];
+    if (de->target) {
+        return de->target;
+    }
+
+    const char *target = NULL;
+    if (de->ino != 0) {
+        target = link_cache_get(list->dev, de->ino, de->mtime);
+    }
+
+    if (!target) {
+        if (!list->has_dirfd) {
+            list->dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (list->dirfd < 0) {
+                return NULL;
+            }
+            list->has_dirfd = true;
+        }
+
+        char buf[PATH_MAX];
+        ssize_t len = readlinkat(
+            list->dirfd, listing_name(list, i), buf, sizeof(buf) - 1);
+        if (len < 0) {
+            return NULL;
+        }
+        buf[len] = '\0';
+
+        target = buf;
+        if (de->ino != 0) {
+            target = link_cache_put(list->dev, de->ino, de->mtime, buf);
+        }
+    }
+
+    de->target = listing_add_name(list, target);
+    return de->target;
+}
+
+/**
+ * Draws a single directory entry in it's own line, links along with their
+ * target
+ *
+ * Assumes the cursor is at the beginning of the line
+ */
+static void
+draw_line(
+    struct listing *list,
+    const char *path,
+    size_t i,
+    bool is_sel,
+    unsigned depth)
+{
+    const struct direlement *ent = &list->ents[i];
+    const char *target           = NULL;
+    if (ent->type == TYPE_SYML || ent->type == TYPE_SYML_TO_DIR ||
+        ent->type == TYPE_SYML_BROKEN) {
+        target = listing_target(list, path, i);
+    }
+    const char *name = listing_name(list, i);
+
+    static const char *cmp_marks[] = {
+        [CMP_NONE]       = "",
+        [CMP_ONLY_LEFT]  = "< ",
+        [CMP_ONLY_RIGHT] = "> ",
+        [CMP_DIFFERS]    = "! ",
+        [CMP_SAME]       = "= ",
+    };
+    static const char *git_marks[] = {
+        [GIT_NONE]      = "",
+        [GIT_MODIFIED]  = "M ",
+        [GIT_UNTRACKED] = "?? ",
+    };
+
+    switch (ent->type) {
+    case TYPE_DIR:
+        printf("\033[34;1m");
+        break;
+    case TYPE_SYML: // FALLTHROUGH
+    case TYPE_SYML_TO_DIR:
+        printf("\033[36;1m");
+        break;
+    case TYPE_SYML_BROKEN:
+        printf("\033[31;1m");
+        break;
+    case TYPE_EXEC:
+        printf("\033[32;1m");
+        break;
+    case TYPE_NORM:
+        printf("\033[m");
+        break;
+    case TYPE_UNKNOWN:
+        printf("\033[31m");
+        break;
+    }
+    if (ent->unreadable) {
+        printf("\033[31;1m");
+    }
+
+    const char *pending = ent->type == TYPE_UNKNOWN ? "? " : "";
+    g_pacer.dirty       = true;
+    if (is_sel) {
+        printf(
+            "> %c%*s%s%s%s%s%s%s",
+            ent->is_selected ? '*' : ' ',
+            (int)depth * 2,
+            "",
+            cmp_marks[ent->cmp],
+            git_marks[ent->git],
+            pending,
+            name,
+            target ? " -> " : "",
+            target ? target : "");
+    } else {
+        // the trailing space clears the last char on unindenting it
+        printf(
+            " %c%*s%s%s%s%s%s%s ",
+            ent->is_selected ? '*' : ' ',
+            (int)depth * 2,
+            "",
+            cmp_marks[ent->cmp],
+            git_marks[ent->git],
+            pending,
+            name,
+            target ? " -> " : "",
+            target ? target : "");
+    }
+}
+
+static void
+tree_free_node(struct treenode *node)
+{
+    listing_clear(&node->list);
+    listing_free_ents(&node->list);
+    free(node->dir);
+    free(node);
+}
+
+/**
+ * Frees all directories loaded for the tree view and goes back to a flat
+ * listing
+ */
+static void
+tree_reset(struct tree *t)
+{
+    for (size_t i = 0; i < t->nnodes; ++i) {
+        tree_free_node(t->nodes[i]);
+    }
+    free(t->nodes);
+    free(t->segs);
+    *t = (struct tree){0};
+}
+
+/**
+ * Drops the tree view if the listing of the current directory was replaced
+ * underneath it. Returns whether it did.
+ */
+static bool
+tree_check(struct tree *t, const struct listing *list)
+{
+    if (t->nsegs == 0 || (t->gen == list->gen && t->n == list->n)) {
+        return false;
+    }
+
+    tree_reset(t);
+    return true;
+}
+
+static size_t
+tree_rows(const struct tree *t, const struct listing *list)
+{
+    return t->nsegs > 0 ? t->rows : list->n;
+}
+
+static struct treerow
+tree_row(
+    const struct tree *t,
+    struct listing *list,
+    const char *path,
+    size_t row)
+{
+    if (t->nsegs == 0) {
+        return (struct treerow){.list = list, .i = row, .dir = path};
+    }
+
+    // last range starting at or before row
+    size_t lo = 0;
+    size_t hi = t->nsegs;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (t->segs[mid].row <= row) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    const struct treeseg *s = &t->segs[lo];
+    return (struct treerow){
+        .list = s->node ? &s->node->list : list,
+        .i    = s->from + row - s->row,
+        .dir  = s->node ? s->node->dir : path,
+        .node = s->node,
+        .seg  = lo,
+    };
+}
+
+/**
+ * Writes the name of row relative to the current directory to buf
+ */
+static const char *
+tree_name(
+    const struct tree *t,
+    struct listing *list,
+    size_t row,
+    char *buf,
+    size_t size)
+{
+    struct treerow r = tree_row(t, list, "", row);
+    snprintf(
+        buf,
+        size,
+        "%s%s%s",
+        r.node ? r.node->rel : "",
+        r.node ? "/" : "",
+        listing_name(r.list, r.i));
+
+    return buf;
+}
+
+static void
+tree_insert(struct tree *t, size_t at, struct treeseg seg)
+{
+    if (t->nsegs == t->segs_size) {
+        t->segs_size = t->segs_size ? t->segs_size * 2 : 16;
+        struct treeseg *tmp = realloc(t->segs, t->segs_size * sizeof(*tmp));
+        if (!tmp) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        t->segs = tmp;
+    }
+
+    memmove(t->segs + at + 1, t->segs + at, (t->nsegs - at) * sizeof(seg));
+    t->segs[at] = seg;
+    ++t->nsegs;
+}
+
+/**
+ * Recomputes the first rows of the ranges from seg on
+ */
+static void
+tree_renumber(struct tree *t, size_t seg)
+{
+    for (size_t s = seg > 0 ? seg : 1; s < t->nsegs; ++s) {
+        const struct treeseg *prev = &t->segs[s - 1];
+        t->segs[s].row             = prev->row + prev->to - prev->from;
+    }
+}
+
+static unsigned
+tree_depth(const struct tree *t, size_t seg)
+{
+    return t->segs[seg].node ? t->segs[seg].node->depth : 0;
+}
+
+/**
+ * Collapses the directory at element i, the last of range seg, by dropping
+ * the ranges below it
+ */
+static void
+tree_collapse(struct tree *t, size_t seg)
+{
+    unsigned depth = tree_depth(t, seg);
+    size_t end     = seg + 1;
+    while (end < t->nsegs && tree_depth(t, end) > depth) {
+        t->rows -= t->segs[end].to - t->segs[end].from;
+        ++end;
+    }
+
+    // rejoin the rest of the listing the directory was in
+    struct treeseg *s = &t->segs[seg];
+    if (end < t->nsegs && t->segs[end].node == s->node &&
+        t->segs[end].from == s->to) {
+        s->to = t->segs[end].to;
+        ++end;
+    }
+
+    memmove(
+        t->segs + seg + 1,
+        t->segs + end,
+        (t->nsegs - end) * sizeof(*t->segs));
+    t->nsegs -= end - seg - 1;
+    tree_renumber(t, seg + 1);
+}
+
+/**
+ * Frees the directories that were expanded before but aren't shown right
+ * now. Their children aren't shown either, so they go as well.
+ */
+static void
+tree_evict(struct tree *t)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < t->nnodes; ++i) {
+        bool shown = false;
+        for (size_t j = 0; j < t->nsegs && !shown; ++j) {
+            shown = t->segs[j].node == t->nodes[i];
+        }
+
+        if (shown) {
+            t->nodes[kept++] = t->nodes[i];
+        } else {
+            tree_free_node(t->nodes[i]);
+        }
+    }
+    t->nnodes = kept;
+}
+
+/**
+ * Whether any element of the listing of node is expanded, NULL standing for
+ * the current directory. Such listings are split into ranges by index.
+ */
+static bool
+tree_has_children(const struct tree *t, const struct treenode *node)
+{
+    for (size_t i = 0; i < t->nnodes; ++i) {
+        if (t->nodes[i]->parent == node) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Fills in late stats of the expanded directories. Returns whether anything
+ * changed.
+ */
+static bool
+tree_poll_late(struct tree *t)
+{
+    bool changed = false;
+    for (size_t i = 0; i < t->nnodes; ++i) {
+        struct treenode *node = t->nodes[i];
+        changed |= listing_poll_late(&node->list, !tree_has_children(t, node));
+    }
+
+    return changed;
+}
+
+static bool
+tree_late(const struct tree *t)
+{
+    for (size_t i = 0; i < t->nnodes; ++i) {
+        if (t->nodes[i]->list.late) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void
+draw_row(
+    const struct tree *t,
+    struct listing *list,
+    const char *path,
+    size_t row,
+    bool is_sel)
+{
+    struct treerow r = tree_row(t, list, path, row);
+    draw_line(r.list, r.dir, r.i, is_sel, r.node ? r.node->depth : 0);
+}
+
+static long
+ms_since(const struct timespec *t)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - t->tv_sec) * 1000 +
+           (now.tv_nsec - t->tv_nsec) / 1000000;
+}
+
+/**
+ * Makes the next header refresh the filesystem info, e.g. after files were
+ * written or deleted
+ */
+static void
+fsinfo_invalidate(void)
+{
+    for (size_t i = 0; i < g_nfsinfo && i < FSINFO_CACHE; ++i) {
+        g_fsinfo[i].valid = false;
+    }
+    g_fsasked[0] = '\0';
+}
+
+static void
+fsreq_release(struct fsreq *req)
+{
+    pthread_mutex_lock(&req->lock);
+    bool last = --req->refs == 0;
+    pthread_mutex_unlock(&req->lock);
+
+    if (last) {
+        pthread_mutex_destroy(&req->lock);
+        free(req->path);
+        free(req);
+    }
+}
+
+static void *
+fsreq_worker(void *arg)
+{
+    struct fsreq *req = arg;
+    struct fsinfo fi  = {0};
+
+    int fd = open(req->path, O_RDONLY | O_DIRECTORY);
+    struct stat sb;
+    struct statvfs vfs;
+    struct statfs fs;
+    if (fd >= 0 && fstat(fd, &sb) == 0 && fstatvfs(fd, &vfs) == 0 &&
+        fstatfs(fd, &fs) == 0) {
+        fi = (struct fsinfo){
+            .dev    = sb.st_dev,
+            .avail  = (unsigned long long)vfs.f_bavail * vfs.f_frsize,
+            .total  = (unsigned long long)vfs.f_blocks * vfs.f_frsize,
+            .fsname = loader_match(fs.f_type).fsname,
+            .valid  = true,
+        };
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    pthread_mutex_lock(&req->lock);
+    req->fi   = fi;
+    req->done = true;
+    pthread_mutex_unlock(&req->lock);
+    fsreq_release(req);
+
+    return NULL;
+}
+
+/**
+ * Starts looking up the filesystem of path on a worker, unless a lookup is
+ * still running or path was just looked up
+ */
+static void
+fsinfo_request(const char *path)
+{
+    time_t now  = time(NULL);
+    bool resent = now - g_fsasked_at < FSINFO_REFRESH_S;
+    if (g_fsreq || (resent && strcmp(g_fsasked, path) == 0)) {
+        return;
+    }
+
+    struct fsreq *req = calloc(1, sizeof(*req));
+    if (!req || !(req->path = strdup(path))) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&req->lock, NULL);
+    req->refs = 2;
+    clock_gettime(CLOCK_MONOTONIC, &req->since);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, fsreq_worker, req) != 0) {
+        req->refs = 1;
+        fsreq_release(req);
+        return;
+    }
+    pthread_detach(thread);
+
+    snprintf(g_fsasked, sizeof(g_fsasked), "%s", path);
+    g_fsasked_at = now;
+    g_fsreq      = req;
+}
+
+/**
+ * Takes the result of a finished lookup into the cache. A lookup hanging for
+ * longer than STAT_DEADLINE_MS is left to its worker and its path marked as
+ * slow, so it isn't tried again. Returns whether the cache changed.
+ */
+static bool
+fsinfo_poll(void)
+{
+    struct fsreq *req = g_fsreq;
+    if (!req) {
+        return false;
+    }
+
+    pthread_mutex_lock(&req->lock);
+    bool done        = req->done;
+    struct fsinfo fi = req->fi;
+    pthread_mutex_unlock(&req->lock);
+
+    if (!done && ms_since(&req->since) < STAT_DEADLINE_MS) {
+        return false;
+    }
+    if (!done) {
+        char dir[PATH_MAX];
+        snprintf(dir, sizeof(dir), "%s", req->path);
+        char *name = strrchr(dir, '/');
+        if (name && name[1]) {
+            *name++ = '\0';
+            slow_add(dir[0] ? dir : "/", name);
+        }
+    }
+    g_fsreq = NULL;
+    fsreq_release(req);
+    if (!fi.valid) {
+        return false;
+    }
+
+    struct fsinfo *slot = NULL;
+    for (size_t i = 0; i < g_nfsinfo && i < FSINFO_CACHE; ++i) {
+        if (g_fsinfo[i].dev == fi.dev) {
+            slot = &g_fsinfo[i];
+            break;
+        }
+    }
+    if (!slot) {
+        slot = &g_fsinfo[g_nfsinfo++ % FSINFO_CACHE];
+    }
+    clock_gettime(CLOCK_MONOTONIC, &fi.at);
+    *slot = fi;
+
+    return true;
+}
+
+/**
+ * Returns the space and type of the filesystem dev, which path is on, as far
+ * as it is known. Results are cached per device and looked up again on a
+ * worker after FSINFO_REFRESH_S seconds, unless path hung before.
+ */
+static const struct fsinfo *
+fsinfo_get(const char *path, dev_t dev)
+{
+    const struct fsinfo *fi = NULL;
+    for (size_t i = 0; i < g_nfsinfo && i < FSINFO_CACHE; ++i) {
+        if (g_fsinfo[i].dev == dev) {
+            fi = &g_fsinfo[i];
+            break;
+        }
+    }
+
+    bool fresh = fi && fi->valid && ms_since(&fi->at) < FSINFO_REFRESH_S * 1000;
+    if (!fresh && !slow_below(path)) {
+        fsinfo_request(path);
+    }
+
+    return fi;
+}
+
+/**
+ * Describes the filesystem of path for the header
+ */
+static const char *
+fsinfo_describe(const char *path, dev_t dev, char *buf, size_t size)
+{
+    const struct fsinfo *fi = fsinfo_get(path, dev);
+    if (!fi) {
+        buf[0] = '\0';
+        return buf;
+    }
+
+    char avail[16];
+    char total[16];
+    snprintf(
+        buf,
+        size,
+        " %s of %s free, %s%s",
+        format_size(fi->avail, avail, sizeof(avail)),
+        format_size(fi->total, total, sizeof(total)),
+        fi->fsname,
+        slow_below(path) ? ", slow" : "");
+
+    return buf;
+}
+
+/**
+ * Describes the marked elements for the header
+ */
+static const char *
+marks_describe(const struct marks *m, char *buf, size_t size)
+{
+    if (m->n == 0) {
+        buf[0] = '\0';
+        return buf;
+    }
+
+    char bytes[16];
+    snprintf(
+        buf,
+        size,
+        " \033[33m%zu marked (%zu dirs, %zu files, %s%s)\033[m",
+        m->n,
+        m->dirs,
+        m->n - m->dirs,
+        format_size(m->bytes, bytes, sizeof(bytes)),
+        m->pending > 0 ? "+" : "");
+
+    return buf;
+}
+
+/**
+ * Prints the header at the cursor
+ */
+static void
+draw_header(
+    const struct listing *list,
+    const char *user_and_hostname,
+    const char *path)
+{
+    char marks[128];
+    char fs[128];
+
+    printf(
+        "%s"           // print username@hostname
+        "\033[34;1m%s" // print path
+        " \033[m[%zu]" // number of entries
+        "%s"           // marks
+        "%s",          // free space and filesystem
+        user_and_hostname,
+        path,
+        list->n,
+        marks_describe(&list->marks, marks, sizeof(marks)),
+        fsinfo_describe(path, list->dev, fs, sizeof(fs)));
+}
+
+/**
+ * Redraws just the header, e.g. after marking something
+ */
+static void
+redraw_header(
+    const struct listing *list,
+    const char *user_and_hostname,
+    const char *path)
+{
+    printf(
+        "\0337"   // save cursor
+        "\033[H"  // go to 0,0
+        "\033[2K" // clear the line
+    );
+    draw_header(list, user_and_hostname, path);
+    printf("\0338"); // restore cursor
+}
+
+/**
+ * Redraws the whole screen. Avoid this if possible
+ */
+static void
+redraw(
+    const struct tree *tree,
+    struct listing *list,
+    const char *user_and_hostname,
+    const char *path,
+    size_t sel,
+    size_t offset,
+    int row)
+{
+    size_t n      = tree_rows(tree, list);
+    g_pacer.dirty = true;
+
+    // clear screen and redraw status
+    printf(
+        "\033[2J" // clear screen
+        "\033[H"  // go to 0,0
+    );
+    draw_header(list, user_and_hostname, path);
+    printf(
+        "\033[3;%dr" // limit scrolling to scrolling area
+        "\r\n"       // go to status line
+        "\033[33m%s" // print status
+        "\033[m\r",  // enter scrolling region
+        row,
+        g_status);
+
+    if (n == 0) {
+        printf("\n\033[31;7mdirectory empty\033[27m");
+    } else {
+        for (size_t i = offset; i < n && i - offset < (size_t)row - 2; ++i) {
+            printf("\n");
+            draw_row(tree, list, path, i, i == sel);
+            printf("\r");
+        }
+    }
+}
+
+/**
+ * Waits up to timeout ms for input on stdin. Returns whether there is some
+ */
+static bool
+wait_input(int timeout)
+{
+    struct pollfd pfd = {.fd = STDIN_FILENO, .events = POLLIN};
+    return poll(&pfd, 1, timeout) > 0;
+}
+
+static void
+pacer_init(struct pacer *p)
+{
+    const char *env = getenv("FILET_FPS");
+    long fps        = env ? strtol(env, NULL, 10) : FPS_DEFAULT;
+
+    *p = (struct pacer){.interval_ms = fps > 0 ? 1000 / fps : 0};
+}
+
+/**
+ * Whether the terminal is behind: it didn't finish drawing the last frame
+ * yet, output is still queued on a serial line or the last flush blocked
+ */
+static bool
+pacer_behind(struct pacer *p)
+{
+    if (p->probing) {
+        long waited = ms_since(&p->probe_sent);
+        if (p->answers && waited > PACE_SLOW_MS) {
+            return true;
+        } else if (!p->answers && waited > PACE_GIVEUP_MS) {
+            p->probing  = false;
+            p->disabled = true;
+        }
+    }
+
+    int queued = 0;
+    if (ioctl(STDOUT_FILENO, TIOCOUTQ, &queued) < 0) {
+        queued = 0;
+    }
+
+    return queued > PACE_OUTQ || p->flush_ms > PACE_SLOW_MS;
+}
+
+/**
+ * Waits until the terminal caught up and the frame interval passed. Returns
+ * false if input arrived first, in which case the frame should be skipped in
+ * favour of handling it.
+ */
+static bool
+pacer_ready(struct pacer *p)
+{
+    for (;;) {
+        long wait = p->interval_ms - ms_since(&p->last);
+        if (wait <= 0 && pacer_behind(p)) {
+            wait = PACE_TICK_MS;
+        }
+
+        if (wait <= 0 || g_quit) {
+            clock_gettime(CLOCK_MONOTONIC, &p->last);
+            return true;
+        }
+        if (wait_input(wait)) {
+            return false;
+        }
+    }
+}
+
+/**
+ * Flushes stdout, measuring how long that took, and asks the terminal to
+ * report back once it has drawn what was written
+ */
+static void
+pacer_flush(struct pacer *p)
+{
+    if (p->dirty && !p->probing && !p->disabled) {
+        printf("\033[6n");
+        p->probing = true;
+        clock_gettime(CLOCK_MONOTONIC, &p->probe_sent);
+    }
+    p->dirty = false;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fflush(stdout);
+    p->flush_ms = ms_since(&start);
+}
+
+static void
+pacer_answer(struct pacer *p)
+{
+    p->probing = false;
+    p->answers = true;
+}
+
+/**
+ * Reads a key from stdin
+ *
+ * Acts as a getchar wrapper that transforms arrow keys to hjkl
+ */
+static int
+getkey(void)
+{
+    int c = getchar();
+    if (c != '\033' || !wait_input(ESC_MS)) {
+        return c; // a lone escape is returned as is
+    }
+
+    c = getchar();
+    if (c != '[') {
+        return c;
+    }
+
+    c = getchar();
+    if (isdigit(c)) {
+        // parameters, e.g. of a cursor position report
+        while (isdigit(c) || c == ';') {
+            c = getchar();
+        }
+        if (c == 'R') {
+            pacer_answer(&g_pacer);
+            return KEY_CPR;
+        }
+    }
+
+    switch (c) {
+    case 'A':
+        return 'k';
+        break;
+    case 'B':
+        return 'j';
+        break;
+    case 'C':
+        return 'l';
+        break;
+    case 'D':
+        return 'h';
+        break;
+    }
+
+    return c;
+}
+
+/**
+ * Waits for the answer to a pending probe, so it doesn't end up in what is
+ * read next
+ */
+static void
+pacer_settle(struct pacer *p)
+{
+    while (p->probing && wait_input(PACE_SETTLE_MS)) {
+        int k = getkey();
+        if (k != KEY_CPR) {
+            if (k != EOF && k < KEY_CPR) {
+                ungetc(k, stdin);
+            }
+            break;
+        }
+    }
+    p->probing = false;
+}
+
+/**
+ * Sets the message shown in the status line and draws it right away
+ */
+static void
+set_status(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(g_status, sizeof(g_status), fmt, ap);
+    va_end(ap);
+
+    printf(
+        "\0337"       // save cursor
+        "\033[2H"     // go to status line
+        "\033[2K"     // clear it
+        "\033[33m%s"  // print status
+        "\033[m\0338", // restore cursor
+        g_status);
+    fflush(stdout);
+}
+
+/**
+ * Reads a line of input on the status line into buf
+ *
+ * Returns false if the user aborted with escape
+ */
+static bool
+prompt(const char *msg, char *buf, size_t size)
+{
+    size_t len = 0;
+    buf[0]     = '\0';
+
+    printf("\033[?25h"); // unhide cursor
+    pacer_settle(&g_pacer);
+
+    for (;;) {
+        printf("\0337\033[2H\033[2K%s%s", msg, buf);
+        fflush(stdout);
+
+        int c = getchar();
+        printf("\0338");
+
+        if (c == EOF || c == '\033') {
+            buf[0] = '\0';
+            break;
+        } else if (c == '\n') {
+            break;
+        } else if (c == 127 || c == '\b') {
+            if (len > 0) {
+                buf[--len] = '\0';
+            }
+        } else if (!iscntrl(c) && len + 1 < size) {
+            buf[len++] = c;
+            buf[len]   = '\0';
+        }
+    }
+
+    printf("\033[?25l"); // hide cursor
+    set_status("%s", "");
+
+    return buf[0] != '\0';
+}
+
+/**
+ * Returns the node of dir, loading it if it wasn't before
+ */
+static struct treenode *
+tree_node(
+    struct tree *t,
+    const char *path,
+    const char *dir,
+    const struct treerow *r,
+    bool show_hidden)
+{
+    for (size_t i = 0; i < t->nnodes; ++i) {
+        if (strcmp(t->nodes[i]->dir, dir) == 0) {
+            return t->nodes[i];
+        }
+    }
+
+    if (mem_over_budget(0)) {
+        tree_evict(t);
+    }
+
+    struct treenode *node = calloc(1, sizeof(*node));
+    struct treenode **tmp =
+        realloc(t->nodes, (t->nnodes + 1) * sizeof(*t->nodes));
+    if (!node || !tmp || !(node->dir = strdup(dir))) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    t->nodes             = tmp;
+    t->nodes[t->nnodes++] = node;
+
+    node->rel    = node->dir + (path[1] == '\0' ? 1 : strlen(path) + 1);
+    node->parent = r->node;
+    node->idx    = r->i;
+    node->depth  = r->node ? r->node->depth + 1 : 1;
+    read_dir(dir, &node->list, show_hidden);
+
+    return node;
+}
+
+/**
+ * Expands the directory at row in place, or collapses it if it is expanded
+ */
+static void
+tree_toggle(
+    struct tree *t,
+    struct listing *list,
+    const char *path,
+    size_t row,
+    bool show_hidden)
+{
+    if (t->nsegs == 0) {
+        tree_insert(t, 0, (struct treeseg){.from = 0, .to = list->n});
+        t->rows = list->n;
+        t->gen  = list->gen;
+        t->n    = list->n;
+    }
+
+    struct treerow r  = tree_row(t, list, path, row);
+    struct treeseg *s = &t->segs[r.seg];
+    struct treeseg *n = r.seg + 1 < t->nsegs ? s + 1 : NULL;
+    if (s->to == r.i + 1 && n && n->node && n->node->parent == r.node &&
+        n->node->idx == r.i && n->from == 0) {
+        tree_collapse(t, r.seg);
+        return;
+    }
+
+    const struct direlement *de = &r.list->ents[r.i];
+    const char *name            = listing_name(r.list, r.i);
+    char dir[PATH_MAX];
+    if (de->type != TYPE_DIR && de->type != TYPE_SYML_TO_DIR) {
+        set_status("%s is not a directory", name);
+        return;
+    }
+    if (!join_path(r.dir, name, dir)) {
+        set_status("%s: %s", name, strerror(ENAMETOOLONG));
+        return;
+    }
+
+    struct treenode *node = tree_node(t, path, dir, &r, show_hidden);
+    if (node->list.n == 0) {
+        set_status("%s is empty", node->rel);
+        return;
+    }
+
+    // split the range the directory is in around its own listing
+    struct treeseg rest = *s;
+    rest.from           = r.i + 1;
+    s->to               = r.i + 1;
+    tree_insert(
+        t, r.seg + 1, (struct treeseg){.node = node, .to = node->list.n});
+    if (rest.from < rest.to) {
+        tree_insert(t, r.seg + 2, rest);
+    }
+    t->rows += node->list.n;
+    tree_renumber(t, r.seg + 1);
+}
+
+/**
+ * Finds the element of list at row for commands that act on the marked
+ * elements or, if there are none, on the current one. Fails if that is in an
+ * expanded directory, since only the current one is passed on.
+ */
+static bool
+tree_current(
+    const struct tree *t,
+    struct listing *list,
+    const char *path,
+    size_t row,
+    size_t *i)
+{
+    struct treerow r = tree_row(t, list, path, row);
+    if (list->marks.n == 0 && r.list != list) {
+        set_status("only entries of %s can be selected", path);
+        return false;
+    }
+
+    *i = r.i;
+    return true;
+}
+
+/**
+ * Resolves input relative to path into a canonical absolute path
+ */
+static bool
+resolve_path(const char *path, const char *input, char *resolved)
+{
+    char joined[2 * PATH_MAX];
+    if (input[0] == '/') {
+        snprintf(joined, sizeof(joined), "%s", input);
+    } else {
+        snprintf(joined, sizeof(joined), "%s/%s", path, input);
+    }
+
+    return realpath(joined, resolved) != NULL;
+}
+
+static void
+compare_content(void *arg, size_t i)
+{
+    struct cmp_ctx *ctx    = arg;
+    struct direlement *ent = &ctx->ents[ctx->cands[i]];
+
+    uint64_t lhash;
+    uint64_t rhash;
+    if (hash_file(ctx->lfd, ent->name, &lhash) &&
+        hash_file(ctx->rfd, ent->name, &rhash) && lhash == rhash) {
+        ent->cmp = CMP_SAME;
+    } else {
+        ent->cmp = CMP_DIFFERS;
+    }
+}
+
+/**
+ * Compares list with the directory other using a linear merge of both sorted
+ * listings. Entries missing on the left are added as virtual rows. Files are
+ * compared by size and mtime; if hash_content is set, files of the same size
+ * but different mtime are hashed in parallel. Files that weren't stat'ed are
+ * only compared by hashing.
+ *
+ * Entries that are only on the left or differ get marked as selected.
+ */
+static void
+compare_dirs(
+    const char *path,
+    const char *other,
+    struct listing *list,
+    bool show_hidden,
+    bool hash_content)
+{
+    struct listing right = {0};
+    read_dir(other, &right, show_hidden);
+
+    // merging reads the names of both listings directly
+    if (!listing_expand(&right)) {
+        set_status("compare: %s is too large", other);
+        listing_clear(&right);
+        listing_free_ents(&right);
+        return;
+    }
+
+    size_t n                  = list->n;
+    size_t m                  = right.n;
+    struct direlement *merged = malloc((n + m + 1) * sizeof(*merged));
+    size_t *cands             = malloc((n + 1) * sizeof(*cands));
+    if (!merged || !cands) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t counts[CMP_SAME + 1] = {0};
+    size_t ncands               = 0;
+    size_t i                    = 0;
+    size_t j                    = 0;
+    size_t k                    = 0;
+    while (i < n || j < m) {
+        int diff;
+        if (i == n) {
+            diff = 1;
+        } else if (j == m) {
+            diff = -1;
+        } else {
+            diff = direlemcmp(&list->ents[i], &right.ents[j]);
+        }
+
+        if (diff < 0) {
+            merged[k]     = list->ents[i++];
+            merged[k].cmp = CMP_ONLY_LEFT;
+        } else if (diff > 0) {
+            merged[k]             = right.ents[j++];
+            merged[k].name        = listing_add_name(list, merged[k].name);
+            merged[k].cmp         = CMP_ONLY_RIGHT;
+            merged[k].is_selected = false;
+        } else {
+            const struct direlement *l = &list->ents[i++];
+            const struct direlement *r = &right.ents[j++];
+
+            merged[k] = *l;
+            if (l->type == TYPE_DIR || l->type == TYPE_SYML_TO_DIR) {
+                merged[k].cmp = CMP_SAME;
+            } else if (!has_stat(l) || !has_stat(r)) {
+                // without size and mtime only the contents can tell
+                merged[k].cmp = CMP_NONE;
+                if (hash_content) {
+                    cands[ncands++] = k;
+                }
+            } else if (l->size != r->size) {
+                merged[k].cmp = CMP_DIFFERS;
+            } else if (
+                l->mtime.tv_sec == r->mtime.tv_sec &&
+                l->mtime.tv_nsec == r->mtime.tv_nsec) {
+                merged[k].cmp = CMP_SAME;
+            } else if (hash_content) {
+                merged[k].cmp   = CMP_DIFFERS;
+                cands[ncands++] = k;
+            } else {
+                merged[k].cmp = CMP_DIFFERS;
+            }
+        }
+
+        ++k;
+    }
+
+    if (ncands > 0) {
+        struct cmp_ctx ctx = {
+            .lfd   = open(path, O_RDONLY | O_DIRECTORY),
+            .rfd   = open(other, O_RDONLY | O_DIRECTORY),
+            .ents  = merged,
+            .cands = cands,
+        };
+
+        if (ctx.lfd >= 0 && ctx.rfd >= 0) {
+            set_status("hashing %zu files...", ncands);
+            parallel_for(ncands, compare_content, &ctx);
+        }
+
+        if (ctx.lfd >= 0) {
+            close(ctx.lfd);
+        }
+        if (ctx.rfd >= 0) {
+            close(ctx.rfd);
+        }
+    }
+
+    for (size_t c = 0; c < k; ++c) {
+        ++counts[merged[c].cmp];
+        if (merged[c].cmp != CMP_ONLY_RIGHT) {
+            merged[c].is_selected =
+                merged[c].cmp == CMP_ONLY_LEFT || merged[c].cmp == CMP_DIFFERS;
+        }
+    }
+
+    set_status(
+        "%zu only here, %zu only in %s, %zu differ, %zu same",
+        counts[CMP_ONLY_LEFT],
+        counts[CMP_ONLY_RIGHT],
+        other,
+        counts[CMP_DIFFERS],
+        counts[CMP_SAME]);
+
+    free(cands);
+    listing_clear(&right);
+    listing_free_ents(&right);
+    listing_free_ents(list);
+    list->ents = merged;
+    list->n    = k;
+    list->size = n + m + 1;
+    mem_alloc(MEM_ENTRIES, list->size * sizeof(*merged));
+    ++list->gen;
+    listing_count_marks(list, path, NULL, 0);
+}
+
+static void
+dup_collect(
+    void *arg,
+    int UNUSED(dirfd),
+    const char *relpath,
+    const struct stat *sb)
+{
+    struct dup_ctx *ctx = arg;
+
+    if (!S_ISREG(sb->st_mode) || sb->st_size == 0) {
+        return;
+    }
+
+    char *copy = strdup(relpath);
+    if (!copy) {
+        return;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    if (ctx->n == ctx->size) {
+        size_t size         = ctx->size ? ctx->size * 2 : ENT_ALLOC_NUM;
+        struct dupfile *tmp = realloc(ctx->files, size * sizeof(*tmp));
+        if (!tmp) {
+            pthread_mutex_unlock(&ctx->lock);
+            free(copy);
+            return;
+        }
+        ctx->files = tmp;
+        ctx->size  = size;
+    }
+
+    ctx->files[ctx->n++] = (struct dupfile){
+        .path  = copy,
+        .size  = sb->st_size,
+        .mode  = sb->st_mode,
+        .mtime = sb->st_mtim,
+        .dev   = sb->st_dev,
+        .ino   = sb->st_ino,
+    };
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+/**
+ * Hashes the first and last DUP_PARTIAL bytes of a file. Files that fit into
+ * that get hashed completely.
+ */
+static void
+dup_hash_partial(void *arg, size_t i)
+{
+    struct dup_ctx *ctx = arg;
+    struct dupfile *f   = &ctx->files[i];
+    unsigned char buf[2 * DUP_PARTIAL];
+
+    f->ok  = false;
+    int fd = openat(ctx->rootfd, f->path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+
+    size_t len;
+    if (f->size <= 2 * DUP_PARTIAL) {
+        len   = f->size;
+        f->ok = pread(fd, buf, len, 0) == (ssize_t)len;
+    } else {
+        len   = 2 * DUP_PARTIAL;
+        f->ok = pread(fd, buf, DUP_PARTIAL, 0) == DUP_PARTIAL &&
+                pread(
+                    fd,
+                    buf + DUP_PARTIAL,
+                    DUP_PARTIAL,
+                    f->size - DUP_PARTIAL) == DUP_PARTIAL;
+    }
+    close(fd);
+
+    f->hash = hash_bytes(buf, len, 0);
+}
+
+static void
+dup_hash_full(void *arg, size_t i)
+{
+    struct dup_ctx *ctx = arg;
+    struct dupfile *f   = &ctx->files[i];
+
+    if (f->size > 2 * DUP_PARTIAL) {
+        f->ok = hash_file(ctx->rootfd, f->path, &f->hash);
+    }
+}
+
+/**
+ * Returns whether the files a and b below rootfd have the same contents
+ */
+static bool
+dup_same(int rootfd, const char *a, const char *b)
+{
+    int fda    = openat(rootfd, a, O_RDONLY);
+    int fdb    = openat(rootfd, b, O_RDONLY);
+    char *bufa = malloc(2 * DUP_COMPARE);
+    bool same  = fda >= 0 && fdb >= 0 && bufa;
+
+    if (same) {
+        posix_fadvise(fda, 0, 0, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(fdb, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    char *bufb = bufa + DUP_COMPARE;
+    while (same) {
+        ssize_t na = read(fda, bufa, DUP_COMPARE);
+        ssize_t nb = na > 0 ? read(fdb, bufb, na) : 0;
+        if (na <= 0) {
+            same = na == 0 && read(fdb, bufb, 1) == 0;
+            break;
+        }
+        same = nb == na && memcmp(bufa, bufb, na) == 0;
+    }
+
+    if (fda >= 0) {
+        close(fda);
+    }
+    if (fdb >= 0) {
+        close(fdb);
+    }
+    free(bufa);
+
+    return same;
+}
+
+/**
+ * Compares a file with the first one of its group byte by byte, so files
+ * are never taken for duplicates on a hash alone
+ */
+static void
+dup_verify(void *arg, size_t i)
+{
+    struct dup_ctx *ctx = arg;
+    struct dupfile *f   = &ctx->files[i];
+
+    if (f->head != i) {
+        f->ok = dup_same(ctx->rootfd, ctx->files[f->head].path, f->path);
+    }
+}
+
+/**
+ * Orders dupfiles by size and inode, to find hardlinks
+ */
+static int
+dupinodecmp(const void *va, const void *vb)
+{
+    const struct dupfile *a = va;
+    const struct dupfile *b = vb;
+
+    if (a->size != b->size) {
+        return a->size < b->size ? -1 : 1;
+    }
+    if (a->dev != b->dev) {
+        return a->dev < b->dev ? -1 : 1;
+    }
+    if (a->ino != b->ino) {
+        return a->ino < b->ino ? -1 : 1;
+    }
+
+    return strnatcmp(a->path, b->path);
+}
+
+/**
+ * Orders dupfiles by size and hash, so duplicates end up next to each other
+ */
+static int
+duphashcmp(const void *va, const void *vb)
+{
+    const struct dupfile *a = va;
+    const struct dupfile *b = vb;
+
+    if (a->size != b->size) {
+        return a->size < b->size ? -1 : 1;
+    }
+    if (a->hash != b->hash) {
+        return a->hash < b->hash ? -1 : 1;
+    }
+
+    return strnatcmp(a->path, b->path);
+}
+
+/**
+ * Drops all files that don't share size (and hash, if by_hash is set) with
+ * another one. Only one path of every inode is kept.
+ */
+static void
+dup_filter(struct dup_ctx *ctx, bool by_hash)
+{
+    size_t kept = 0;
+    size_t i    = 0;
+
+    while (i < ctx->n) {
+        size_t end = i + 1;
+        while (end < ctx->n && ctx->files[end].size == ctx->files[i].size &&
+               (!by_hash || ctx->files[end].hash == ctx->files[i].hash)) {
+            ++end;
+        }
+
+        size_t start = kept;
+        for (size_t j = i; j < end; ++j) {
+            const struct dupfile *f = &ctx->files[j];
+            bool same_inode         = kept > start &&
+                              ctx->files[kept - 1].dev == f->dev &&
+                              ctx->files[kept - 1].ino == f->ino;
+
+            if (f->ok && !same_inode) {
+                ctx->files[kept++] = *f;
+            } else {
+                free(f->path);
+            }
+        }
+
+        if (kept - start < 2) {
+            while (kept > start) {
+                free(ctx->files[--kept].path);
+            }
+        }
+
+        i = end;
+    }
+
+    ctx->n = kept;
+}
+
+/**
+ * Replaces list with all duplicate files below path. Files are grouped by
+ * size first, then only groups with more than one member get their head and
+ * tail hashed and only collisions of that get hashed completely. What still
+ * matches is compared byte by byte.
+ *
+ * All but the first file of every group get marked.
+ */
+static void
+find_duplicates(const char *path, struct listing *list, bool show_hidden)
+{
+    struct dup_ctx ctx = {.rootfd = open(path, O_RDONLY | O_DIRECTORY)};
+    if (ctx.rootfd < 0) {
+        set_status("duplicates: %s: %s", path, strerror(errno));
+        return;
+    }
+
+    set_status("scanning...");
+    pthread_mutex_init(&ctx.lock, NULL);
+    walk_tree(ctx.rootfd, show_hidden, dup_collect, &ctx, NULL);
+    pthread_mutex_destroy(&ctx.lock);
+    size_t total = ctx.n;
+
+    for (size_t i = 0; i < ctx.n; ++i) {
+        ctx.files[i].ok = true;
+    }
+    qsort(ctx.files, ctx.n, sizeof(*ctx.files), dupinodecmp);
+    dup_filter(&ctx, false);
+
+    set_status("hashing heads and tails of %zu files...", ctx.n);
+    parallel_for(ctx.n, dup_hash_partial, &ctx);
+    qsort(ctx.files, ctx.n, sizeof(*ctx.files), duphashcmp);
+    dup_filter(&ctx, true);
+
+    set_status("hashing %zu files...", ctx.n);
+    parallel_for(ctx.n, dup_hash_full, &ctx);
+    qsort(ctx.files, ctx.n, sizeof(*ctx.files), duphashcmp);
+    dup_filter(&ctx, true);
+
+    set_status("comparing %zu files...", ctx.n);
+    for (size_t i = 0; i < ctx.n; ++i) {
+        const struct dupfile *f = &ctx.files[i];
+        bool is_first =
+            i == 0 || f->size != f[-1].size || f->hash != f[-1].hash;
+        ctx.files[i].head = is_first ? i : f[-1].head;
+    }
+    parallel_for(ctx.n, dup_verify, &ctx);
+    dup_filter(&ctx, true);
+
+    listing_clear(list);
+
+    size_t groups = 0;
+    off_t wasted  = 0;
+    for (size_t i = 0; i < ctx.n; ++i) {
+        const struct dupfile *f = &ctx.files[i];
+        bool is_first =
+            i == 0 || f->size != f[-1].size || f->hash != f[-1].hash;
+
+        struct direlement *de = listing_push(list);
+        de->name              = listing_add_name(list, f->path);
+        de->type              = f->mode & S_IXUSR ? TYPE_EXEC : TYPE_NORM;
+        de->cmp               = CMP_NONE;
+        de->size              = f->size;
+        de->mtime             = f->mtime;
+        de->is_selected       = !is_first;
+
+        if (is_first) {
+            ++groups;
+        } else {
+            wasted += f->size;
+        }
+
+        free(f->path);
+    }
+    listing_count_marks(list, path, NULL, 0);
+
+    char buf[16];
+    set_status(
+        "%zu of %zu files are duplicates in %zu groups, %s reclaimable",
+        ctx.n - groups,
+        total,
+        groups,
+        format_size(wasted, buf, sizeof(buf)));
+
+    free(ctx.files);
+    close(ctx.rootfd);
+}
+
+static void *
+job_thread(void *arg)
+{
+    struct job *job = arg;
+
+    job->run(job);
+    atomic_store(&job->done, true);
+
+    return NULL;
+}
+
+/**
+ * Runs job->run in the background. The main loop polls it with job_poll
+ * and calls job->finish on the main thread once it's done.
+ */
+static bool
+job_start(struct job *job)
+{
+    atomic_init(&job->cancel, false);
+    atomic_init(&job->done, false);
+    atomic_init(&job->progress, 0);
+
+    if (pthread_create(&job->thread, NULL, job_thread, job) != 0) {
+        set_status("%s: %s", job->what, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Shows the progress of a job. Returns false once it's done.
+ */
+static bool
+job_poll(struct job *job)
+{
+    if (atomic_load(&job->done)) {
+        return false;
+    }
+
+    size_t total = atomic_load(&job->total);
+    if (total > 0) {
+        set_status(
+            "%s: %zu/%zu, esc to cancel",
+            job->what,
+            atomic_load(&job->progress),
+            total);
+    } else {
+        set_status(
+            "%s: %zu, esc to cancel", job->what, atomic_load(&job->progress));
+    }
+
+    return true;
+}
+
+/**
+ * Waits for a job (cancelling it if cancel is set), lets it patch the
+ * listing and frees it
+ */
+static void
+job_stop(struct job **jp, struct listing *list, bool cancel)
+{
+    struct job *job = *jp;
+    if (!job) {
+        return;
+    }
+    *jp = NULL;
+
+    if (cancel) {
+        atomic_store(&job->cancel, true);
+    }
+    pthread_join(job->thread, NULL);
+
+    job->finish(job, list);
+    fsinfo_invalidate();
+}
+
+/**
+ * Parses an attribute command: "chmod MODE", "chown USER[:GROUP]",
+ * "chown :GROUP" or "touch". MODE is octal or symbolic like "u+x,go-w".
+ */
+static bool
+attr_parse(const char *cmd, struct attrop *op)
+{
+    char arg[256];
+
+    memset(op, 0, sizeof(*op));
+    op->uid = (uid_t)-1;
+    op->gid = (gid_t)-1;
+
+    if (strcmp(cmd, "touch") == 0) {
+        op->kind = ATTR_TOUCH;
+        return true;
+    }
+
+    if (sscanf(cmd, "chmod %255s", arg) == 1) {
+        op->kind = ATTR_CHMOD;
+
+        char *end;
+        unsigned long mode = strtoul(arg, &end, 8);
+        if (*end == '\0' && mode <= 07777) {
+            op->is_octal = true;
+            op->octal    = mode;
+            return true;
+        }
+
+        op->umask = umask(0);
+        umask(op->umask);
+
+        for (const char *p = arg; *p;) {
+            if (op->nclauses == ATTR_MAX_CLAUSES) {
+                return false;
+            }
+            struct modeclause *c = &op->clauses[op->nclauses++];
+
+            for (; strchr("ugoa", *p); ++p) {
+                c->who |= *p == 'u'   ? S_IRWXU | S_ISUID
+                          : *p == 'g' ? S_IRWXG | S_ISGID
+                          : *p == 'o' ? S_IRWXO | S_ISVTX
+                                      : 07777;
+            }
+            if (c->who == 0) {
+                c->who    = 07777;
+                c->masked = true;
+            }
+
+            if (!*p || !strchr("+-=", *p)) {
+                return false;
+            }
+            c->op = *p++;
+
+            for (; *p && *p != ','; ++p) {
+                switch (*p) {
+                case 'r':
+                    c->perm |= S_IRUSR | S_IRGRP | S_IROTH;
+                    break;
+                case 'w':
+                    c->perm |= S_IWUSR | S_IWGRP | S_IWOTH;
+                    break;
+                case 'x':
+                    c->perm |= S_IXUSR | S_IXGRP | S_IXOTH;
+                    break;
+                case 'X':
+                    c->cond_exec = true;
+                    break;
+                case 's':
+                    c->perm |= S_ISUID | S_ISGID;
+                    break;
+                case 't':
+                    c->perm |= S_ISVTX;
+                    break;
+                default:
+                    return false;
+                }
+            }
+            if (*p == ',') {
+                ++p;
+            }
+        }
+
+        return op->nclauses > 0;
+    }
+
+    if (sscanf(cmd, "chown %255s", arg) == 1) {
+        op->kind    = ATTR_CHOWN;
+        char *group = strchr(arg, ':');
+        if (group) {
+            *group++ = '\0';
+        }
+
+        if (arg[0] != '\0') {
+            struct passwd *pw = getpwnam(arg);
+            if (!pw) {
+                return false;
+            }
+            op->uid = pw->pw_uid;
+        }
+
+        if (group && group[0] != '\0') {
+            struct group *gr = getgrnam(group);
+            if (!gr) {
+                return false;
+            }
+            op->gid = gr->gr_gid;
+        }
+
+        return op->uid != (uid_t)-1 || op->gid != (gid_t)-1;
+    }
+
+    return false;
+}
+
+static mode_t
+attr_mode(const struct attrop *op, mode_t old)
+{
+    if (op->is_octal) {
+        return op->octal;
+    }
+
+    mode_t mode = old & 07777;
+    for (size_t i = 0; i < op->nclauses; ++i) {
+        const struct modeclause *c = &op->clauses[i];
+        mode_t perm                = c->perm;
+
+        if (c->cond_exec &&
+            (S_ISDIR(old) || (old & (S_IXUSR | S_IXGRP | S_IXOTH)))) {
+            perm |= S_IXUSR | S_IXGRP | S_IXOTH;
+        }
+        perm &= c->who;
+        if (c->masked) {
+            perm &= ~op->umask;
+        }
+
+        if (c->op == '+') {
+            mode |= perm;
+        } else if (c->op == '-') {
+            mode &= ~perm;
+        } else {
+            mode = (mode & ~c->who) | perm;
+        }
+    }
+
+    return mode;
+}
+
+/**
+ * Applies op to name in dirfd, skipping the syscall if sb shows that nothing
+ * would change. Returns 1 if something changed, 0 if not and -1 on errors.
+ */
+static int
+attr_apply(
+    const struct attrop *op,
+    int dirfd,
+    const char *name,
+    const struct stat *sb)
+{
+    switch (op->kind) {
+    case ATTR_CHMOD: {
+        mode_t mode = attr_mode(op, sb->st_mode);
+        if (S_ISLNK(sb->st_mode) || mode == (sb->st_mode & 07777)) {
+            return 0; // symlinks have no mode of their own
+        }
+        return fchmodat(dirfd, name, mode, 0) < 0 ? -1 : 1;
+    }
+    case ATTR_CHOWN:
+        if ((op->uid == (uid_t)-1 || op->uid == sb->st_uid) &&
+            (op->gid == (gid_t)-1 || op->gid == sb->st_gid)) {
+            return 0;
+        }
+        return fchownat(dirfd, name, op->uid, op->gid, AT_SYMLINK_NOFOLLOW) < 0
+                   ? -1
+                   : 1;
+    case ATTR_TOUCH:
+        return utimensat(dirfd, name, NULL, AT_SYMLINK_NOFOLLOW) < 0 ? -1 : 1;
+    }
+
+    return -1;
+}
+
+static void
+attr_count(struct attrjob *aj, int res)
+{
+    if (res > 0) {
+        atomic_fetch_add(&aj->changed, 1);
+    } else if (res < 0) {
+        atomic_fetch_add(&aj->failed, 1);
+    }
+    atomic_fetch_add(&aj->job.progress, 1);
+}
+
+static void
+attr_visit(void *arg, int dirfd, const char *relpath, const struct stat *sb)
+{
+    struct attrjob *aj = arg;
+    const char *name   = strrchr(relpath, '/');
+    name               = name ? name + 1 : relpath;
+
+    if (!atomic_load(&aj->job.cancel)) {
+        attr_count(aj, attr_apply(&aj->op, dirfd, name, sb));
+    }
+}
+
+static void
+attr_item(void *arg, size_t i)
+{
+    struct attrjob *aj    = arg;
+    struct attritem *item = &aj->items[i];
+    struct stat sb;
+
+    if (atomic_load(&aj->job.cancel) ||
+        fstatat(aj->dirfd, item->name, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
+        return;
+    }
+
+    int res = attr_apply(&aj->op, aj->dirfd, item->name, &sb);
+    attr_count(aj, res);
+
+    if (res > 0 &&
+        fstatat(aj->dirfd, item->name, &item->sb, AT_SYMLINK_NOFOLLOW) == 0) {
+        item->changed = true;
+    }
+
+    item->descend = aj->op.recursive && S_ISDIR(sb.st_mode);
+}
+
+/**
+ * Applies the op to the items in parallel, then walks the directories among
+ * them one at a time since walk_tree already keeps all cpus busy
+ */
+static void
+attr_run(struct job *job)
+{
+    struct attrjob *aj = (struct attrjob *)job;
+
+    parallel_for(aj->n, attr_item, aj);
+
+    for (size_t i = 0; i < aj->n && !atomic_load(&job->cancel); ++i) {
+        if (!aj->items[i].descend) {
+            continue;
+        }
+        int fd = openat(
+            aj->dirfd, aj->items[i].name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if (fd >= 0) {
+            walk_tree(fd, true, attr_visit, aj, &job->cancel);
+            close(fd);
+        }
+    }
+}
+
+/**
+ * Updates the cached metadata of the entries that changed
+ */
+static void
+attr_finish(struct job *job, struct listing *list)
+{
+    struct attrjob *aj = (struct attrjob *)job;
+
+    for (size_t i = 0; i < aj->n; ++i) {
+        const struct attritem *item = &aj->items[i];
+        if (!item->changed || list->gen != aj->gen || item->idx >= list->n ||
+            strcmp(listing_name(list, item->idx), item->name) != 0) {
+            continue;
+        }
+
+        struct direlement *de = &list->ents[item->idx];
+        de->mtime             = item->sb.st_mtim;
+        if (de->type == TYPE_EXEC || de->type == TYPE_NORM) {
+            de->type = item->sb.st_mode & S_IXUSR ? TYPE_EXEC : TYPE_NORM;
+        }
+    }
+    g_needs_redraw = true;
+
+    set_status(
+        "%s: %zu changed, %zu unchanged, %zu failed%s",
+        job->what,
+        atomic_load(&aj->changed),
+        atomic_load(&job->progress) - atomic_load(&aj->changed) -
+            atomic_load(&aj->failed),
+        atomic_load(&aj->failed),
+        atomic_load(&job->cancel) ? " (cancelled)" : "");
+
+    for (size_t i = 0; i < aj->n; ++i) {
+        free(aj->items[i].name);
+    }
+    free(aj->items);
+    close(aj->dirfd);
+    free(aj);
+}
+
+/**
+ * Starts a background job applying cmd to the marked entries (or the one
+ * at sel if none are marked), recursing into directories if recursive is set
+ */
+static struct job *
+attr_start(
+    const char *path,
+    const char *cmd,
+    struct listing *list,
+    size_t sel,
+    bool recursive)
+{
+    struct attrjob *aj = calloc(1, sizeof(*aj));
+    if (!aj) {
+        return NULL;
+    }
+
+    if (!attr_parse(cmd, &aj->op)) {
+        set_status("invalid command: %s", cmd);
+        free(aj);
+        return NULL;
+    }
+    aj->op.recursive = recursive;
+
+    aj->dirfd = open(path, O_RDONLY | O_DIRECTORY);
+    aj->items = malloc((list->n + 1) * sizeof(*aj->items));
+    if (aj->dirfd < 0 || !aj->items) {
+        set_status("%s: %s", cmd, strerror(errno));
+        if (aj->dirfd >= 0) {
+            close(aj->dirfd);
+        }
+        free(aj->items);
+        free(aj);
+        return NULL;
+    }
+
+    bool any_selected = false;
+    for (size_t i = 0; i < list->n; ++i) {
+        any_selected |= list->ents[i].is_selected;
+    }
+
+    for (size_t i = 0; i < list->n; ++i) {
+        const struct direlement *de = &list->ents[i];
+        if ((any_selected ? !de->is_selected : i != sel) ||
+            de->cmp == CMP_ONLY_RIGHT) {
+            continue;
+        }
+
+        char *name = strdup(listing_name(list, i));
+        if (name) {
+            aj->items[aj->n++] = (struct attritem){.name = name, .idx = i};
+        }
+    }
+
+    aj->gen        = list->gen;
+    aj->job.total  = recursive ? 0 : aj->n;
+    aj->job.run    = attr_run;
+    aj->job.finish = attr_finish;
+    atomic_init(&aj->changed, 0);
+    atomic_init(&aj->failed, 0);
+    snprintf(aj->what, sizeof(aj->what), "%s", cmd);
+    aj->job.what = aj->what;
+
+    if (!job_start(&aj->job)) {
+        aj->job.finish(&aj->job, list);
+        return NULL;
+    }
+
+    return &aj->job;
+}
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static uint32_t
+rotr32(uint32_t x, int n)
+{
+    return x >> n | x << (32 - n);
+}
+
+static void
+sha256_init(struct sha256 *s)
+{
+    static const uint32_t init[8] = {
+        0x6a09e667,
+        0xbb67ae85,
+        0x3c6ef372,
+        0xa54ff53a,
+        0x510e527f,
+        0x9b05688c,
+        0x1f83d9ab,
+        0x5be0cd19,
+    };
+
+    memcpy(s->h, init, sizeof(init));
+    s->len  = 0;
+    s->used = 0;
+}
+
+static void
+sha256_block(uint32_t h[8], const unsigned char *p)
+{
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i) {
+        w[i] = load_be32(p + 4 * i);
+    }
+    for (int i = 16; i < 64; ++i) {
+        uint32_t s0 =
+            rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ w[i - 15] >> 3;
+        uint32_t s1 =
+            rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ w[i - 2] >> 10;
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t v[8];
+    memcpy(v, h, sizeof(v));
+    for (int i = 0; i < 64; ++i) {
+        uint32_t s1  = rotr32(v[4], 6) ^ rotr32(v[4], 11) ^ rotr32(v[4], 25);
+        uint32_t ch  = (v[4] & v[5]) ^ (~v[4] & v[6]);
+        uint32_t t1  = v[7] + s1 + ch + sha256_k[i] + w[i];
+        uint32_t s0  = rotr32(v[0], 2) ^ rotr32(v[0], 13) ^ rotr32(v[0], 22);
+        uint32_t maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+
+        memmove(v + 1, v, 7 * sizeof(*v));
+        v[4] += t1;
+        v[0] = t1 + s0 + maj;
+    }
+
+    for (int i = 0; i < 8; ++i) {
+        h[i] += v[i];
+    }
+}
+
+static void
+sha256_update(struct sha256 *s, const unsigned char *data, size_t len)
+{
+    s->len += len;
+
+    if (s->used > 0) {
+        size_t take = 64 - s->used < len ? 64 - s->used : len;
+        memcpy(s->buf + s->used, data, take);
+        s->used += take;
+        data += take;
+        len -= take;
+        if (s->used < 64) {
+            return;
+        }
+        sha256_block(s->h, s->buf);
+        s->used = 0;
+    }
+
+    for (; len >= 64; data += 64, len -= 64) {
+        sha256_block(s->h, data);
+    }
+
+    memcpy(s->buf, data, len);
+    s->used = len;
+}
+
+static void
+sha256_final(struct sha256 *s, unsigned char out[SHA256_SIZE])
+{
+    uint64_t bits = s->len * 8;
+
+    unsigned char pad[72] = {0x80};
+    size_t padlen         = (s->used < 56 ? 56 : 120) - s->used;
+    for (int i = 0; i < 8; ++i) {
+        pad[padlen + i] = bits >> (56 - 8 * i);
+    }
+    sha256_update(s, pad, padlen + 8);
+
+    for (int i = 0; i < 8; ++i) {
+        out[4 * i]     = s->h[i] >> 24;
+        out[4 * i + 1] = s->h[i] >> 16;
+        out[4 * i + 2] = s->h[i] >> 8;
+        out[4 * i + 3] = s->h[i];
+    }
+}
+
+/**
+ * Hashes the file name of dirfd through buf, reading it sequentially
+ */
+static bool
+sum_file(
+    int dirfd,
+    const char *name,
+    unsigned char *buf,
+    const atomic_bool *cancel,
+    unsigned char out[SHA256_SIZE])
+{
+    int fd = openat(dirfd, name, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    struct sha256 s;
+    sha256_init(&s);
+
+    ssize_t n = 0;
+    while (!atomic_load(cancel)) {
+        n = read(fd, buf, SUM_BUFFER);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            break;
+        }
+        sha256_update(&s, buf, n);
+    }
+    close(fd);
+
+    // a cancelled hash stops early and must not pass for the file's
+    if (n != 0 || atomic_load(cancel)) {
+        return false;
+    }
+
+    sha256_final(&s, out);
+    return true;
+}
+
+static void
+sum_add(struct sumjob *sj, char *path)
+{
+    pthread_mutex_lock(&sj->lock);
+    if (sj->n == sj->size) {
+        sj->size = sj->size ? sj->size * 2 : 256;
+        struct sumfile *tmp = realloc(sj->files, sj->size * sizeof(*tmp));
+        if (!tmp) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        sj->files = tmp;
+    }
+    sj->files[sj->n++] = (struct sumfile){.path = path};
+    pthread_mutex_unlock(&sj->lock);
+
+    atomic_fetch_add(&sj->job.progress, 1);
+}
+
+static void
+sum_visit(
+    void *arg,
+    int UNUSED(dirfd),
+    const char *relpath,
+    const struct stat *sb)
+{
+    struct sumwalk *w = arg;
+    if (!S_ISREG(sb->st_mode) ||
+        (sb->st_dev == w->sj->skip_dev && sb->st_ino == w->sj->skip_ino)) {
+        return;
+    }
+
+    char *path = malloc(strlen(w->prefix) + strlen(relpath) + 2);
+    if (!path) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(path, "%s%s%s", w->prefix, w->prefix[0] ? "/" : "", relpath);
+    sum_add(w->sj, path);
+}
+
+/**
+ * Collects the regular files below the roots of sj, or the whole directory
+ */
+static void
+sum_collect(struct sumjob *sj)
+{
+    if (sj->nroots == 0) {
+        struct sumwalk w = {.sj = sj, .prefix = ""};
+        walk_tree(sj->dirfd, sj->show_hidden, sum_visit, &w, &sj->job.cancel);
+        return;
+    }
+
+    for (size_t i = 0; i < sj->nroots; ++i) {
+        struct stat sb;
+        if (fstatat(sj->dirfd, sj->roots[i], &sb, AT_SYMLINK_NOFOLLOW) < 0) {
+            continue;
+        }
+
+        if (S_ISDIR(sb.st_mode)) {
+            int fd = openat(
+                sj->dirfd, sj->roots[i], O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+            if (fd >= 0) {
+                struct sumwalk w = {.sj = sj, .prefix = sj->roots[i]};
+                walk_tree(fd, sj->show_hidden, sum_visit, &w, &sj->job.cancel);
+                close(fd);
+            }
+        } else {
+            struct sumwalk w = {.sj = sj, .prefix = ""};
+            sum_visit(&w, sj->dirfd, sj->roots[i], &sb);
+        }
+    }
+}
+
+static int
+hexval(int c)
+{
+    return isdigit(c) ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+/**
+ * Reads the files and checksums to verify from the manifest. Names with a
+ * newline or backslash are escaped like sha256sum does.
+ */
+static void
+sum_read_manifest(struct sumjob *sj)
+{
+    int fd   = openat(sj->dirfd, sj->manifest, O_RDONLY);
+    FILE *in = fd < 0 ? NULL : fdopen(fd, "r");
+    if (!in) {
+        sj->err = errno;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, in)) > 0) {
+        if (line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+
+        bool escaped     = line[0] == '\\';
+        char *p          = line + escaped;
+        struct sumfile f = {0};
+        bool valid       = len - escaped > 2 * SHA256_SIZE + 2;
+        for (size_t i = 0; valid && i < 2 * SHA256_SIZE; ++i) {
+            int hi = hexval(tolower((unsigned char)p[i]));
+            valid  = hi >= 0;
+            f.want[i / 2] |= valid ? hi << (i % 2 ? 0 : 4) : 0;
+        }
+        p += 2 * SHA256_SIZE;
+        if (!valid || p[0] != ' ' || (p[1] != ' ' && p[1] != '*')) {
+            ++sj->malformed;
+            continue;
+        }
+        p += 2;
+
+        char *out = p;
+        for (char *q = p; *q; ++q) {
+            if (escaped && q[0] == '\\' && q[1] != '\0') {
+                *out++ = *++q == 'n' ? '\n' : *q;
+            } else {
+                *out++ = *q;
+            }
+        }
+        *out = '\0';
+
+        if (!(f.path = strdup(p))) {
+            perror("strdup");
+            exit(EXIT_FAILURE);
+        }
+        sum_add(sj, f.path);
+        memcpy(sj->files[sj->n - 1].want, f.want, SHA256_SIZE);
+    }
+    free(line);
+    fclose(in);
+}
+
+static int
+sumfilecmp(const void *va, const void *vb)
+{
+    const struct sumfile *a = va;
+    const struct sumfile *b = vb;
+
+    return strcmp(a->path, b->path);
+}
+
+static void
+sum_write_manifest(struct sumjob *sj)
+{
+    qsort(sj->files, sj->n, sizeof(*sj->files), sumfilecmp);
+
+    int fd = openat(
+        sj->dirfd, sj->manifest, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    FILE *out = fd < 0 ? NULL : fdopen(fd, "w");
+    if (!out) {
+        sj->err = errno;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+
+    static const char hex[] = "0123456789abcdef";
+    for (size_t i = 0; i < sj->n; ++i) {
+        const struct sumfile *f = &sj->files[i];
+        if (!f->ok) {
+            continue;
+        }
+
+        bool escape = strpbrk(f->path, "\\\n") != NULL;
+        if (escape) {
+            fputc('\\', out);
+        }
+        for (size_t j = 0; j < SHA256_SIZE; ++j) {
+            fputc(hex[f->sum[j] >> 4], out);
+            fputc(hex[f->sum[j] & 0xf], out);
+        }
+        fputs("  ", out);
+        for (const char *p = f->path; *p; ++p) {
+            if (escape && (*p == '\\' || *p == '\n')) {
+                fputc('\\', out);
+                fputc(*p == '\n' ? 'n' : '\\', out);
+            } else {
+                fputc(*p, out);
+            }
+        }
+        fputc('\n', out);
+    }
+
+    if (fclose(out) != 0) {
+        sj->err = errno;
+    }
+}
+
+/**
+ * Hashes the files of the job one after another, with one buffer per thread
+ */
+static void *
+sum_worker(void *arg)
+{
+    struct sumjob *sj = arg;
+
+    void *buf;
+    if (posix_memalign(&buf, SUM_ALIGN, SUM_BUFFER) != 0) {
+        return NULL;
+    }
+    mem_alloc(MEM_JOBS, SUM_BUFFER);
+
+    size_t i;
+    while ((i = atomic_fetch_add(&sj->next, 1)) < sj->n) {
+        struct sumfile *f = &sj->files[i];
+        f->ok = sum_file(sj->dirfd, f->path, buf, &sj->job.cancel, f->sum);
+        atomic_fetch_add(&sj->job.progress, 1);
+    }
+    mem_free(MEM_JOBS, SUM_BUFFER);
+    free(buf);
+
+    return NULL;
+}
+
+static void
+sum_run(struct job *job)
+{
+    struct sumjob *sj = (struct sumjob *)job;
+
+    if (sj->verify) {
+        sum_read_manifest(sj);
+    } else {
+        sum_collect(sj);
+    }
+
+    atomic_store(&job->progress, 0);
+    atomic_store(&job->total, sj->n);
+    run_threads(sum_worker, sj, sj->n);
+
+    if (!sj->verify && !atomic_load(&job->cancel)) {
+        sum_write_manifest(sj);
+    }
+}
+
+/**
+ * Reports the outcome. Files that don't match the manifest (or can't be
+ * read) replace the listing, marked.
+ */
+static void
+sum_finish(struct job *job, struct listing *list)
+{
+    struct sumjob *sj = (struct sumjob *)job;
+    bool cancelled    = atomic_load(&job->cancel);
+
+    size_t unreadable = 0;
+    size_t failed     = 0;
+    for (size_t i = 0; i < sj->n; ++i) {
+        const struct sumfile *f = &sj->files[i];
+        unreadable += !f->ok;
+        failed += sj->verify && f->ok &&
+                  memcmp(f->sum, f->want, SHA256_SIZE) != 0;
+    }
+
+    if (sj->err != 0) {
+        set_status("%s: %s", sj->manifest, strerror(sj->err));
+    } else if (sj->verify) {
+        set_status(
+            "%s: %zu OK, %zu FAILED, %zu unreadable, %zu malformed lines%s",
+            sj->manifest,
+            sj->n - failed - unreadable,
+            failed,
+            unreadable,
+            sj->malformed,
+            cancelled ? " (cancelled)" : "");
+    } else {
+        set_status(
+            "%s: %zu files written, %zu unreadable%s",
+            sj->manifest,
+            sj->n - unreadable,
+            unreadable,
+            cancelled ? " (not written, cancelled)" : "");
+    }
+
+    if (sj->verify && !cancelled && failed + unreadable > 0) {
+        listing_clear(list);
+        for (size_t i = 0; i < sj->n; ++i) {
+            const struct sumfile *f = &sj->files[i];
+            if (f->ok && memcmp(f->sum, f->want, SHA256_SIZE) == 0) {
+                continue;
+            }
+
+            struct direlement *de = listing_push(list);
+            de->name              = listing_add_name(list, f->path);
+            de->type              = TYPE_NORM; // unless it is still there
+            de->unreadable        = !f->ok;
+            de->is_selected       = true;
+            stat_element(sj->dirfd, f->path, de);
+        }
+        listing_count_marks(list, sj->dir, NULL, 0);
+        g_needs_redraw = true;
+    }
+
+    for (size_t i = 0; i < sj->n; ++i) {
+        free(sj->files[i].path);
+    }
+    for (size_t i = 0; i < sj->nroots; ++i) {
+        free(sj->roots[i]);
+    }
+    free(sj->files);
+    free(sj->roots);
+    pthread_mutex_destroy(&sj->lock);
+    close(sj->dirfd);
+    free(sj);
+}
+
+/**
+ * Starts a background job hashing the marked entries (or everything below
+ * path if none are marked) into manifest, or checking the files listed in it
+ * if verify is set
+ */
+static struct job *
+sum_start(
+    const char *path,
+    const char *manifest,
+    struct listing *list,
+    bool show_hidden,
+    bool verify)
+{
+    struct sumjob *sj = calloc(1, sizeof(*sj));
+    if (!sj) {
+        return NULL;
+    }
+
+    sj->dirfd = open(path, O_RDONLY | O_DIRECTORY);
+    sj->roots = malloc((list->marks.n + 1) * sizeof(*sj->roots));
+    if (sj->dirfd < 0 || !sj->roots) {
+        set_status("%s: %s", path, strerror(errno));
+        if (sj->dirfd >= 0) {
+            close(sj->dirfd);
+        }
+        free(sj->roots);
+        free(sj);
+        return NULL;
+    }
+
+    for (size_t i = 0; !verify && i < list->n; ++i) {
+        if (list->ents[i].is_selected) {
+            char *name = strdup(listing_name(list, i));
+            if (name) {
+                sj->roots[sj->nroots++] = name;
+            }
+        }
+    }
+
+    struct stat sb;
+    if (fstatat(sj->dirfd, manifest, &sb, 0) == 0) {
+        sj->skip_dev = sb.st_dev;
+        sj->skip_ino = sb.st_ino;
+    }
+
+    snprintf(sj->dir, sizeof(sj->dir), "%s", path);
+    snprintf(sj->manifest, sizeof(sj->manifest), "%s", manifest);
+    sj->verify      = verify;
+    sj->show_hidden = show_hidden;
+    pthread_mutex_init(&sj->lock, NULL);
+    atomic_init(&sj->next, 0);
+    atomic_init(&sj->job.total, 0);
+    sj->job.what   = "sha256";
+    sj->job.run    = sum_run;
+    sj->job.finish = sum_finish;
+
+    if (!job_start(&sj->job)) {
+        sj->job.finish(&sj->job, list);
+        return NULL;
+    }
+
+    return &sj->job;
+}
+
+/**
+ * Writes out what was buffered for the archive
+ */
+static bool
+tar_flush(struct tarjob *tj)
+{
+    for (size_t done = 0; done < tj->len && tj->err == 0;) {
+        ssize_t n = write(tj->out, tj->buf + done, tj->len - done);
+        if (n < 0 && errno != EINTR) {
+            tj->err = errno;
+        } else if (n == 0) {
+            tj->err = EIO; // would loop forever otherwise
+        }
+        done += n > 0 ? n : 0;
+    }
+    tj->written += tj->len;
+    tj->len = 0;
+
+    return tj->err == 0;
+}
+
+/**
+ * Returns room for len bytes in the buffer, which have to be filled
+ */
+static char *
+tar_reserve(struct tarjob *tj, size_t len)
+{
+    if (tj->len + len > TAR_BUFFER) {
+        tar_flush(tj);
+    }
+
+    char *p = tj->buf + tj->len;
+    memset(p, 0, len);
+    tj->len += len;
+
+    return p;
+}
+
+/**
+ * Writes val into a numeric header field as octal digits followed by a NUL.
+ * Values that don't fit are written in GNU tar's base-256 form instead: the
+ * high bit of the first byte set and the value in big endian.
+ */
+static void
+tar_number(char *field, size_t size, unsigned long long val)
+{
+    if ((val >> (3 * (size - 1))) == 0) {
+        field[size - 1] = '\0';
+        for (size_t i = size - 1; i-- > 0; val >>= 3) {
+            field[i] = '0' + (val & 7);
+        }
+        return;
+    }
+
+    memset(field, 0, size);
+    for (size_t i = size; i-- > 1; val >>= 8) {
+        field[i] = val & 0xff;
+    }
+    field[0] = (char)0x80;
+}
+
+/**
+ * Appends a pax record "LEN key=value\n", where LEN counts itself
+ */
+static void
+tar_pax_record(char *buf, size_t *len, const char *key, const char *value)
+{
+    size_t body = strlen(key) + strlen(value) + 3; // space, = and newline
+    size_t n    = body + 1;
+    while (snprintf(NULL, 0, "%zu", n) + body != n) {
+        ++n;
+    }
+
+    *len += sprintf(buf + *len, "%zu %s=%s\n", n, key, value);
+}
+
+/**
+ * Writes the header of an entry. Paths and link targets that don't fit into
+ * ustar's fields and sizes beyond 8 GiB go into a pax header first.
+ */
+static void
+tar_header(
+    struct tarjob *tj,
+    const char *path,
+    const struct stat *sb,
+    char type,
+    const char *target)
+{
+    size_t plen = strlen(path);
+    size_t tlen = target ? strlen(target) : 0;
+    bool big    = sb->st_size > 077777777777LL;
+
+    // split long paths into prefix and name at a slash if possible
+    const char *name = path;
+    size_t prefix    = 0;
+    if (plen >= 100) {
+        const char *slash = memchr(path + plen - 100, '/', 100);
+        if (slash && slash - path <= 155 && slash[1] != '\0') {
+            prefix = slash - path;
+            name   = slash + 1;
+        }
+    }
+    bool pax = strlen(name) >= 100 || tlen >= 100 || big;
+
+    if (pax) {
+        char *rec = malloc(2 * PATH_MAX + 64);
+        if (!rec) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+
+        size_t len = 0;
+        tar_pax_record(rec, &len, "path", path);
+        if (tlen >= 100) {
+            tar_pax_record(rec, &len, "linkpath", target);
+        }
+        if (big) {
+            char size[32];
+            snprintf(size, sizeof(size), "%lld", (long long)sb->st_size);
+            tar_pax_record(rec, &len, "size", size);
+        }
+
+        struct stat xsb = {.st_mode = 0644, .st_size = len};
+        tar_header(tj, "././@PaxHeader", &xsb, 'x', NULL);
+        memcpy(
+            tar_reserve(tj, (len + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK),
+            rec,
+            len);
+        free(rec);
+
+        name   = path;
+        prefix = 0;
+    }
+
+    char *h = tar_reserve(tj, TAR_BLOCK);
+    memcpy(h, name, strnlen(name, 100));
+    tar_number(h + 100, 8, sb->st_mode & 07777);
+    tar_number(h + 108, 8, sb->st_uid);
+    tar_number(h + 116, 8, sb->st_gid);
+    tar_number(h + 124, 12, big ? 0 : (unsigned long long)sb->st_size);
+    tar_number(h + 136, 12, sb->st_mtime > 0 ? sb->st_mtime : 0);
+    h[156] = type;
+    if (target) {
+        memcpy(h + 157, target, tlen < 100 ? tlen : 100);
+    }
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+    memcpy(h + 345, path, prefix);
+
+    memset(h + 148, ' ', 8);
+    unsigned sum = 0;
+    for (size_t i = 0; i < TAR_BLOCK; ++i) {
+        sum += (unsigned char)h[i];
+    }
+    tar_number(h + 148, 7, sum); // six digits, a NUL and the space
+}
+
+/**
+ * Appends size bytes of fd and pads them to a full block. Large files are
+ * moved by sendfile, without copying them through the buffer. If the file
+ * shrank meanwhile the rest is padded with zeros, so the archive stays valid.
+ */
+static void
+tar_data(struct tarjob *tj, int fd, off_t size)
+{
+    off_t left = size;
+
+    if (tj->use_sendfile && size >= TAR_SENDFILE_MIN && tar_flush(tj)) {
+        while (left > 0 && !atomic_load(&tj->job.cancel)) {
+            ssize_t n = sendfile(tj->out, fd, NULL, left);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                tj->use_sendfile = false; // fall back to reading
+                break;
+            } else if (n < 0) {
+                tj->err = errno;
+                break;
+            } else if (n == 0) {
+                break;
+            }
+            left -= n;
+            tj->written += n;
+        }
+    }
+
+    while (left > 0 && !atomic_load(&tj->job.cancel) && tj->err == 0) {
+        if (tj->len == TAR_BUFFER) {
+            tar_flush(tj);
+        }
+
+        off_t room = TAR_BUFFER - tj->len;
+        ssize_t n  = read(fd, tj->buf + tj->len, left < room ? left : room);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            break;
+        }
+        tj->len += n;
+        left -= n;
+    }
+
+    size_t pad = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+    while (left > 0 && tj->err == 0) {
+        size_t n = left < TAR_BLOCK ? left : TAR_BLOCK;
+        tar_reserve(tj, n);
+        left -= n;
+    }
+    tar_reserve(tj, pad);
+}
+
+/**
+ * Returns the path a file with several links was packed with before, or
+ * records the current path for it and returns NULL
+ */
+static const char *
+tar_link(struct tarjob *tj, const struct stat *sb)
+{
+    if (tj->nlinks * 2 >= tj->links_size) {
+        size_t size = tj->links_size ? tj->links_size * 2 : 64;
+        struct tarlink *links = calloc(size, sizeof(*links));
+        if (!links) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < tj->links_size; ++i) {
+            struct tarlink *l = &tj->links[i];
+            if (!l->path) {
+                continue;
+            }
+            size_t j = (l->ino * HASH_PRIME1 ^ l->dev) & (size - 1);
+            while (links[j].path) {
+                j = (j + 1) & (size - 1);
+            }
+            links[j] = *l;
+        }
+        free(tj->links);
+        tj->links      = links;
+        tj->links_size = size;
+    }
+
+    size_t mask = tj->links_size - 1;
+    size_t i    = (sb->st_ino * HASH_PRIME1 ^ sb->st_dev) & mask;
+    for (; tj->links[i].path; i = (i + 1) & mask) {
+        if (tj->links[i].dev == sb->st_dev && tj->links[i].ino == sb->st_ino) {
+            return tj->links[i].path;
+        }
+    }
+
+    char *copy = strdup(tj->path);
+    if (!copy) {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+    tj->links[i] = (struct tarlink){sb->st_dev, sb->st_ino, copy};
+    ++tj->nlinks;
+
+    return NULL;
+}
+
+/**
+ * Reads the names in the directory at tj->path into lv
+ */
+static bool
+tar_read_dir(struct tarjob *tj, struct tarlevel *lv)
+{
+    int fd = openat(tj->dirfd, tj->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    DIR *dir = fd < 0 ? NULL : fdopendir(fd);
+    if (!dir) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+
+    *lv         = (struct tarlevel){.pathlen = strlen(tj->path)};
+    size_t size = 0;
+
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+        if (!is_listed(ent->d_name, true)) {
+            continue;
+        }
+
+        size_t len = strlen(ent->d_name) + 1;
+        if (lv->len + len > size) {
+            size      = size ? size * 2 : 4096;
+            char *tmp = realloc(lv->names, size);
+            if (!tmp) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+            lv->names = tmp;
+        }
+        memcpy(lv->names + lv->len, ent->d_name, len);
+        lv->len += len;
+    }
+    closedir(dir);
+
+    return true;
+}
+
+/**
+ * Appends the entry at tj->path. For directories only the header is written
+ * and lv is filled with their entries, in which case true is returned.
+ */
+static bool
+tar_entry(struct tarjob *tj, struct tarlevel *lv)
+{
+    struct stat sb;
+    if (fstatat(tj->dirfd, tj->path, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
+        ++tj->failed;
+        return false;
+    }
+    if (sb.st_dev == tj->skip_dev && sb.st_ino == tj->skip_ino) {
+        return false;
+    }
+
+    bool dir = false;
+    if (S_ISREG(sb.st_mode)) {
+        int fd = openat(tj->dirfd, tj->path, O_RDONLY | O_NOFOLLOW);
+        if (fd < 0) {
+            ++tj->failed;
+            return false;
+        }
+
+        const char *first = sb.st_nlink > 1 ? tar_link(tj, &sb) : NULL;
+        if (first) {
+            sb.st_size = 0;
+            tar_header(tj, tj->path, &sb, '1', first);
+        } else {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            tar_header(tj, tj->path, &sb, '0', NULL);
+            tar_data(tj, fd, sb.st_size);
+        }
+        close(fd);
+    } else if (S_ISLNK(sb.st_mode)) {
+        char target[PATH_MAX];
+        ssize_t len =
+            readlinkat(tj->dirfd, tj->path, target, sizeof(target) - 1);
+        if (len < 0) {
+            ++tj->failed;
+            return false;
+        }
+        target[len] = '\0';
+        sb.st_size  = 0;
+        tar_header(tj, tj->path, &sb, '2', target);
+    } else if (S_ISDIR(sb.st_mode)) {
+        if (!tar_read_dir(tj, lv)) {
+            ++tj->failed;
+            return false;
+        }
+
+        char dirpath[PATH_MAX + 1];
+        snprintf(dirpath, sizeof(dirpath), "%s/", tj->path);
+        sb.st_size = 0;
+        tar_header(tj, dirpath, &sb, '5', NULL);
+        dir = true;
+    } else {
+        return false; // devices, fifos and sockets aren't packed
+    }
+
+    atomic_fetch_add(&tj->job.progress, 1);
+    return dir;
+}
+
+/**
+ * Appends root, which is in tj->dirfd, and everything below it. Directories
+ * are walked with a stack of their own, so neither deep trees nor the limit
+ * on open files get in the way.
+ */
+static void
+tar_tree(struct tarjob *tj, const char *root)
+{
+    struct tarlevel *stack = NULL;
+    size_t depth           = 0;
+    size_t size            = 0;
+    struct tarlevel lv;
+
+    snprintf(tj->path, sizeof(tj->path), "%s", root);
+    bool push = tar_entry(tj, &lv);
+
+    for (;;) {
+        if (push) {
+            if (depth == size) {
+                size                 = size ? size * 2 : 16;
+                struct tarlevel *tmp = realloc(stack, size * sizeof(*tmp));
+                if (!tmp) {
+                    perror("realloc");
+                    exit(EXIT_FAILURE);
+                }
+                stack = tmp;
+            }
+            stack[depth++] = lv;
+        }
+        push = false;
+
+        if (depth == 0 || atomic_load(&tj->job.cancel) || tj->err != 0) {
+            break;
+        }
+
+        struct tarlevel *top = &stack[depth - 1];
+        if (top->at == top->len) {
+            free(top->names);
+            --depth;
+            continue;
+        }
+
+        const char *name = top->names + top->at;
+        size_t room      = sizeof(tj->path) - top->pathlen;
+        top->at += strlen(name) + 1;
+        if ((size_t)snprintf(tj->path + top->pathlen, room, "/%s", name) >=
+            room) {
+            ++tj->failed;
+            continue;
+        }
+        push = tar_entry(tj, &lv);
+    }
+
+    while (depth > 0) {
+        free(stack[--depth].names);
+    }
+    free(stack);
+}
+
+/**
+ * Picks a compressor by the suffix of the archive
+ */
+static const char *
+tar_compressor(const char *archive)
+{
+    static const char *compressors[][2] = {
+        {".gz", "gzip"},
+        {".tgz", "gzip"},
+        {".bz2", "bzip2"},
+        {".xz", "xz"},
+        {".zst", "zstd"},
+    };
+
+    size_t len = strlen(archive);
+    for (size_t i = 0; i < sizeof(compressors) / sizeof(*compressors); ++i) {
+        size_t slen = strlen(compressors[i][0]);
+        if (len > slen &&
+            strcmp(archive + len - slen, compressors[i][0]) == 0) {
+            return compressors[i][1];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Opens the archive, or a pipe to the compressor writing it
+ */
+static bool
+tar_open(struct tarjob *tj)
+{
+    int fd = openat(
+        tj->dirfd,
+        tj->archive,
+        O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+        0666);
+    if (fd < 0) {
+        tj->err = errno;
+        return false;
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) == 0) {
+        tj->skip_dev = sb.st_dev;
+        tj->skip_ino = sb.st_ino;
+    }
+
+    const char *compressor = tar_compressor(tj->archive);
+    if (!compressor) {
+        tj->out = fd;
+        return true;
+    }
+
+    int fds[2];
+    if (pipe(fds) < 0) {
+        tj->err = errno;
+        close(fd);
+        return false;
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa, fds[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&fa, fd, STDOUT_FILENO);
+
+    char *argv[] = {(char *)compressor, "-c", NULL};
+    tj->err =
+        posix_spawnp(&tj->compressor, compressor, &fa, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    close(fds[0]);
+    close(fd);
+
+    if (tj->err != 0) {
+        close(fds[1]);
+        return false;
+    }
+
+    tj->out = fds[1];
+    return true;
+}
+
+static void
+tar_run(struct job *job)
+{
+    struct tarjob *tj = (struct tarjob *)job;
+
+    // a dying compressor makes writes fail with EPIPE instead
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    tj->out = -1;
+    if (!tar_open(tj)) {
+        return;
+    }
+
+    for (size_t i = 0; i < tj->nroots; ++i) {
+        tar_tree(tj, tj->roots[i]);
+    }
+
+    // two zero blocks end the archive, which is padded to a full record
+    tar_reserve(tj, 2 * TAR_BLOCK);
+    off_t total = tj->written + tj->len;
+    tar_reserve(tj, (TAR_RECORD - total % TAR_RECORD) % TAR_RECORD);
+    tar_flush(tj);
+
+    if (close(tj->out) < 0 && tj->err == 0) {
+        tj->err = errno;
+    }
+
+    int status;
+    if (tj->compressor > 0 && waitpid(tj->compressor, &status, 0) > 0 &&
+        (!WIFEXITED(status) || WEXITSTATUS(status) != 0) && tj->err == 0) {
+        tj->err = EIO;
+    }
+}
+
+static void
+tar_finish(struct job *job, struct listing *UNUSED(list))
+{
+    struct tarjob *tj = (struct tarjob *)job;
+    bool cancelled    = atomic_load(&job->cancel);
+
+    char size[16];
+    if (tj->err != 0 || cancelled) {
+        unlinkat(tj->dirfd, tj->archive, 0);
+        set_status(
+            "%s: %s",
+            tj->archive,
+            cancelled ? "cancelled" : strerror(tj->err));
+    } else {
+        set_status(
+            "%s: %zu entries, %s, %zu failed",
+            tj->archive,
+            atomic_load(&job->progress),
+            format_size(tj->written, size, sizeof(size)),
+            tj->failed);
+    }
+
+    for (size_t i = 0; i < tj->nroots; ++i) {
+        free(tj->roots[i]);
+    }
+    free(tj->roots);
+    for (size_t i = 0; i < tj->links_size; ++i) {
+        free(tj->links[i].path);
+    }
+    free(tj->links);
+    mem_free(MEM_JOBS, TAR_BUFFER);
+    free(tj->buf);
+    close(tj->dirfd);
+    free(tj);
+}
+
+/**
+ * Starts a background job packing the marked entries (or the one at sel if
+ * none are marked) into the tar archive
+ */
+static struct job *
+tar_start(
+    const char *path,
+    const char *archive,
+    struct listing *list,
+    size_t sel)
+{
+    struct tarjob *tj = calloc(1, sizeof(*tj));
+    if (!tj) {
+        return NULL;
+    }
+
+    tj->dirfd = open(path, O_RDONLY | O_DIRECTORY);
+    tj->roots = malloc((list->marks.n + 1) * sizeof(*tj->roots));
+    tj->buf   = malloc(TAR_BUFFER);
+    if (tj->dirfd < 0 || !tj->roots || !tj->buf) {
+        set_status("%s: %s", archive, strerror(errno));
+        if (tj->dirfd >= 0) {
+            close(tj->dirfd);
+        }
+        free(tj->roots);
+        free(tj->buf);
+        free(tj);
+        return NULL;
+    }
+    mem_alloc(MEM_JOBS, TAR_BUFFER);
+
+    for (size_t i = 0; i < list->n; ++i) {
+        if (list->marks.n > 0 ? list->ents[i].is_selected : i == sel) {
+            char *name = strdup(listing_name(list, i));
+            if (name) {
+                tj->roots[tj->nroots++] = name;
+            }
+        }
+    }
+
+    snprintf(tj->archive, sizeof(tj->archive), "%s", archive);
+    tj->use_sendfile = true;
+    atomic_init(&tj->job.total, 0);
+    tj->job.what   = "pack";
+    tj->job.run    = tar_run;
+    tj->job.finish = tar_finish;
+
+    if (!job_start(&tj->job)) {
+        tj->job.finish(&tj->job, list);
+        return NULL;
+    }
+
+    return &tj->job;
+}
+
+/**
+ * Finds needle in data using memchr to skip to candidates
+ */
+static bool
+find_literal(const char *data, size_t len, const char *needle, size_t nlen)
+{
+    const char *end = data + len;
+    const char *p   = data;
+
+    while ((size_t)(end - p) >= nlen) {
+        p = memchr(p, needle[0], end - p - nlen + 1);
+        if (!p) {
+            return false;
+        }
+        if (memcmp(p + 1, needle + 1, nlen - 1) == 0) {
+            return true;
+        }
+        ++p;
+    }
+
+    return false;
+}
+
+static void
+search_visit(void *arg, int dirfd, const char *relpath, const struct stat *sb)
+{
+    struct search *s = arg;
+
+    if (!S_ISREG(sb->st_mode) || sb->st_size < (off_t)s->needle_len ||
+        atomic_load(&s->cancel)) {
+        return;
+    }
+
+    const char *name = strrchr(relpath, '/');
+    name             = name ? name + 1 : relpath;
+
+    int fd = openat(dirfd, name, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // files are read rather than mapped, so one that gets truncated while
+    // it is searched can't raise SIGBUS. The tail of each read is kept in
+    // front of the next one to find matches across reads.
+    char buf[SEARCH_BUFFER + NAME_MAX];
+    size_t keep = 0;
+    off_t bytes = 0;
+    bool found  = false;
+    bool binary = false;
+    ssize_t nread;
+    while (!found && !atomic_load(&s->cancel) &&
+           (nread = read(fd, buf + keep, SEARCH_BUFFER)) > 0) {
+        if (bytes == 0) {
+            size_t head = nread < BINARY_CHECK ? nread : BINARY_CHECK;
+            binary      = memchr(buf, '\0', head) != NULL;
+            if (binary) {
+                break;
+            }
+        }
+        bytes += nread;
+
+        size_t len = keep + nread;
+        found      = find_literal(buf, len, s->needle, s->needle_len);
+        keep       = len < s->needle_len ? len : s->needle_len - 1;
+        memmove(buf, buf + len - keep, keep);
+    }
+    close(fd);
+
+    if (found) {
+        size_t len            = strlen(relpath) + 1;
+        struct searchhit *hit = malloc(sizeof(*hit) + len);
+        if (!hit) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        mem_alloc(MEM_JOBS, sizeof(*hit) + len);
+        memcpy(hit->name, relpath, len);
+        hit->de = (struct direlement){
+            .type  = sb->st_mode & S_IXUSR ? TYPE_EXEC : TYPE_NORM,
+            .cmp   = CMP_NONE,
+            .size  = sb->st_size,
+            .mtime = sb->st_mtim,
+        };
+
+        hit->next = atomic_load(&s->hits);
+        while (!atomic_compare_exchange_weak(&s->hits, &hit->next, hit)) {
+        }
+    }
+
+    if (!binary) {
+        atomic_fetch_add(&s->bytes, bytes);
+    }
+    atomic_fetch_add(&s->files, 1);
+}
+
+static void *
+search_thread(void *arg)
+{
+    struct search *s = arg;
+
+    walk_tree(s->rootfd, s->show_hidden, search_visit, s, &s->cancel);
+    atomic_store(&s->done, true);
+
+    return NULL;
+}
+
+/**
+ * Starts searching all files below path for needle in the background and
+ * empties list, which receives the results through search_poll
+ */
+static struct search *
+search_start(
+    const char *path,
+    const char *needle,
+    struct listing *list,
+    bool show_hidden)
+{
+    struct search *s = calloc(1, sizeof(*s));
+    if (!s) {
+        return NULL;
+    }
+
+    s->rootfd = open(path, O_RDONLY | O_DIRECTORY);
+    if (s->rootfd < 0) {
+        set_status("search: %s: %s", path, strerror(errno));
+        free(s);
+        return NULL;
+    }
+
+    s->show_hidden = show_hidden;
+    s->needle_len  = strlen(needle);
+    memcpy(s->needle, needle, s->needle_len + 1);
+    atomic_init(&s->cancel, false);
+    atomic_init(&s->done, false);
+    atomic_init(&s->files, 0);
+    atomic_init(&s->bytes, 0);
+    atomic_init(&s->hits, NULL);
+
+    if (pthread_create(&s->thread, NULL, search_thread, s) != 0) {
+        set_status("search: %s", strerror(errno));
+        close(s->rootfd);
+        free(s);
+        return NULL;
+    }
+
+    listing_clear(list);
+
+    return s;
+}
+
+/**
+ * Moves new hits into list. Returns false once the search is finished.
+ */
+static bool
+search_poll(struct search *s, struct listing *list)
+{
+    bool done = atomic_load(&s->done);
+
+    // newest first, turn them around to keep the order they were found in
+    struct searchhit *hit  = atomic_exchange(&s->hits, NULL);
+    struct searchhit *prev = NULL;
+    while (hit) {
+        struct searchhit *next = hit->next;
+        hit->next              = prev;
+        prev                   = hit;
+        hit                    = next;
+    }
+
+    for (hit = prev; hit; hit = prev) {
+        struct direlement *de = listing_push(list);
+        *de                   = hit->de;
+        de->name              = listing_add_name(list, hit->name);
+        prev                  = hit->next;
+        mem_free(MEM_JOBS, sizeof(*hit) + strlen(hit->name) + 1);
+        free(hit);
+    }
+
+    char buf[16];
+    set_status(
+        "%s\"%s\": %zu matches in %zu files (%s)%s",
+        done ? "" : "searching ",
+        s->needle,
+        list->n,
+        atomic_load(&s->files),
+        format_size(atomic_load(&s->bytes), buf, sizeof(buf)),
+        done ? "" : ", esc to cancel");
+
+    return !done;
+}
+
+/**
+ * Cancels a search if it's still running and frees it
+ */
+static void
+search_stop(struct search **sp, struct listing *list)
+{
+    struct search *s = *sp;
+    if (!s) {
+        return;
+    }
+    *sp = NULL;
+
+    atomic_store(&s->cancel, true);
+    pthread_join(s->thread, NULL);
+    search_poll(s, list);
+
+    close(s->rootfd);
+    free(s);
+}
+
+/**
+ * Builds the path of file name in filet's directory below the xdg base
+ * directory given by env, which defaults to fallback in $HOME
+ */
+static bool
+user_file(
+    const char *env,
+    const char *fallback,
+    const char *name,
+    char *buf,
+    size_t size)
+{
+    const char *base = getenv(env);
+
+    int len;
+    if (base && base[0] == '/') {
+        len = snprintf(buf, size, "%s/filet/%s", base, name);
+    } else {
+        len = snprintf(
+            buf,
+            size,
+            "%s/%s/filet/%s",
+            getenv_or("HOME", "/tmp"),
+            fallback,
+            name);
+    }
+
+    return len > 0 && (size_t)len < size;
+}
+
+/**
+ * Creates all missing parent directories of file
+ */
+static bool
+make_parents(const char *file)
+{
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", file);
+
+    for (char *p = dir + 1; *p; ++p) {
+        if (*p == '/') {
+            *p = '\0';
+            if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+                return false;
+            }
+            *p = '/';
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Builds the path of the index file for root into buf
+ */
+static bool
+index_file(const char *root, char *buf, size_t size)
+{
+    char name[32];
+    snprintf(
+        name,
+        sizeof(name),
+        "index-%016llx",
+        (unsigned long long)hash_bytes(root, strlen(root), 0));
+
+    return user_file("XDG_CACHE_HOME", ".cache", name, buf, size);
+}
+
+/**
+ * Finds the index of path or its nearest parent that has one.
+ * Writes the index file to file and returns false if there is none.
+ */
+static bool
+index_find(const char *path, char *file, size_t size)
+{
+    char root[PATH_MAX];
+    snprintf(root, sizeof(root), "%s", path);
+
+    for (;;) {
+        if (index_file(root, file, size) && access(file, R_OK) == 0) {
+            return true;
+        }
+        if (root[1] == '\0') {
+            return false;
+        }
+        parent_dir(root);
+    }
+}
+
+static void
+index_close(struct pathindex *ix)
+{
+    if (ix->map) {
+        munmap(ix->map, ix->map_size);
+    }
+    memset(ix, 0, sizeof(*ix));
+}
+
+static const char *
+index_name(const struct pathindex *ix, uint64_t ent)
+{
+    return ix->names + (ix->ents[ent] >> 1) + 1; // skip the type byte
+}
+
+static bool
+index_is_dir(const struct pathindex *ix, uint64_t ent)
+{
+    return ix->ents[ent] & 1;
+}
+
+/**
+ * Returns the directory that contains ent
+ */
+static uint64_t
+index_parent(const struct pathindex *ix, uint64_t ent)
+{
+    uint64_t lo = 0;
+    uint64_t hi = ix->hdr.ndirs;
+
+    // last dir whose first entry is <= ent
+    while (hi - lo > 1) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (ix->dirs[mid].first <= ent) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+/**
+ * Checks every offset in ix against the table it points into: names must
+ * start inside the names, directories must cover the entries in order with
+ * parents before their children, and posting lists must decode to entries
+ * within the postings. A corrupt file can't make lookups read past the map.
+ */
+static bool
+index_check(const struct pathindex *ix)
+{
+    const struct ixheader *hdr = &ix->hdr;
+    if (hdr->names_size == 0 || ix->names[hdr->names_size - 1] != '\0') {
+        return false;
+    }
+    for (uint64_t e = 0; e < hdr->nents; ++e) {
+        if ((ix->ents[e] >> 1) + 1 >= hdr->names_size) {
+            return false;
+        }
+    }
+
+    uint64_t next = 0;
+    for (uint64_t d = 0; d < hdr->ndirs; ++d) {
+        const struct ixdirrec *dr = &ix->dirs[d];
+        if (dr->first != next || dr->count > hdr->nents - next) {
+            return false;
+        }
+        next += dr->count;
+    }
+    if (next != hdr->nents) {
+        return false;
+    }
+    for (uint64_t d = 0; d < hdr->ndirs; ++d) {
+        uint64_t self = ix->dirs[d].self;
+        if (self != INDEX_NONE &&
+            (self >= hdr->nents || index_parent(ix, self) >= d)) {
+            return false;
+        }
+    }
+
+    const unsigned char *end = ix->postings + hdr->postings_size;
+    for (uint64_t t = 0; t < hdr->ntris; ++t) {
+        if (ix->tris[t].off > hdr->postings_size) {
+            return false;
+        }
+        const unsigned char *p = ix->postings + ix->tris[t].off;
+        uint64_t e             = 0;
+        for (uint32_t i = 0; i < ix->tris[t].count; ++i) {
+            uint64_t delta = 0;
+            int shift      = 0;
+            do {
+                if (p == end || shift > 63) {
+                    return false;
+                }
+                delta |= (uint64_t)(*p & 0x7f) << shift;
+                shift += 7;
+            } while (*p++ & 0x80);
+
+            if (delta >= hdr->nents - e) {
+                return false;
+            }
+            e += delta;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Maps an index file and checks that it's consistent
+ */
+static bool
+index_open(const char *file, struct pathindex *ix)
+{
+    memset(ix, 0, sizeof(*ix));
+
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) < 0 || (size_t)sb.st_size < sizeof(struct ixheader)) {
+        close(fd);
+        return false;
+    }
+
+    void *map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+
+    ix->map      = map;
+    ix->map_size = sb.st_size;
+
+    // no count may be larger than the file, so the sizes can't overflow
+    const struct ixheader *hdr = map;
+    size_t size                = ix->map_size;
+    if (memcmp(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->root_len >= PATH_MAX || hdr->ndirs == 0 ||
+        hdr->ndirs > size / sizeof(*ix->dirs) ||
+        hdr->nents > size / sizeof(*ix->ents) ||
+        hdr->ntris > size / sizeof(*ix->tris) || hdr->postings_size > size ||
+        hdr->names_size > size) {
+        index_close(ix);
+        return false;
+    }
+
+    const char *p        = (const char *)(hdr + 1);
+    size_t root_size     = (hdr->root_len + 8) & ~(uint64_t)7;
+    size_t postings_size = (hdr->postings_size + 7) & ~(uint64_t)7;
+    size_t need          = sizeof(*hdr) + root_size +
+                  hdr->ndirs * sizeof(*ix->dirs) +
+                  hdr->nents * sizeof(*ix->ents) +
+                  hdr->ntris * sizeof(*ix->tris) + postings_size +
+                  hdr->names_size;
+    if (need != size) {
+        index_close(ix);
+        return false;
+    }
+
+    ix->hdr  = *hdr;
+    ix->root = p;
+    p += root_size;
+    ix->dirs = (const struct ixdirrec *)p;
+    p += hdr->ndirs * sizeof(*ix->dirs);
+    ix->ents = (const uint64_t *)p;
+    p += hdr->nents * sizeof(*ix->ents);
+    ix->tris = (const struct ixtri *)p;
+    p += hdr->ntris * sizeof(*ix->tris);
+    ix->postings = (const unsigned char *)p;
+    p += postings_size;
+    ix->names = p;
+
+    if (!index_check(ix)) {
+        index_close(ix);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Writes the path of ent relative to the root of the index into buf
+ */
+static bool
+index_path(const struct pathindex *ix, uint64_t ent, char *buf, size_t size)
+{
+    size_t pos = size - 1;
+    buf[pos]   = '\0';
+
+    for (uint64_t e = ent; e != INDEX_NONE;) {
+        const char *name = index_name(ix, e);
+        size_t len       = strlen(name);
+
+        if (len + (e != ent) > pos) {
+            return false;
+        }
+        if (e != ent) {
+            buf[--pos] = '/';
+        }
+        pos -= len;
+        memcpy(buf + pos, name, len);
+
+        e = ix->dirs[index_parent(ix, e)].self;
+    }
+
+    memmove(buf, buf + pos, size - pos);
+
+    return true;
+}
+
+/**
+ * Returns whether s contains needle, ignoring ascii case
+ */
+static bool
+contains_nocase(const char *s, const char *needle)
+{
+    size_t nlen = strlen(needle);
+
+    for (; *s; ++s) {
+        size_t i = 0;
+        while (i < nlen && s[i] && tolower((unsigned char)s[i]) == needle[i]) {
+            ++i;
+        }
+        if (i == nlen) {
+            return true;
+        }
+    }
+
+    return nlen == 0;
+}
+
+static uint32_t
+trigram(const char *s)
+{
+    return (uint32_t)tolower((unsigned char)s[0]) << 16 |
+           (uint32_t)tolower((unsigned char)s[1]) << 8 |
+           (uint32_t)tolower((unsigned char)s[2]);
+}
+
+static const struct ixtri *
+index_trigram(const struct pathindex *ix, uint32_t tri)
+{
+    uint64_t lo = 0;
+    uint64_t hi = ix->hdr.ntris;
+
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (ix->tris[mid].tri < tri) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo < ix->hdr.ntris && ix->tris[lo].tri == tri ? &ix->tris[lo]
+                                                        : NULL;
+}
+
+static void
+index_add_result(
+    const struct pathindex *ix,
+    uint64_t ent,
+    const char *query,
+    struct listing *list)
+{
+    char relpath[PATH_MAX];
+    if (!index_path(ix, ent, relpath, sizeof(relpath)) ||
+        !contains_nocase(relpath, query)) {
+        return;
+    }
+
+    struct direlement *de = listing_push(list);
+    de->name              = listing_add_name(list, relpath);
+    de->type              = index_is_dir(ix, ent) ? TYPE_DIR : TYPE_NORM;
+    de->cmp               = CMP_NONE;
+    de->size              = 0;
+    de->mtime             = (struct timespec){0};
+    de->is_selected       = false;
+}
+
+static int
+index_resultcmp(const void *va, const void *vb)
+{
+    const struct direlement *a = va;
+    const struct direlement *b = vb;
+
+    size_t alen = strlen(a->name);
+    size_t blen = strlen(b->name);
+    if (alen != blen) {
+        return alen < blen ? -1 : 1;
+    }
+
+    return strnatcmp(a->name, b->name);
+}
+
+/**
+ * Fills list with up to INDEX_MAX_RESULTS entries whose path contains query
+ * and whose name contains the last component of query. The trigrams of that
+ * component select the candidates, shorter ones fall back to a linear scan.
+ * Shorter paths are ranked first.
+ */
+static void
+index_query(const struct pathindex *ix, const char *query, struct listing *list)
+{
+    char lower[PATH_MAX];
+    size_t qlen = 0;
+    for (; query[qlen] && qlen + 1 < sizeof(lower); ++qlen) {
+        lower[qlen] = tolower((unsigned char)query[qlen]);
+    }
+    lower[qlen] = '\0';
+
+    const char *last = strrchr(lower, '/');
+    last             = last ? last + 1 : lower;
+    size_t lastlen   = strlen(last);
+
+    listing_clear(list);
+
+    if (lastlen < 3) {
+        for (uint64_t e = 0;
+             e < ix->hdr.nents && list->n < INDEX_MAX_RESULTS;
+             ++e) {
+            if (contains_nocase(index_name(ix, e), last)) {
+                index_add_result(ix, e, lower, list);
+            }
+        }
+    } else {
+        // start with the rarest trigram and check the others on the name
+        const struct ixtri *rarest = NULL;
+        for (size_t i = 0; i + 3 <= lastlen; ++i) {
+            const struct ixtri *t = index_trigram(ix, trigram(last + i));
+            if (!t) {
+                return; // some trigram doesn't appear anywhere
+            }
+            if (!rarest || t->count < rarest->count) {
+                rarest = t;
+            }
+        }
+
+        const unsigned char *p = ix->postings + rarest->off;
+        uint64_t e             = 0;
+        for (uint32_t i = 0; i < rarest->count && list->n < INDEX_MAX_RESULTS;
+             ++i) {
+            uint64_t delta;
+            p = read_varint(p, &delta);
+            e += delta;
+
+            if (contains_nocase(index_name(ix, e), last)) {
+                index_add_result(ix, e, lower, list);
+            }
+        }
+    }
+
+    qsort(list->ents, list->n, sizeof(*list->ents), index_resultcmp);
+}
+
+static void
+index_free_scan(struct ixscan *scan)
+{
+    for (size_t i = 0; i < scan->ndirs; ++i) {
+        free(scan->dirs[i].path);
+        free(scan->dirs[i].names);
+        free(scan->dirs[i].block);
+    }
+    free(scan->dirs);
+    free(scan->old_child);
+    while (scan->queue) {
+        struct ixqueue *next = scan->queue->next;
+        free(scan->queue);
+        scan->queue = next;
+    }
+}
+
+static void
+index_enqueue(struct ixscan *scan, const char *path, uint64_t old)
+{
+    size_t len           = strlen(path);
+    struct ixqueue *item = malloc(sizeof(*item) + len + 1);
+    if (!item) {
+        return;
+    }
+
+    item->old = old;
+    memcpy(item->path, path, len + 1);
+
+    pthread_mutex_lock(&scan->lock);
+    item->next  = scan->queue;
+    scan->queue = item;
+    ++scan->active;
+    pthread_cond_signal(&scan->cond);
+    pthread_mutex_unlock(&scan->lock);
+}
+
+static int
+ixnamecmp(const void *va, const void *vb)
+{
+    const char *const *a = va;
+    const char *const *b = vb;
+
+    return strcmp(*a + 1, *b + 1);
+}
+
+/**
+ * Looks up the directory of the old index that belongs to entry name of the
+ * old directory dir
+ */
+static uint64_t
+index_old_child(const struct ixscan *scan, uint64_t dir, const char *name)
+{
+    const struct pathindex *old = scan->old;
+    if (!old || dir == INDEX_NONE) {
+        return INDEX_NONE;
+    }
+
+    uint64_t lo = old->dirs[dir].first;
+    uint64_t hi = lo + old->dirs[dir].count;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        int diff     = strcmp(index_name(old, mid), name);
+        if (diff == 0) {
+            return scan->old_child[mid];
+        } else if (diff < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return INDEX_NONE;
+}
+
+/**
+ * Reads the entries of a single directory, reusing the ones of the old index
+ * if the mtime of the directory didn't change
+ */
+static void
+index_scan_dir(struct ixscan *scan, const struct ixqueue *item)
+{
+    const struct pathindex *old = scan->old;
+    const char *path            = item->path[0] ? item->path : ".";
+    struct ixscandir d          = {0};
+    size_t used                 = 0;
+    size_t cap                  = 0;
+    struct stat sb;
+
+    if (atomic_load(&scan->job->cancel) ||
+        fstatat(scan->rootfd, path, &sb, AT_SYMLINK_NOFOLLOW) < 0 ||
+        !S_ISDIR(sb.st_mode)) {
+        return; // once cancelled, the queue runs dry without reading more
+    }
+    d.mtime = sb.st_mtim;
+    atomic_fetch_add(&scan->job->progress, 1);
+
+    if (old && item->old != INDEX_NONE &&
+        old->dirs[item->old].sec == (int64_t)sb.st_mtim.tv_sec &&
+        old->dirs[item->old].nsec == (int64_t)sb.st_mtim.tv_nsec) {
+        const struct ixdirrec *od = &old->dirs[item->old];
+
+        for (uint64_t e = od->first; e < od->first + od->count; ++e) {
+            cap += strlen(old->names + (old->ents[e] >> 1)) + 1;
+        }
+        d.block = malloc(cap ? cap : 1);
+        d.names = malloc((od->count + 1) * sizeof(*d.names));
+        if (!d.block || !d.names) {
+            free(d.block);
+            free(d.names);
+            return;
+        }
+
+        for (uint64_t e = od->first; e < od->first + od->count; ++e) {
+            const char *name = old->names + (old->ents[e] >> 1);
+            size_t len       = strlen(name) + 1;
+            memcpy(d.block + used, name, len);
+            d.names[d.n++] = (char *)(uintptr_t)used;
+            used += len;
+
+            if (index_is_dir(old, e)) {
+                char sub[PATH_MAX];
+                snprintf(
+                    sub,
+                    sizeof(sub),
+                    "%s%s%s",
+                    item->path,
+                    item->path[0] ? "/" : "",
+                    name + 1);
+                index_enqueue(scan, sub, scan->old_child[e]);
+            }
+        }
+        atomic_fetch_add(&scan->reused, 1);
+    } else {
+        int fd = openat(
+            scan->rootfd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        DIR *dir = fd < 0 ? NULL : fdopendir(fd);
+        if (!dir) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            return;
+        }
+
+        size_t ncap = 0;
+        struct dirent *ent;
+        while ((ent = readdir(dir))) {
+            const char *name = ent->d_name;
+            if (name[0] == '.' &&
+                (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+
+            bool is_dir;
+#ifdef DT_UNKNOWN
+            if (ent->d_type != DT_UNKNOWN) {
+                is_dir = ent->d_type == DT_DIR;
+            } else
+#endif /* DT_UNKNOWN */
+            {
+                struct stat esb;
+                is_dir =
+                    fstatat(dirfd(dir), name, &esb, AT_SYMLINK_NOFOLLOW) == 0 &&
+                    S_ISDIR(esb.st_mode);
+            }
+
+            size_t len = strlen(name) + 2;
+            if (used + len > cap || d.n == ncap) {
+                cap          = cap * 2 + len + 4096;
+                ncap         = ncap * 2 + 64;
+                char *block  = realloc(d.block, cap);
+                char **names = realloc(d.names, ncap * sizeof(*names));
+                if (block) {
+                    d.block = block;
+                }
+                if (names) {
+                    d.names = names;
+                }
+                if (!block || !names) {
+                    break;
+                }
+            }
+
+            d.block[used] = is_dir ? 'd' : 'f';
+            memcpy(d.block + used + 1, name, len - 1);
+            d.names[d.n++] = (char *)(uintptr_t)used;
+            used += len;
+
+            if (is_dir) {
+                char sub[PATH_MAX];
+                int plen = snprintf(
+                    sub,
+                    sizeof(sub),
+                    "%s%s%s",
+                    item->path,
+                    item->path[0] ? "/" : "",
+                    name);
+                if (plen > 0 && (size_t)plen < sizeof(sub)) {
+                    index_enqueue(
+                        scan, sub, index_old_child(scan, item->old, name));
+                }
+            }
+        }
+        closedir(dir);
+        atomic_fetch_add(&scan->scanned, 1);
+    }
+
+    // names were stored as offsets while the block could still move
+    for (size_t i = 0; i < d.n; ++i) {
+        d.names[i] = d.block + (uintptr_t)d.names[i];
+    }
+    qsort(d.names, d.n, sizeof(*d.names), ixnamecmp);
+
+    d.path = strdup(item->path);
+    if (!d.path) {
+        free(d.block);
+        free(d.names);
+        return;
+    }
+
+    pthread_mutex_lock(&scan->lock);
+    if (scan->ndirs == scan->dirs_size) {
+        size_t size           = scan->dirs_size * 2 + 64;
+        struct ixscandir *tmp = realloc(scan->dirs, size * sizeof(*tmp));
+        if (!tmp) {
+            pthread_mutex_unlock(&scan->lock);
+            free(d.path);
+            free(d.block);
+            free(d.names);
+            return;
+        }
+        scan->dirs      = tmp;
+        scan->dirs_size = size;
+    }
+    scan->dirs[scan->ndirs++] = d;
+    pthread_mutex_unlock(&scan->lock);
+}
+
+static void *
+index_scan_worker(void *arg)
+{
+    struct ixscan *scan = arg;
+
+    pthread_mutex_lock(&scan->lock);
+    for (;;) {
+        while (!scan->queue && scan->active > 0) {
+            pthread_cond_wait(&scan->cond, &scan->lock);
+        }
+
+        struct ixqueue *item = scan->queue;
+        if (!item) {
+            break;
+        }
+        scan->queue = item->next;
+        pthread_mutex_unlock(&scan->lock);
+
+        index_scan_dir(scan, item);
+        free(item);
+
+        pthread_mutex_lock(&scan->lock);
+        if (--scan->active == 0) {
+            pthread_cond_broadcast(&scan->cond);
+        }
+    }
+    pthread_mutex_unlock(&scan->lock);
+
+    return NULL;
+}
+
+static int
+ixscandircmp(const void *va, const void *vb)
+{
+    const struct ixscandir *a = va;
+    const struct ixscandir *b = vb;
+
+    return strcmp(a->path, b->path);
+}
+
+static int
+uint64cmp(const void *va, const void *vb)
+{
+    uint64_t a = *(const uint64_t *)va;
+    uint64_t b = *(const uint64_t *)vb;
+
+    return (a > b) - (a < b);
+}
+
+/**
+ * Writes the scanned directories as an index file. The file is written to a
+ * temporary name and renamed, so readers always see a complete index.
+ */
+static bool
+index_write(struct ixscan *scan, const char *root, const char *file)
+{
+    qsort(scan->dirs, scan->ndirs, sizeof(*scan->dirs), ixscandircmp);
+
+    uint64_t nents      = 0;
+    uint64_t names_size = 0;
+    for (size_t i = 0; i < scan->ndirs; ++i) {
+        nents += scan->dirs[i].n;
+        for (size_t j = 0; j < scan->dirs[i].n; ++j) {
+            names_size += strlen(scan->dirs[i].names[j]) + 1;
+        }
+    }
+
+    struct ixdirrec *dirs = calloc(scan->ndirs, sizeof(*dirs));
+    uint64_t *ents        = malloc((nents + 1) * sizeof(*ents));
+    char *names           = malloc(names_size + 1);
+    if (!dirs || !ents || !names) {
+        free(dirs);
+        free(ents);
+        free(names);
+        return false;
+    }
+
+    // lay out entries directory by directory
+    uint64_t e   = 0;
+    uint64_t off = 0;
+    for (size_t i = 0; i < scan->ndirs; ++i) {
+        const struct ixscandir *d = &scan->dirs[i];
+        dirs[i]                   = (struct ixdirrec){
+            .first = e,
+            .count = d->n,
+            .sec   = d->mtime.tv_sec,
+            .nsec  = d->mtime.tv_nsec,
+            .self  = INDEX_NONE,
+        };
+
+        for (size_t j = 0; j < d->n; ++j) {
+            size_t len = strlen(d->names[j]) + 1;
+            memcpy(names + off, d->names[j], len);
+            ents[e++] = off << 1 | (d->names[j][0] == 'd');
+            off += len;
+        }
+    }
+
+    // link every directory to its own entry in the parent, which is found by
+    // binary searching the sorted paths and names
+    for (size_t i = 1; i < scan->ndirs; ++i) {
+        char parent[PATH_MAX];
+        snprintf(parent, sizeof(parent), "%s", scan->dirs[i].path);
+        char *slash      = strrchr(parent, '/');
+        const char *base = slash ? slash + 1 : scan->dirs[i].path;
+        if (slash) {
+            *slash = '\0';
+        } else {
+            parent[0] = '\0';
+        }
+
+        struct ixscandir key       = {.path = parent};
+        const struct ixscandir *pd = bsearch(
+            &key, scan->dirs, scan->ndirs, sizeof(*scan->dirs), ixscandircmp);
+        if (!pd) {
+            continue;
+        }
+
+        char lookup[NAME_MAX + 2];
+        snprintf(lookup, sizeof(lookup), "d%s", base);
+        const char *keyname = lookup;
+        char **found        = bsearch(
+            &keyname, pd->names, pd->n, sizeof(*pd->names), ixnamecmp);
+        if (found) {
+            dirs[i].self = dirs[pd - scan->dirs].first + (found - pd->names);
+        }
+    }
+
+    // collect (trigram, entry) pairs of every name and sort them, which
+    // groups them into posting lists
+    size_t npairs   = 0;
+    size_t cap      = 0;
+    uint64_t *pairs = NULL;
+    for (e = 0; e < nents; ++e) {
+        const char *name = names + (ents[e] >> 1) + 1;
+        size_t len       = strlen(name);
+
+        for (size_t i = 0; i + 3 <= len; ++i) {
+            if (npairs == cap) {
+                cap           = cap * 2 + 4096;
+                uint64_t *tmp = realloc(pairs, cap * sizeof(*tmp));
+                if (!tmp) {
+                    free(pairs);
+                    free(dirs);
+                    free(ents);
+                    free(names);
+                    return false;
+                }
+                pairs = tmp;
+            }
+            pairs[npairs++] = (uint64_t)trigram(name + i) << 40 | e;
+        }
+    }
+    qsort(pairs, npairs, sizeof(*pairs), uint64cmp);
+
+    struct ixtri *tris      = malloc((npairs + 1) * sizeof(*tris));
+    unsigned char *postings = malloc(npairs * 10 + 8);
+    size_t ntris            = 0;
+    unsigned char *p        = postings;
+    for (size_t i = 0; tris && postings && i < npairs;) {
+        uint32_t tri  = pairs[i] >> 40;
+        uint64_t prev = 0;
+
+        tris[ntris] = (struct ixtri){.tri = tri, .off = p - postings};
+        for (; i < npairs && pairs[i] >> 40 == tri; ++i) {
+            uint64_t ent = pairs[i] & (((uint64_t)1 << 40) - 1);
+            if (ent == prev && tris[ntris].count > 0) {
+                continue; // trigram appears twice in the name
+            }
+            p    = write_varint(p, ent - prev);
+            prev = ent;
+            ++tris[ntris].count;
+        }
+        ++ntris;
+    }
+    free(pairs);
+
+    char tmppath[PATH_MAX + 8];
+    snprintf(tmppath, sizeof(tmppath), "%s.tmp", file);
+    FILE *f = fopen(tmppath, "w");
+
+    bool ok = tris && postings && f;
+    if (ok) {
+        static const char zeros[8] = {0};
+        struct ixheader hdr        = {
+            .root_len      = strlen(root),
+            .ndirs         = scan->ndirs,
+            .nents         = nents,
+            .names_size    = names_size,
+            .ntris         = ntris,
+            .postings_size = p - postings,
+        };
+        memcpy(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic));
+        size_t root_size = (hdr.root_len + 8) & ~(uint64_t)7;
+        size_t post_size = (hdr.postings_size + 7) & ~(uint64_t)7;
+
+        fwrite(&hdr, sizeof(hdr), 1, f);
+        fwrite(root, 1, hdr.root_len, f);
+        fwrite(zeros, 1, root_size - hdr.root_len, f);
+        fwrite(dirs, sizeof(*dirs), scan->ndirs, f);
+        fwrite(ents, sizeof(*ents), nents, f);
+        fwrite(tris, sizeof(*tris), ntris, f);
+        fwrite(postings, 1, hdr.postings_size, f);
+        fwrite(zeros, 1, post_size - hdr.postings_size, f);
+        fwrite(names, 1, names_size, f);
+        ok = !ferror(f);
+    }
+
+    if (f) {
+        ok = fclose(f) == 0 && ok;
+    }
+    ok = ok && rename(tmppath, file) == 0;
+    if (!ok) {
+        unlink(tmppath);
+    }
+
+    free(tris);
+    free(postings);
+    free(dirs);
+    free(ents);
+    free(names);
+
+    return ok;
+}
+
+static void
+index_run(struct job *job)
+{
+    struct indexjob *ij = (struct indexjob *)job;
+    struct pathindex old;
+    struct ixscan scan = {.job = job};
+
+    bool has_old = index_find(ij->root, ij->file, sizeof(ij->file)) &&
+                   index_open(ij->file, &old);
+    if (has_old) {
+        snprintf(
+            ij->root,
+            sizeof(ij->root),
+            "%.*s",
+            (int)old.hdr.root_len,
+            old.root);
+        scan.old       = &old;
+        scan.old_child = malloc((old.hdr.nents + 1) * sizeof(*scan.old_child));
+        if (!scan.old_child) {
+            ij->err    = errno;
+            ij->failed = ij->root;
+            index_close(&old);
+            return;
+        }
+
+        for (uint64_t e = 0; e < old.hdr.nents; ++e) {
+            scan.old_child[e] = INDEX_NONE;
+        }
+        for (uint64_t d = 0; d < old.hdr.ndirs; ++d) {
+            if (old.dirs[d].self != INDEX_NONE) {
+                scan.old_child[old.dirs[d].self] = d;
+            }
+        }
+    } else if (
+        !index_file(ij->root, ij->file, sizeof(ij->file)) ||
+        !make_parents(ij->file)) {
+        ij->err    = errno;
+        ij->failed = ij->file;
+        return;
+    }
+
+    scan.rootfd = open(ij->root, O_RDONLY | O_DIRECTORY);
+    if (scan.rootfd < 0) {
+        ij->err    = errno;
+        ij->failed = ij->root;
+        if (has_old) {
+            free(scan.old_child);
+            index_close(&old);
+        }
+        return;
+    }
+
+    atomic_init(&scan.scanned, 0);
+    atomic_init(&scan.reused, 0);
+    pthread_mutex_init(&scan.lock, NULL);
+    pthread_cond_init(&scan.cond, NULL);
+    index_enqueue(&scan, "", has_old ? 0 : INDEX_NONE);
+    run_threads(index_scan_worker, &scan, MAX_THREADS);
+    pthread_cond_destroy(&scan.cond);
+    pthread_mutex_destroy(&scan.lock);
+    close(scan.rootfd);
+
+    ij->scanned = atomic_load(&scan.scanned);
+    ij->reused  = atomic_load(&scan.reused);
+    errno       = 0;
+    if (!atomic_load(&job->cancel) &&
+        !(scan.ndirs > 0 && index_write(&scan, ij->root, ij->file))) {
+        ij->err    = errno ? errno : EIO;
+        ij->failed = ij->file;
+    }
+
+    index_free_scan(&scan);
+    if (has_old) {
+        index_close(&old);
+    }
+}
+
+static void
+index_finish(struct job *job, struct listing *UNUSED(list))
+{
+    struct indexjob *ij = (struct indexjob *)job;
+
+    if (atomic_load(&job->cancel)) {
+        set_status("index: cancelled");
+    } else if (ij->err != 0) {
+        set_status("index: %s: %s", ij->failed, strerror(ij->err));
+    } else {
+        set_status(
+            "indexed %s: %zu directories read, %zu unchanged",
+            ij->root,
+            ij->scanned,
+            ij->reused);
+    }
+
+    free(ij);
+}
+
+/**
+ * Starts a background job building or refreshing the index for path, or for
+ * the nearest parent that already has one. Only directories whose mtime
+ * changed since the last build are read again.
+ */
+static struct job *
+index_start(const char *path)
+{
+    struct indexjob *ij = calloc(1, sizeof(*ij));
+    if (!ij) {
+        return NULL;
+    }
+
+    snprintf(ij->root, sizeof(ij->root), "%s", path);
+    atomic_init(&ij->job.total, 0);
+    ij->job.what   = "index";
+    ij->job.run    = index_run;
+    ij->job.finish = index_finish;
+
+    if (!job_start(&ij->job)) {
+        free(ij);
+        return NULL;
+    }
+
+    return &ij->job;
+}
+
+/**
+ * Replaces list with the results of query on the index of path. On success
+ * path is set to the root of the index, as results are relative to it.
+ */
+static bool
+index_jump(char *path, const char *query, struct listing *list)
+{
+    char file[PATH_MAX];
+    struct pathindex ix;
+
+    if (!index_find(path, file, sizeof(file)) || !index_open(file, &ix)) {
+        set_status("no index for %s, press I to build one", path);
+        return false;
+    }
+
+    index_query(&ix, query, list);
+    snprintf(path, PATH_MAX, "%.*s", (int)ix.hdr.root_len, ix.root);
+    set_status(
+        "%zu%s matches for \"%s\" in %llu paths",
+        list->n,
+        list->n >= INDEX_MAX_RESULTS ? "+" : "",
+        query,
+        (unsigned long long)ix.hdr.nents);
+    index_close(&ix);
+
+    return true;
+}
+
+static bool
+frecency_file(char *buf, size_t size)
+{
+    return user_file("XDG_DATA_HOME", ".local/share", "frecency", buf, size);
+}
+
+/**
+ * Returns the frecency score of e at time now, zoxide style: the rank is
+ * weighted by how recently the directory was visited
+ */
+static double
+frecency_score(const struct frentry *e, time_t now)
+{
+    time_t age = now - e->last;
+
+    if (age < 60 * 60) {
+        return e->rank * 4;
+    } else if (age < 24 * 60 * 60) {
+        return e->rank * 2;
+    } else if (age < 7 * 24 * 60 * 60) {
+        return e->rank / 2;
+    }
+
+    return e->rank / 4;
+}
+
+static void
+frecency_free(struct frecency *db)
+{
+    for (size_t i = 0; i < db->n; ++i) {
+        free(db->ents[i].path);
+    }
+    free(db->ents);
+    memset(db, 0, sizeof(*db));
+}
+
+static bool
+frecency_add(struct frecency *db, const char *path, double rank, time_t last)
+{
+    if (db->n == db->size) {
+        size_t size         = db->size ? db->size * 2 : ENT_ALLOC_NUM;
+        struct frentry *tmp = realloc(db->ents, size * sizeof(*tmp));
+        if (!tmp) {
+            return false;
+        }
+        db->ents = tmp;
+        db->size = size;
+    }
+
+    char *copy = strdup(path);
+    if (!copy) {
+        return false;
+    }
+
+    db->ents[db->n++] = (struct frentry){
+        .path = copy,
+        .rank = rank,
+        .last = last,
+    };
+
+    return true;
+}
+
+/**
+ * Reads the frecency database. A missing or broken database is empty.
+ */
+static void
+frecency_load(const char *file, struct frecency *db)
+{
+    memset(db, 0, sizeof(*db));
+
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) < 0 || (size_t)sb.st_size < sizeof(struct frheader)) {
+        close(fd);
+        return;
+    }
+
+    const char *map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return;
+    }
+
+    const struct frheader *hdr = (const struct frheader *)map;
+    const char *end            = map + sb.st_size;
+    const char *p              = (const char *)(hdr + 1);
+
+    if (memcmp(hdr->magic, FRECENCY_MAGIC, sizeof(hdr->magic)) == 0) {
+        for (uint32_t i = 0; i < hdr->count; ++i) {
+            const struct frrecord *rec = (const struct frrecord *)p;
+            if ((size_t)(end - p) < sizeof(*rec) ||
+                (size_t)(end - p) - sizeof(*rec) <= rec->len ||
+                rec->len >= PATH_MAX) {
+                break;
+            }
+
+            char path[PATH_MAX];
+            memcpy(path, rec + 1, rec->len);
+            path[rec->len] = '\0';
+            if (!frecency_add(db, path, rec->rank, rec->last)) {
+                break;
+            }
+
+            p += sizeof(*rec) + ((rec->len + 8) & ~(uint32_t)7);
+        }
+    }
+
+    munmap((void *)map, sb.st_size);
+}
+
+static int
+frentrycmp(const void *va, const void *vb)
+{
+    const struct frentry *a = va;
+    const struct frentry *b = vb;
+
+    return (a->rank < b->rank) - (a->rank > b->rank);
+}
+
+/**
+ * Writes the database to a temporary file and renames it over the old one,
+ * so concurrent readers never see a partial update
+ */
+static bool
+frecency_save(const char *file, const struct frecency *db)
+{
+    char tmppath[PATH_MAX + 16];
+    snprintf(tmppath, sizeof(tmppath), "%s.%ld", file, (long)getpid());
+
+    FILE *f = fopen(tmppath, "w");
+    if (!f) {
+        return false;
+    }
+
+    struct frheader hdr = {.count = db->n};
+    memcpy(hdr.magic, FRECENCY_MAGIC, sizeof(hdr.magic));
+    fwrite(&hdr, sizeof(hdr), 1, f);
+
+    for (size_t i = 0; i < db->n; ++i) {
+        static const char zeros[8] = {0};
+        const struct frentry *e    = &db->ents[i];
+        struct frrecord rec        = {
+            .rank = e->rank,
+            .last = e->last,
+            .len  = strlen(e->path),
+        };
+
+        fwrite(&rec, sizeof(rec), 1, f);
+        fwrite(e->path, 1, rec.len, f);
+        fwrite(zeros, 1, ((rec.len + 8) & ~(uint32_t)7) - rec.len, f);
+    }
+
+    bool ok = !ferror(f);
+    ok      = fclose(f) == 0 && ok;
+    ok      = ok && rename(tmppath, file) == 0;
+    if (!ok) {
+        unlink(tmppath);
+    }
+
+    return ok;
+}
+
+/**
+ * Adds the visits recorded since the last call to the database. The database
+ * is locked from reading to renaming, so concurrent instances don't lose each
+ * other's visits. Once the ranks add up to FRECENCY_MAX_RANK all of them are
+ * aged and the database is cut down to FRECENCY_MAX_ENTRIES.
+ */
+static void
+frecency_flush(void)
+{
+    char file[PATH_MAX];
+    char lockfile[PATH_MAX + 8];
+    g_visits_flushed = time(NULL);
+    if (g_visits.n == 0 || !frecency_file(file, sizeof(file)) ||
+        !make_parents(file)) {
+        frecency_free(&g_visits);
+        return;
+    }
+
+    // the database itself is replaced by renaming, so a lock on it would
+    // not be seen by whoever opens the new one
+    snprintf(lockfile, sizeof(lockfile), "%s.lock", file);
+    int lock = open(lockfile, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (lock < 0 || flock(lock, LOCK_EX) < 0) {
+        if (lock >= 0) {
+            close(lock);
+        }
+        frecency_free(&g_visits);
+        return;
+    }
+
+    struct frecency db;
+    frecency_load(file, &db);
+
+    double total = 0;
+    for (size_t i = 0; i < db.n; ++i) {
+        total += db.ents[i].rank;
+    }
+    for (size_t v = 0; v < g_visits.n; ++v) {
+        const struct frentry *visit = &g_visits.ents[v];
+        bool found                  = false;
+        for (size_t i = 0; i < db.n && !found; ++i) {
+            if (strcmp(db.ents[i].path, visit->path) == 0) {
+                db.ents[i].rank += visit->rank;
+                db.ents[i].last = visit->last;
+                found           = true;
+            }
+        }
+        if (!found) {
+            frecency_add(&db, visit->path, visit->rank, visit->last);
+        }
+        total += visit->rank;
+    }
+    frecency_free(&g_visits);
+
+    if (total > FRECENCY_MAX_RANK || db.n > FRECENCY_MAX_ENTRIES) {
+        qsort(db.ents, db.n, sizeof(*db.ents), frentrycmp);
+
+        size_t kept = 0;
+        for (size_t i = 0; i < db.n; ++i) {
+            if (total > FRECENCY_MAX_RANK) {
+                db.ents[i].rank *= FRECENCY_AGING;
+            }
+
+            if (db.ents[i].rank >= 1 && kept < FRECENCY_MAX_ENTRIES) {
+                db.ents[kept++] = db.ents[i];
+            } else {
+                free(db.ents[i].path);
+            }
+        }
+        db.n = kept;
+    }
+
+    frecency_save(file, &db);
+    frecency_free(&db);
+    close(lock);
+}
+
+/**
+ * Records a visit of path. Visits are kept in memory and written out every
+ * FRECENCY_FLUSH_S seconds, before querying and on exit, instead of
+ * rewriting the database whenever a directory is loaded.
+ */
+static void
+frecency_visit(const char *path)
+{
+    time_t now = time(NULL);
+    bool found = false;
+    for (size_t i = 0; i < g_visits.n && !found; ++i) {
+        if (strcmp(g_visits.ents[i].path, path) == 0) {
+            g_visits.ents[i].rank += 1;
+            g_visits.ents[i].last = now;
+            found                 = true;
+        }
+    }
+    if (!found) {
+        frecency_add(&g_visits, path, 1, now);
+    }
+
+    if (now - g_visits_flushed >= FRECENCY_FLUSH_S) {
+        frecency_flush();
+    }
+}
+
+/**
+ * Returns whether all space separated words of query appear in path in
+ * order, ignoring case. The last word has to match the last component.
+ */
+static bool
+frecency_matches(const char *path, const char *query)
+{
+    const char *last = strrchr(path, '/');
+    last             = last ? last + 1 : path;
+    const char *p    = path;
+
+    while (*query) {
+        char word[PATH_MAX];
+        size_t len = strcspn(query, " ");
+        if (len == 0) {
+            ++query;
+            continue;
         }
 
-        if (*s1 == '\0') {
-            return 1;
+        snprintf(word, sizeof(word), "%.*s", (int)len, query);
+        for (char *c = word; *c; ++c) {
+            *c = tolower((unsigned char)*c);
         }
+        query += len;
+        query += strspn(query, " ");
 
-        if (!(isdigit((int)*s1) && isdigit((int)*s2))) {
-            if (*s1 != *s2) {
-                return (int)*s1 - (int)*s2;
+        // the last word has to match in the last component
+        const char *found = NULL;
+        const char *start = !*query && last > p ? last : p;
+        for (const char *s = start; *s && !found; ++s) {
+            size_t i = 0;
+            while (word[i] && tolower((unsigned char)s[i]) == word[i]) {
+                ++i;
             }
-            ++s1;
-            ++s2;
-        } else {
-            char *lim1;
-            char *lim2;
-            unsigned long n1 = strtoul(s1, &lim1, 10);
-            unsigned long n2 = strtoul(s2, &lim2, 10);
-            if (n1 > n2) {
-                return 1;
-            } else if (n1 < n2) {
-                return -1;
+            if (!word[i]) {
+                found = s;
             }
-            s1 = lim1;
-            s2 = lim2;
         }
+
+        if (!found) {
+            return false;
+        }
+        p = found + len;
     }
+
+    return true;
+}
+
+static int
+frscorecmp(const void *va, const void *vb)
+{
+    const struct frentry *a = va;
+    const struct frentry *b = vb;
+
+    // the rank field holds the score while querying
+    return (a->rank < b->rank) - (a->rank > b->rank);
 }
 
 /**
- * Comparison function for direlements
+ * Finds the directories matching query, ranked by their frecency score.
+ * Directories that vanished are left out. They are stat'ed on workers with
+ * a deadline, so a dead mount among them doesn't hang the caller.
  */
-static int
-direlemcmp(const void *va, const void *vb)
+static void
+frecency_query(const char *query, struct frecency *res)
 {
-    const struct direlement *a = va;
-    const struct direlement *b = vb;
+    char file[PATH_MAX];
+    memset(res, 0, sizeof(*res));
+    frecency_flush();
+    if (!frecency_file(file, sizeof(file))) {
+        return;
+    }
 
-    bool a_is_dir = a->type == TYPE_DIR || a->type == TYPE_SYML_TO_DIR;
-    bool b_is_dir = b->type == TYPE_DIR || b->type == TYPE_SYML_TO_DIR;
+    struct frecency db;
+    frecency_load(file, &db);
 
-    if (a_is_dir != b_is_dir) {
-        return a_is_dir ? -1 : 1;
+    size_t names = 0;
+    size_t *idx  = malloc((db.n + 1) * sizeof(*idx));
+    if (!idx) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < db.n; ++i) {
+        names += strlen(db.ents[i].path) + 1;
     }
 
-    return strnatcmp(a->name, b->name);
+    int rootfd = open("/", O_RDONLY | O_DIRECTORY);
+    if (rootfd < 0) {
+        free(idx);
+        frecency_free(&db);
+        return;
+    }
+    struct statjob *job = statjob_new("/", rootfd, db.n + 1, names + 1);
+    close(rootfd);
+
+    char *p = job->names;
+    for (size_t i = 0; i < db.n; ++i) {
+        const char *path = db.ents[i].path;
+        if (path[0] == '/' && !slow_below(path) &&
+            frecency_matches(path, query)) {
+            job->res[job->n].name = strcpy(p, path[1] ? path + 1 : ".");
+            idx[job->n++]         = i;
+            p += strlen(p) + 1;
+        }
+    }
+    job->nwait = job->n;
+    statjob_wait(job, LOADER_THREADS);
+
+    time_t now = time(NULL);
+    pthread_mutex_lock(&job->lock);
+    for (size_t j = 0; j < job->n; ++j) {
+        const struct statresult *r = &job->res[j];
+        const struct frentry *e    = &db.ents[idx[j]];
+        if (!r->done) {
+            slow_add("/", r->name);
+        } else if (
+            r->ok &&
+            (r->de.type == TYPE_DIR || r->de.type == TYPE_SYML_TO_DIR)) {
+            frecency_add(res, e->path, frecency_score(e, now), e->last);
+        }
+    }
+    pthread_mutex_unlock(&job->lock);
+    statjob_release(job);
+    free(idx);
+    frecency_free(&db);
+
+    qsort(res->ents, res->n, sizeof(*res->ents), frscorecmp);
 }
 
 /**
- * Sets the terminal size on row
+ * Renames from to to, failing if to exists. Uses renameat2 where available,
+ * which makes the check atomic.
  */
-static bool
-get_term_size(int *row, int *col)
+static int
+rename_noreplace(int dirfd, const char *from, const char *to)
 {
-    struct winsize wsize;
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &wsize) < 0) {
-        perror("ioctl");
-        return false;
+#ifdef SYS_renameat2
+    if (syscall(SYS_renameat2, dirfd, from, dirfd, to, RENAME_NOREPLACE) == 0) {
+        return 0;
+    }
+    if (errno != ENOSYS && errno != EINVAL) {
+        return -1;
     }
+#endif /* SYS_renameat2 */
 
-    *row = wsize.ws_row;
-    *col = wsize.ws_col;
+    struct stat sb;
+    if (fstatat(dirfd, to, &sb, AT_SYMLINK_NOFOLLOW) == 0) {
+        errno = EEXIST;
+        return -1;
+    }
 
-    return true;
+    return renameat(dirfd, from, dirfd, to);
 }
 
-/**
- * Used as SIGWINCH (terminal resize handler)
- */
-static void
-handle_winch(int UNUSED(sig))
+static int
+renameopcmp(const void *va, const void *vb)
 {
-    g_needs_redraw = true;
+    const struct renameop *a = va;
+    const struct renameop *b = vb;
+
+    return strcmp(a->from, b->from);
 }
 
 /**
- * Used for SIGINT and SIGTERM to pass the exit signal to main()
+ * Returns the pending op that renames name away, if any
  */
-static void
-handle_exit(int UNUSED(sig))
+static struct renameop *
+rename_find(struct renameop *ops, size_t n, const char *name)
 {
-    g_quit = true;
+    struct renameop key    = {.from = name};
+    struct renameop *found = bsearch(&key, ops, n, sizeof(*ops), renameopcmp);
+
+    if (!found || found->state == RENAME_DONE || found->tmp[0] != '\0') {
+        return NULL;
+    }
+
+    return found;
 }
 
 /**
- * Saves the current session (current path and selected file)
- * to /tmp/filet_dir and /tmp/filet_sel
+ * Executes a batch of renames. An op whose target is still occupied by the
+ * source of another op waits for that one, chains are resolved in order and
+ * cycles (like swaps) are broken by moving one source to a temporary name.
+ *
+ * Returns the number of failed renames.
  */
-static void
-save_session(const char *path, const char *sel_name)
+static size_t
+rename_batch(int dirfd, struct renameop *ops, size_t n)
 {
-    FILE *f = fopen("/tmp/filet_dir", "w");
-    if (f) {
-        fprintf(f, "%s\n", path);
-        fclose(f);
+    size_t failed = 0;
+    size_t *stack = malloc((n + 1) * sizeof(*stack));
+    if (!stack) {
+        return n;
     }
-    f = fopen("/tmp/filet_sel", "w");
-    if (f) {
-        fprintf(f, "%s/%s\n", path, sel_name);
-        fclose(f);
+
+    qsort(ops, n, sizeof(*ops), renameopcmp);
+
+    for (size_t i = 0; i < n; ++i) {
+        if (ops[i].state != RENAME_NEW) {
+            continue;
+        }
+
+        size_t depth   = 0;
+        stack[depth++] = i;
+        ops[i].state   = RENAME_STACKED;
+
+        while (depth > 0) {
+            struct renameop *op   = &ops[stack[depth - 1]];
+            struct renameop *next = rename_find(ops, n, op->to);
+
+            if (next && next != op && next->state == RENAME_NEW) {
+                next->state    = RENAME_STACKED;
+                stack[depth++] = next - ops;
+                continue;
+            }
+
+            if (next && next != op) {
+                // cycle: park the blocking source under a temporary name
+                snprintf(
+                    next->tmp,
+                    sizeof(next->tmp),
+                    ".filet-rename-%ld-%zu",
+                    (long)getpid(),
+                    (size_t)(next - ops));
+                if (rename_noreplace(dirfd, next->from, next->tmp) < 0) {
+                    next->tmp[0] = '\0';
+                }
+            }
+
+            const char *from = op->tmp[0] ? op->tmp : op->from;
+            op->ok           = rename_noreplace(dirfd, from, op->to) == 0;
+            if (!op->ok) {
+                op->err = errno;
+                ++failed;
+            }
+            op->state = RENAME_DONE;
+            --depth;
+        }
     }
+
+    free(stack);
+
+    return failed;
+}
+
+static bool
+journal_file(char *buf, size_t size)
+{
+    return user_file("XDG_DATA_HOME", ".local/share", "journal", buf, size);
 }
 
 /**
- * Resets the terminal to its prior state
+ * Appends a record and its names a and b (if any) to batch
  */
 static void
-restore_terminal(void)
+journal_put(
+    struct jnbatch *batch,
+    uint32_t kind,
+    const struct stat *sb,
+    const char *a,
+    const char *b)
 {
-    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &g_old_termios) < 0) {
-        perror("tcsetattr");
+    size_t alen         = strlen(a);
+    size_t blen         = b ? strlen(b) + 1 : 0;
+    struct jnrecord rec = {
+        .kind = kind,
+        .len  = alen + blen,
+        .dev  = sb->st_dev,
+        .ino  = sb->st_ino,
+    };
+    size_t padded = (rec.len + 8) & ~(size_t)7;
+
+    if (batch->size - batch->len < sizeof(rec) + padded) {
+        size_t size = batch->size ? batch->size * 2 : 4096;
+        while (size - batch->len < sizeof(rec) + padded) {
+            size *= 2;
+        }
+        char *tmp = realloc(batch->data, size);
+        if (!tmp) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        batch->data = tmp;
+        batch->size = size;
     }
 
-    printf(
-        "\033[?7h"    // enable line wrapping
-        "\033[?25h"   // unhide cursor
-        "\033[;r"     // reset scroll region
-        "\033[?1049l" // restore main screen
-    );
+    char *p = batch->data + batch->len;
+    memcpy(p, &rec, sizeof(rec));
+    p += sizeof(rec);
+    memset(p, 0, padded);
+    memcpy(p, a, alen);
+    if (b) {
+        memcpy(p + alen + 1, b, blen - 1);
+    }
+    batch->len += sizeof(rec) + padded;
 }
 
 /**
- * Saves old terminal configuration to reset on SIGINT or SIGTERM
- * restore_terminal will use this to restore the settings.
+ * Records the successful renames of a batch done in path, so they can be
+ * undone. The batch is appended with a single write while holding a lock,
+ * so filets in nested shells don't interleave.
+ *
+ * Returns whether the renames made it into the journal.
  */
 static bool
-get_termios(void)
+journal_append(
+    const char *path,
+    int dirfd,
+    const struct renameop *ops,
+    size_t n)
 {
-    if (tcgetattr(STDIN_FILENO, &g_old_termios) < 0) {
-        perror("tcgetattr");
+    char file[PATH_MAX];
+    struct stat sb;
+    if (!journal_file(file, sizeof(file)) || !make_parents(file) ||
+        fstat(dirfd, &sb) < 0) {
         return false;
     }
 
-    return true;
+    struct jnbatch batch = {0};
+    journal_put(&batch, JOURNAL_DIR, &sb, path, NULL);
+    for (size_t i = 0; i < n; ++i) {
+        if (ops[i].ok &&
+            fstatat(dirfd, ops[i].to, &sb, AT_SYMLINK_NOFOLLOW) == 0) {
+            journal_put(&batch, JOURNAL_RENAME, &sb, ops[i].from, ops[i].to);
+        }
+    }
+
+    int fd = open(file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        free(batch.data);
+        return false;
+    }
+
+    bool ok = flock(fd, LOCK_EX) == 0 && fstat(fd, &sb) == 0;
+    if (ok && (sb.st_size == 0 || sb.st_size > JOURNAL_MAX)) {
+        ok = ftruncate(fd, 0) == 0 &&
+             write(fd, JOURNAL_MAGIC, 8) == 8;
+    }
+    ok = ok && write(fd, batch.data, batch.len) == (ssize_t)batch.len;
+
+    close(fd);
+    free(batch.data);
+
+    return ok;
 }
 
 /**
- * Sets up the terminal for TUI use (read every char, differentiate \r and \n,
- * don't echo, hide the cursor, fix a scroll region, switch to a second screen)
+ * Renames an element of list from one name to another, as done by an undo.
+ * Returns false if the listing has to be reloaded instead.
  */
 static bool
-setup_terminal(int row)
+journal_patch(
+    struct listing *list,
+    const char *from,
+    const char *to,
+    bool show_hidden)
 {
-    setvbuf(stdout, NULL, _IOFBF, 0);
-
-    struct termios raw = g_old_termios;
-    raw.c_oflag &= ~OPOST;
-    raw.c_lflag &= ~(ECHO | ICANON);
+    size_t i = listing_find(list, from, false);
+    if (i == list->n) {
+        i = listing_find(list, from, true);
+    }
 
-    if (tcsetattr(STDIN_FILENO, TCSANOW, &raw) < 0) {
-        perror("tcsetattr");
+    if (i == list->n) {
+        return !is_listed(to, show_hidden);
+    }
+    if (!is_listed(to, show_hidden)) {
         return false;
     }
 
-    printf(
-        "\033[?1049h" // use alternative screen buffer
-        "\033[?7l"    // diable line wrapping
-        "\033[?25l"   // hide cursor
-        "\033[2J"     // clear screen
-        "\033[3;%dr", // limit scrolling to scrolling area
-        row);
-
+    list->ents[i].name = listing_add_name(list, to);
     return true;
 }
 
 /**
- * Read a directory into ents.
+ * Undoes the last batch of renames in the journal, wherever it was done, and
+ * drops it from the journal. Renames are only reverted if the entry still
+ * has the inode it had back then. If the batch was done in path, the
+ * affected elements of list are patched; list may be NULL if it can't be.
  *
- * Returns the number of elements in the dir.
+ * Returns whether list has to be reloaded.
  */
-static size_t
-read_dir(
-    const char *path,
-    struct direlement **ents,
-    size_t *ents_size,
-    bool show_hidden)
+static bool
+journal_undo(const char *path, struct listing *list, bool show_hidden)
 {
-    size_t n = 0;
-    DIR *dir;
-    dir = opendir(path);
-    if (dir) {
-        struct dirent *ent;
-        while ((ent = readdir(dir))) {
-            const char *name = ent->d_name;
-            int fd           = dirfd(dir);
-            struct stat sb;
+    char file[PATH_MAX];
+    int fd = -1;
+    if (journal_file(file, sizeof(file))) {
+        fd = open(file, O_RDWR | O_CLOEXEC);
+    }
 
-            if (name[0] == '.' &&
-                (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
-                continue;
-            }
+    struct stat sb;
+    if (fd < 0 || flock(fd, LOCK_EX) < 0 || fstat(fd, &sb) < 0 ||
+        sb.st_size <= 8) {
+        set_status("undo: nothing to undo");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+
+    size_t size = sb.st_size;
+    char *map   = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        set_status("undo: %s", strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    // find the last complete batch
+    const char *end  = map + size;
+    const char *p    = memcmp(map, JOURNAL_MAGIC, 8) == 0 ? map + 8 : end;
+    const char *last = NULL;
+    while ((size_t)(end - p) >= sizeof(struct jnrecord)) {
+        const struct jnrecord *rec = (const struct jnrecord *)p;
+        size_t padded              = (rec->len + 8) & ~(size_t)7;
+        if ((size_t)(end - p) - sizeof(*rec) < padded ||
+            rec->len >= 2 * PATH_MAX) {
+            break;
+        }
+        if (rec->kind == JOURNAL_DIR) {
+            last = p;
+        }
+        p += sizeof(*rec) + padded;
+    }
+    end = p;
+
+    if (!last) {
+        set_status("undo: nothing to undo");
+        munmap(map, size);
+        close(fd);
+        return false;
+    }
+
+    const struct jnrecord *dirrec = (const struct jnrecord *)last;
+    const char *dir               = (const char *)(dirrec + 1);
+    struct renameop *ops          = NULL;
+    size_t nops                   = 0;
+    size_t changed                = 0;
+    bool reload                   = false;
+
+    int dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd < 0 || fstat(dirfd, &sb) < 0 || sb.st_dev != dirrec->dev ||
+        sb.st_ino != dirrec->ino) {
+        set_status("undo: %s is gone", dir);
+    } else {
+        size_t count = 0;
+        for (p = last; p < end;) {
+            const struct jnrecord *rec = (const struct jnrecord *)p;
+            count += rec->kind == JOURNAL_RENAME;
+            p += sizeof(*rec) + ((rec->len + 8) & ~(size_t)7);
+        }
+
+        ops = malloc((count + 1) * sizeof(*ops));
+        if (!ops) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
 
-            if (!show_hidden && name[0] == '.') {
+        for (p = last; p < end;) {
+            const struct jnrecord *rec = (const struct jnrecord *)p;
+            const char *old            = (const char *)(rec + 1);
+            p += sizeof(*rec) + ((rec->len + 8) & ~(size_t)7);
+            if (rec->kind != JOURNAL_RENAME) {
                 continue;
             }
 
-            if (fstatat(fd, name, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
+            const char *cur = old + strlen(old) + 1;
+            if (fstatat(dirfd, cur, &sb, AT_SYMLINK_NOFOLLOW) < 0 ||
+                sb.st_ino != rec->ino) {
+                ++changed;
                 continue;
             }
+            ops[nops++] = (struct renameop){.from = cur, .to = (char *)old};
+        }
 
-            if (n == *ents_size) {
-                *ents_size += ENT_ALLOC_NUM;
-                struct direlement *tmp =
-                    realloc(*ents, *ents_size * sizeof(*tmp));
-                if (!tmp) {
-                    perror("realloc");
-                    exit(EXIT_FAILURE);
-                }
-                *ents = tmp;
-            }
+        size_t failed = rename_batch(dirfd, ops, nops);
+        int err       = 0;
 
-            strcpy((*ents)[n].name, ent->d_name);
-            (*ents)[n].is_selected = false;
+        bool here = stat(path, &sb) == 0 && sb.st_dev == dirrec->dev &&
+                    sb.st_ino == dirrec->ino;
+        reload = here && (!list || list->fc || list->spill);
+        for (size_t i = 0; here && !reload && i < nops; ++i) {
+            if (ops[i].ok) {
+                reload = !journal_patch(
+                    list, ops[i].from, ops[i].to, show_hidden);
+            }
+        }
+        if (here && !reload && nops > failed) {
+            qsort(list->ents, list->n, sizeof(*list->ents), direlemcmp);
+            ++list->gen;
+        }
 
-            if (S_ISDIR(sb.st_mode)) {
-                (*ents)[n].type = TYPE_DIR;
-            } else if (S_ISLNK(sb.st_mode)) {
-                if (!(fstatat(dirfd(dir), (*ents)[n].name, &sb, 0) < 0 ||
-                      !S_ISDIR(sb.st_mode))) {
-                    (*ents)[n].type = TYPE_SYML_TO_DIR;
-                } else {
-                    (*ents)[n].type = TYPE_SYML;
-                }
-            } else {
-                if (sb.st_mode & S_IXUSR) {
-                    (*ents)[n].type = TYPE_EXEC;
-                } else {
-                    (*ents)[n].type = TYPE_NORM;
-                }
+        for (size_t i = 0; i < nops; ++i) {
+            if (!ops[i].ok) {
+                err = ops[i].err;
             }
+        }
 
-            ++n;
+        if (failed > 0) {
+            set_status(
+                "undid %zu renames in %s, %zu failed: %s",
+                nops - failed,
+                dir,
+                failed,
+                strerror(err));
+        } else if (changed > 0) {
+            set_status(
+                "undid %zu renames in %s, %zu changed since",
+                nops,
+                dir,
+                changed);
+        } else {
+            set_status("undid %zu renames in %s", nops, dir);
         }
-        qsort(*ents, n, sizeof(**ents), direlemcmp);
-        closedir(dir);
     }
 
-    return n;
+    if (ftruncate(fd, last - map) < 0) {
+        set_status("undo: %s", strerror(errno));
+    }
+
+    if (dirfd >= 0) {
+        close(dirfd);
+    }
+    free(ops);
+    munmap(map, size);
+    close(fd);
+
+    return reload;
 }
 
 /**
- * Spawns a new process, waits for it and returns
+ * Lets the user edit the names of the marked entries (or all of them, if
+ * none are marked) with editor and renames the entries accordingly. The
+ * listing is patched instead of being reloaded.
  */
 static void
-spawn(const char *path, const char *cmd, const char *argv1, int row)
+bulk_rename(
+    const char *path,
+    const char *editor,
+    struct listing *list,
+    int row)
 {
-    int status;
-    pid_t pid = fork();
+    char tmppath[PATH_MAX];
+    snprintf(
+        tmppath,
+        sizeof(tmppath),
+        "%s/filet-rename-XXXXXX",
+        getenv_or("TMPDIR", "/tmp"));
 
-    if (pid < 0) {
+    int fd = mkstemp(tmppath);
+    if (fd < 0) {
+        set_status("rename: %s", strerror(errno));
         return;
     }
 
-    restore_terminal();
-    fflush(stdout);
+    bool any_selected = false;
+    for (size_t i = 0; i < list->n && !any_selected; ++i) {
+        any_selected = list->ents[i].is_selected;
+    }
+
+    FILE *f = fdopen(fd, "w");
+    for (size_t i = 0; f && i < list->n; ++i) {
+        const struct direlement *de = &list->ents[i];
+        if ((any_selected && !de->is_selected) || de->cmp == CMP_ONLY_RIGHT ||
+            strchr(de->name, '\n')) {
+            continue;
+        }
+        fprintf(f, "%zu\t%s\n", i + 1, de->name);
+    }
+    if (!f || fclose(f) != 0) {
+        set_status("rename: %s", strerror(errno));
+        unlink(tmppath);
+        return;
+    }
+
+    spawn(path, editor, tmppath, row);
+
+    f = fopen(tmppath, "r");
+    unlink(tmppath);
+    if (!f) {
+        set_status("rename: %s", strerror(errno));
+        return;
+    }
+
+    struct renameop *ops = NULL;
+    size_t nops          = 0;
+    size_t size          = 0;
+    const char *error    = NULL;
+    char *line           = NULL;
+    size_t linesize      = 0;
+    ssize_t len;
+    while (!error && (len = getline(&line, &linesize, f)) > 0) {
+        if (line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+
+        char *name;
+        unsigned long idx = strtoul(line, &name, 10);
+        if (name == line || *name != '\t' || idx == 0 || idx > list->n) {
+            continue; // not one of our lines
+        }
+        ++name;
+
+        const struct direlement *de = &list->ents[idx - 1];
+        if (strcmp(name, de->name) == 0) {
+            continue;
+        }
+
+        if (name[0] == '\0' || strcmp(name, ".") == 0 ||
+            strcmp(name, "..") == 0 ||
+            (strchr(name, '/') && !strchr(de->name, '/'))) {
+            error = "invalid name";
+            break;
+        }
+
+        if (nops == size) {
+            size                 = size ? size * 2 : ENT_ALLOC_NUM;
+            struct renameop *tmp = realloc(ops, size * sizeof(*tmp));
+            if (!tmp) {
+                error = strerror(errno);
+                break;
+            }
+            ops = tmp;
+        }
+
+        ops[nops] = (struct renameop){
+            .from = de->name,
+            .to   = strdup(name),
+            .idx  = idx - 1,
+        };
+        if (!ops[nops++].to) {
+            error = strerror(errno);
+        }
+    }
+    free(line);
+    fclose(f);
+
+    // every target may only be used once
+    for (size_t i = 0; !error && i < nops; ++i) {
+        for (size_t j = i + 1; j < nops; ++j) {
+            if (strcmp(ops[i].to, ops[j].to) == 0) {
+                error = "duplicate target name";
+                break;
+            }
+        }
+    }
+
+    int dirfd = open(path, O_RDONLY | O_DIRECTORY);
+    if (!error && dirfd < 0) {
+        error = strerror(errno);
+    }
+
+    if (error) {
+        set_status("rename: %s, nothing renamed", error);
+    } else if (nops > 0) {
+        size_t failed    = rename_batch(dirfd, ops, nops);
+        int err          = 0;
+        const char *undo = journal_append(path, dirfd, ops, nops)
+                               ? ""
+                               : ", can't be undone";
 
-    if (pid == 0) {
-        if (chdir(path) < 0) {
-            _exit(EXIT_FAILURE);
+        for (size_t i = 0; i < nops; ++i) {
+            if (ops[i].ok) {
+                list->ents[ops[i].idx].name = listing_add_name(list, ops[i].to);
+            } else {
+                err = ops[i].err;
+            }
+        }
+        qsort(list->ents, list->n, sizeof(*list->ents), direlemcmp);
+
+        if (failed > 0) {
+            set_status(
+                "renamed %zu, %zu failed: %s%s",
+                nops - failed,
+                failed,
+                strerror(err),
+                undo);
+        } else {
+            set_status("renamed %zu%s", nops, undo);
         }
-        execlp(cmd, cmd, argv1, NULL);
-        // NOTREACHED
-        _exit(EXIT_FAILURE);
-    } else {
-        do {
-            waitpid(pid, &status, WUNTRACED);
-        } while (!WIFEXITED(status) && !WIFSIGNALED(status));
     }
 
-    setup_terminal(row);
+    if (dirfd >= 0) {
+        close(dirfd);
+    }
+    for (size_t i = 0; i < nops; ++i) {
+        free(ops[i].to);
+    }
+    free(ops);
 }
 
 /**
- * Gets the parent dir of a given path (without trailing /) and writes it back
+ * Writes out what was buffered for --ls
  */
 static void
-parent_dir(char *path)
+ls_flush(struct lsout *o)
 {
-    if (path[1] != '\0') {
-        char *end = strrchr(path, '/');
-        if (path == end) {
-            ++end;
+    for (size_t done = 0; done < o->len;) {
+        ssize_t n = write(STDOUT_FILENO, o->buf + done, o->len - done);
+        if (n < 0 && errno != EINTR) {
+            perror("write");
+            exit(EXIT_FAILURE);
         }
-        *end = '\0';
+        done += n > 0 ? n : 0;
     }
+    o->len = 0;
 }
 
-/**
- * Draws a single directory entry in it's own line
- *
- * Assumes the cursor is at the beginning of the line
- */
 static void
-draw_line(const struct direlement *ent, bool is_sel)
+ls_put(struct lsout *o, const char *name, int type)
 {
-    switch (ent->type) {
-    case TYPE_DIR:
-        printf("\033[34;1m");
-        break;
-    case TYPE_SYML: // FALLTHROUGH
-    case TYPE_SYML_TO_DIR:
-        printf("\033[36;1m");
-        break;
-    case TYPE_EXEC:
-        printf("\033[32;1m");
-        break;
-    case TYPE_NORM:
-        printf("\033[m");
-        break;
+    size_t len = strlen(name);
+    if (o->len + len + 2 > LS_BUFFER) {
+        ls_flush(o);
     }
 
-    if (is_sel) {
-        printf("> %c%s", ent->is_selected ? '*' : ' ', ent->name);
-    } else {
-        printf(
-            " %c%s ",
-            ent->is_selected ? '*' : ' ',
-            ent->name); // space to clear the last char on unindenting it
+    memcpy(o->buf + o->len, name, len);
+    o->len += len;
+
+    if (o->classify) {
+        switch (type) {
+        case TYPE_DIR:
+            o->buf[o->len++] = '/';
+            break;
+        case TYPE_SYML: // FALLTHROUGH
+        case TYPE_SYML_TO_DIR:
+        case TYPE_SYML_BROKEN:
+            o->buf[o->len++] = '@';
+            break;
+        case TYPE_EXEC:
+            o->buf[o->len++] = '*';
+            break;
+        }
     }
+    o->buf[o->len++] = o->sep;
 }
 
 /**
- * Redraws the whole screen. Avoid this if possible
+ * Lists dir to stdout in directory order. Entries are only stat'ed if
+ * their type is needed and d_type doesn't tell.
  */
 static void
-redraw(
-    const struct direlement *ents,
-    const char *user_and_hostname,
-    const char *path,
-    size_t n,
-    size_t sel,
-    size_t offset,
-    int row)
+ls_unsorted(DIR *dir, struct lsout *o)
 {
-    // clear screen and redraw status
-    printf(
-        "\033[2J"      // clear screen
-        "\033[H"       // go to 0,0
-        "%s"           // print username@hostname
-        "\033[34;1m%s" // print path
-        " \033[m[%zu]" // number of entries
-        "\033[3;%dr"   // limit scrolling to scrolling area
-        "\r\n",        // enter scrolling region
-        user_and_hostname,
-        path,
-        n,
-        row);
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+        if (!is_listed(ent->d_name, o->show_hidden)) {
+            continue;
+        }
 
-    if (n == 0) {
-        printf("\n\033[31;7mdirectory empty\033[27m");
-    } else {
-        for (size_t i = offset; i < n && i - offset < (size_t)row - 2; ++i) {
-            printf("\n");
-            draw_line(&ents[i], i == sel);
-            printf("\r");
+        struct direlement de = {.type = TYPE_NORM};
+        if (o->classify && ent->d_type == DT_DIR) {
+            de.type = TYPE_DIR;
+        } else if (o->classify) {
+            stat_element(dirfd(dir), ent->d_name, &de);
         }
+        ls_put(o, ent->d_name, de.type);
     }
 }
 
 /**
- * Reads a key from stdin
- *
- * Acts as a getchar wrapper that transforms arrow keys to hjkl
+ * Runs filet --ls [-aF0U] [DIR]: prints the names in DIR like ls -1 would,
+ * loaded and sorted the same way as the listing, without a terminal
  */
 static int
-getkey(void)
+ls_main(int argc, char **argv)
 {
-    int c = getchar();
-    if (c != '\033') {
-        return c;
+    struct lsout o   = {.sep = '\n'};
+    const char *path = ".";
+
+    for (int i = 0; i < argc; ++i) {
+        if (argv[i][0] != '-' || argv[i][1] == '\0') {
+            path = argv[i];
+            continue;
+        }
+
+        for (const char *f = argv[i] + 1; *f; ++f) {
+            switch (*f) {
+            case 'a':
+                o.show_hidden = true;
+                break;
+            case 'F':
+                o.classify = true;
+                break;
+            case '0':
+                o.sep = '\0';
+                break;
+            case 'U':
+                o.unsorted = true;
+                break;
+            default:
+                fprintf(stderr, "usage: filet --ls [-aF0U] [DIR]\n");
+                return EXIT_FAILURE;
+            }
+        }
     }
 
-    c = getchar();
-    if (c != '[') {
-        return c;
+    char real[PATH_MAX];
+    struct stat sb;
+    if (!realpath(path, real)) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return LS_TROUBLE;
+    }
+    if (stat(real, &sb) == 0 && !S_ISDIR(sb.st_mode)) {
+        fprintf(stderr, "%s: %s\n", path, strerror(ENOTDIR));
+        return LS_TROUBLE;
     }
 
-    c = getchar();
-    switch (c) {
-    case 'A':
-        return 'k';
-        break;
-    case 'B':
-        return 'j';
-        break;
-    case 'C':
-        return 'l';
-        break;
-    case 'D':
-        return 'h';
-        break;
+    // read_dir shows errors in the status line only, so open it here first
+    DIR *dir = opendir(real);
+    if (!dir) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return LS_TROUBLE;
     }
 
-    return c;
+    o.buf = malloc(LS_BUFFER);
+    if (!o.buf) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    if (o.unsorted) {
+        ls_unsorted(dir, &o);
+        closedir(dir);
+    } else {
+        closedir(dir);
+
+        // d_type is enough to sort, unless executables are to be marked
+        if (!o.classify) {
+            setenv("FILET_LOADER", "dtype", false);
+        }
+
+        struct listing list = {0};
+        read_dir(real, &list, o.show_hidden);
+        if (g_status[0] != '\0') {
+            fprintf(stderr, "%s\n", g_status); // errors and FILET_TRACE
+        }
+
+        for (size_t i = 0; i < list.n; ++i) {
+            ls_put(&o, listing_name(&list, i), list.ents[i].type);
+        }
+    }
+    ls_flush(&o);
+
+    if (getenv("FILET_TRACE")) {
+        mem_json(stderr);
+    }
+
+    return EXIT_SUCCESS;
 }
 
 int
 main(int argc, char **argv)
 {
+    mem_init();
+
+    if (argc > 1 && strcmp(argv[1], "--ls") == 0) {
+        return ls_main(argc - 2, argv + 2);
+    }
+
     if (!(isatty(STDIN_FILENO) && isatty(STDOUT_FILENO))) {
         fprintf(stderr, "isatty: not connected to a tty");
         exit(EXIT_FAILURE);
@@ -541,20 +9787,15 @@ main(int argc, char **argv)
     char *hostname = malloc(HOST_NAME_MAX);
     if (!hostname) {
         perror("malloc");
+        exit(EXIT_FAILURE);
     }
 
     if (gethostname(hostname, HOST_NAME_MAX) < 0) {
         perror("gethostname");
-        free(hostname);
         hostname[0] = '\0';
     }
 
-    size_t ents_size        = ENT_ALLOC_NUM;
-    struct direlement *ents = malloc(ents_size * sizeof(*ents));
-    if (!ents) {
-        perror("malloc");
-        exit(EXIT_FAILURE);
-    }
+    struct listing list = {0};
 
     int row = 0;
     int col = 0;
@@ -587,6 +9828,7 @@ main(int argc, char **argv)
     }
 
     atexit(restore_terminal);
+    atexit(frecency_flush);
 
     size_t user_and_host_size =
         strlen(user) + strlen(hostname) + strlen("\033[32;1m@\033[m:") + 1;
@@ -609,52 +9851,164 @@ main(int argc, char **argv)
             user_and_hostname, user_and_host_size, "\033[32;1m%s\033[m:", user);
     }
 
-    bool show_hidden = false;
-    bool fetch_dir   = true;
-    size_t sel       = 0;
-    size_t y         = 0;
-    size_t n;
+    bool show_hidden       = false;
+    bool fetch_dir         = true;
+    size_t sel             = 0;
+    size_t y               = 0;
+    struct search *search  = NULL;
+    struct job *job        = NULL;
+    char visited[PATH_MAX]  = "";
+    char reselect[PATH_MAX] = "";
+    struct rawdir rawdir    = {0};
+    bool raw_order          = false;
+    size_t anchor           = SIZE_MAX; // last element marked with m
+    struct tree tree        = {0};
+    char name[PATH_MAX];
+
+    pacer_init(&g_pacer);
+
+    // getkey is mixed with poll, so stdio must not read ahead
+    setvbuf(stdin, NULL, _IONBF, 0);
 
     for (;;) {
         if (g_quit) {
-            save_session(path, ents[sel].name);
+            save_session(path, tree_name(&tree, &list, sel, name, PATH_MAX));
             exit(EXIT_SUCCESS);
         }
 
         if (fetch_dir) {
+            search_stop(&search, &list);
+            tree_reset(&tree);
             fetch_dir      = false;
+            g_status[0]    = '\0';
+            sel            = 0;
+            y              = 0;
+            anchor         = SIZE_MAX;
+            if (raw_order || raw_wanted(path)) {
+                raw_open(&rawdir, path, &list, show_hidden, row);
+                snprintf(g_status, sizeof(g_status), "unsorted");
+            } else {
+                raw_close(&rawdir);
+                read_dir(path, &list, show_hidden);
+            }
+            g_needs_redraw = true;
+
+            if (mem_over_budget(0)) {
+                link_cache_clear();
+            }
+            if (getenv("FILET_TRACE")) {
+                size_t len = strlen(g_status);
+                if (len > 0) {
+                    len += snprintf(
+                        g_status + len, sizeof(g_status) - len, "; ");
+                }
+                if (len < sizeof(g_status)) {
+                    mem_describe(g_status + len, sizeof(g_status) - len);
+                }
+            }
+
+            // put the cursor back on the directory we just left
+            if (reselect[0] != '\0' && !rawdir.dir) {
+                size_t found = listing_find(&list, reselect, true);
+                if (found < list.n) {
+                    sel = found;
+                    y   = found;
+                }
+                reselect[0] = '\0';
+            }
+
+            if (strcmp(path, visited) != 0) {
+                frecency_visit(path);
+                strcpy(visited, path);
+            }
+        }
+
+        if (tree_check(&tree, &list)) {
+            sel            = 0;
+            y              = 0;
+            g_needs_redraw = true;
+        }
+        size_t nrows = tree_rows(&tree, &list);
+        if (sel > 0 && sel >= nrows) {
+            // the listing was replaced by a job
             sel            = 0;
             y              = 0;
-            n              = read_dir(path, &ents, &ents_size, show_hidden);
             g_needs_redraw = true;
         }
 
-        if (g_needs_redraw) {
+        if (g_needs_redraw && pacer_ready(&g_pacer)) {
             g_needs_redraw = false;
             get_term_size(&row, &col);
             size_t scroll_size = row - 3;
 
-            int empty_space = -(n - (sel - y + scroll_size));
+            int empty_space = -(nrows - (sel - y + scroll_size));
             if (y > scroll_size) {
                 y = scroll_size;
             } else if (empty_space > 0) {
-                y = n >= scroll_size ? y + empty_space + 1 : sel;
+                y = nrows >= scroll_size ? y + empty_space + 1 : sel;
             }
-            redraw(ents, user_and_hostname, path, n, sel, sel - y, row);
+            redraw(&tree, &list, user_and_hostname, path, sel, sel - y, row);
 
             // move cursor to selection
             printf("\033[%zuH", y + 3);
         }
 
-        fflush(stdout);
+        pacer_flush(&g_pacer);
+
+        if (search || job || list.late || list.marks.pending > 0 ||
+            tree_late(&tree) || g_fsreq) {
+            size_t old     = list.n;
+            bool has_input = wait_input(POLL_MS);
+            if (listing_poll_late(&list, !tree_has_children(&tree, NULL)) ||
+                tree_poll_late(&tree)) {
+                g_needs_redraw = true;
+            }
+            if (listing_poll_marks(&list)) {
+                redraw_header(&list, user_and_hostname, path);
+            }
+            if (fsinfo_poll()) {
+                redraw_header(&list, user_and_hostname, path);
+            }
+            if (search && !search_poll(search, &list)) {
+                search_stop(&search, &list);
+            }
+            if (job && !job_poll(job)) {
+                job_stop(&job, &list, false);
+            }
+
+            if (list.n != old) {
+                g_needs_redraw = true;
+            }
+            if (!has_input) {
+                continue;
+            }
+        } else if (!wait_input(FSINFO_REFRESH_S * 1000)) {
+            // idle, keeps the free space in the header current
+            redraw_header(&list, user_and_hostname, path);
+            continue;
+        }
 
         int k = getkey();
+        if (k == KEY_CPR) {
+            continue;
+        }
+
+        if (search && (k == '\033' || k == 'F')) {
+            search_stop(&search, &list);
+            continue;
+        } else if (job && k == '\033') {
+            job_stop(&job, &list, true);
+            continue;
+        }
 
         switch (k) {
-        case 'h':
+        case 'h': {
+            const char *child = strrchr(path, '/');
+            snprintf(reselect, sizeof(reselect), "%s", child ? child + 1 : "");
             parent_dir(path);
             fetch_dir = true;
             break;
+        }
         case '~':
             strcpy(path, home);
             fetch_dir = true;
@@ -670,30 +10024,168 @@ main(int argc, char **argv)
         case 'r':
             fetch_dir = true;
             break;
+        case 'S':
+            raw_order = !raw_order;
+            fetch_dir = true;
+            break;
+        case 'c': // FALLTHROUGH
+        case 'C': {
+            char input[PATH_MAX];
+            char other[PATH_MAX];
+            if (!prompt("compare with: ", input, sizeof(input))) {
+                break;
+            }
+
+            search_stop(&search, &list);
+
+            if (!resolve_path(path, input, other)) {
+                set_status("compare: %s: %s", input, strerror(errno));
+                break;
+            }
+
+            if (!listing_expand(&list)) {
+                set_status("compare: directory is too large");
+                break;
+            }
+            compare_dirs(path, other, &list, show_hidden, k == 'C');
+            sel            = 0;
+            y              = 0;
+            g_needs_redraw = true;
+            break;
+        }
+        case 'F': {
+            char needle[NAME_MAX + 1];
+            if (!prompt("search: ", needle, sizeof(needle))) {
+                break;
+            }
+
+            search         = search_start(path, needle, &list, show_hidden);
+            sel            = 0;
+            y              = 0;
+            g_needs_redraw = true;
+            break;
+        }
+        case 'I':
+            if (job) {
+                set_status("%s is still running", job->what);
+            } else {
+                job = index_start(path);
+            }
+            break;
+        case 'L': {
+            char query[PATH_MAX];
+            if (!prompt("jump to: ", query, sizeof(query))) {
+                break;
+            }
+
+            search_stop(&search, &list);
+
+            if (index_jump(path, query, &list)) {
+                sel            = 0;
+                y              = 0;
+                g_needs_redraw = true;
+            }
+            break;
+        }
+        case 'z': // FALLTHROUGH
+        case 'Z': {
+            char query[PATH_MAX];
+            if (!prompt(k == 'z' ? "z: " : "Z: ", query, sizeof(query))) {
+                break;
+            }
+
+            struct frecency res;
+            frecency_query(query, &res);
+            if (res.n == 0) {
+                set_status("no visited directory matches \"%s\"", query);
+            } else if (k == 'z') {
+                strcpy(path, res.ents[0].path);
+                fetch_dir = true;
+            } else {
+                search_stop(&search, &list);
+
+                // list the matches as paths relative to /
+                listing_clear(&list);
+                strcpy(path, "/");
+                for (size_t i = 0; i < res.n; ++i) {
+                    const char *name = res.ents[i].path + 1;
+                    if (name[0] == '\0') {
+                        continue;
+                    }
+
+                    struct direlement *de = listing_push(&list);
+                    de->name              = listing_add_name(&list, name);
+                    de->type              = TYPE_DIR;
+                    de->cmp               = CMP_NONE;
+                    de->size              = 0;
+                    de->mtime             = (struct timespec){0};
+                    de->is_selected       = false;
+                }
+                sel            = 0;
+                y              = 0;
+                g_needs_redraw = true;
+            }
+            frecency_free(&res);
+            break;
+        }
+        case 'R':
+            search_stop(&search, &list);
+            if (!listing_expand(&list)) {
+                set_status("rename: directory is too large");
+                break;
+            }
+            bulk_rename(path, editor, &list, row);
+            g_needs_redraw = true;
+            break;
+        case 'U':
+            search_stop(&search, &list);
+            if (journal_undo(path, rawdir.dir ? NULL : &list, show_hidden)) {
+                fetch_dir = true;
+            }
+            g_needs_redraw = true;
+            break;
+        case 'D':
+            search_stop(&search, &list);
+            find_duplicates(path, &list, show_hidden);
+            sel            = 0;
+            y              = 0;
+            g_needs_redraw = true;
+            break;
         case 's': {
-            save_session(path, ents[sel].name);
+            save_session(path, tree_name(&tree, &list, sel, name, PATH_MAX));
             spawn(path, shell, NULL, row);
             fetch_dir = true;
             break;
         }
         case 'q': {
-            save_session(path, ents[sel].name);
+            save_session(path, tree_name(&tree, &list, sel, name, PATH_MAX));
             exit(EXIT_SUCCESS);
             break;
         }
         }
 
-        if (n == 0) {
+        if (list.n == 0) {
             continue; // rest of the commands require at least one entry
         }
 
         switch (k) {
         case 'j':
-            if (sel < n - 1) {
-                draw_line(&ents[sel], false);
+            if (raw_active(&rawdir, &list) && sel + row >= list.n) {
+                sel -= raw_forward(&rawdir, &list, sel - y, sel + row);
+            }
+            if (sel < nrows - 1 &&
+                (g_needs_redraw || pacer_behind(&g_pacer))) {
+                // only move, the next frame shows where we ended up
+                ++sel;
+                if (y < (size_t)row - 3) {
+                    ++y;
+                }
+                g_needs_redraw = true;
+            } else if (sel < nrows - 1) {
+                draw_row(&tree, &list, path, sel, false);
                 printf("\r\n");
                 ++sel;
-                draw_line(&ents[sel], true);
+                draw_row(&tree, &list, path, sel, true);
                 printf("\r");
 
                 if (y < (size_t)row - 3) {
@@ -702,8 +10194,17 @@ main(int argc, char **argv)
             }
             break;
         case 'k':
-            if (sel > 0) {
-                draw_line(&ents[sel], false);
+            if (raw_active(&rawdir, &list) && sel < (size_t)row) {
+                sel += raw_back(&rawdir, &list, sel - y + row);
+            }
+            if (sel > 0 && (g_needs_redraw || pacer_behind(&g_pacer))) {
+                --sel;
+                if (y > 0) {
+                    --y;
+                }
+                g_needs_redraw = true;
+            } else if (sel > 0) {
+                draw_row(&tree, &list, path, sel, false);
                 if (y == 0) {
                     printf("\r\033[L");
                 } else {
@@ -711,73 +10212,168 @@ main(int argc, char **argv)
                     --y;
                 }
                 --sel;
-                draw_line(&ents[sel], true);
+                draw_row(&tree, &list, path, sel, true);
                 printf("\r");
             }
             break;
         case '\n': // FALLTHROUGH
-        case 'l':
-            if (ents[sel].type == TYPE_DIR ||
-                ents[sel].type == TYPE_SYML_TO_DIR) {
+        case 'l': {
+            struct treerow r = tree_row(&tree, &list, path, sel);
+            const struct direlement *de = &r.list->ents[r.i];
+            tree_name(&tree, &list, sel, name, PATH_MAX);
+            if (de->type == TYPE_UNKNOWN) {
+                set_status("%s: still waiting for stat", name);
+            } else if (de->cmp == CMP_ONLY_RIGHT) {
+                set_status("%s: only in the compared directory", name);
+            } else if (de->type == TYPE_DIR || de->type == TYPE_SYML_TO_DIR) {
                 // don't append to /
                 if (path[1] != '\0') {
                     strcat(path, "/");
                 }
-                strcat(path, ents[sel].name);
+                strcat(path, name);
                 fetch_dir = true;
             } else {
                 if (opener) {
-                    spawn(path, opener, ents[sel].name, row);
+                    spawn(path, opener, name, row);
                 }
                 fetch_dir = true;
             }
             break;
+        }
+        case 't':
+            if (rawdir.dir) {
+                set_status("tree: not in unsorted mode");
+                break;
+            }
+            tree_toggle(&tree, &list, path, sel, show_hidden);
+            g_needs_redraw = true;
+            break;
         case 'g':
+            if (raw_active(&rawdir, &list) && rawdir.first > 0) {
+                raw_rewind(&rawdir, &list, row);
+                sel            = 0;
+                y              = 0;
+                g_needs_redraw = true;
+                break;
+            }
             if (sel - y == 0) {
-                draw_line(&ents[sel], false);
+                draw_row(&tree, &list, path, sel, false);
                 printf("\033[3H");
                 sel = 0;
-                draw_line(&ents[sel], true);
+                draw_row(&tree, &list, path, sel, true);
                 printf("\r");
             } else {
                 // screen needs to be redrawn
-                sel = 0;
-                y   = 0;
-                redraw(ents, user_and_hostname, path, n, sel, 0, row);
-                printf("\033[3H");
+                sel            = 0;
+                y              = 0;
+                g_needs_redraw = true;
             }
             break;
         case 'G':
-            if (sel + row - 2 - y >= n) {
-                draw_line(&ents[sel], false);
+            // only the last chunks are read, the window moves along
+            if (raw_active(&rawdir, &list) && raw_end(&rawdir, &list, row)) {
+                sel            = list.n - 1;
+                y              = row - 3;
+                g_needs_redraw = true;
+                break;
+            }
+            if (sel + row - 2 - y >= nrows) {
+                draw_row(&tree, &list, path, sel, false);
                 printf(
-                    "\033[%luH", 2 + (n < ((size_t)row - 3) ? n : (size_t)row));
-                sel = n - 1;
+                    "\033[%luH",
+                    2 + (nrows < ((size_t)row - 3) ? nrows : (size_t)row));
+                sel = nrows - 1;
                 y   = row - 3;
-                draw_line(&ents[sel], true);
+                draw_row(&tree, &list, path, sel, true);
                 printf("\r");
             } else {
                 // screen needs to be redrawn
-                sel = n - 1;
-                y   = row - 3;
-                redraw(
-                    ents, user_and_hostname, path, n, sel, n - (row - 2), row);
-                printf("\033[%dH", row);
+                sel            = nrows - 1;
+                y              = row - 3;
+                g_needs_redraw = true;
+            }
+            break;
+        case 'a': // FALLTHROUGH
+        case 'A': {
+            char cmd[NAME_MAX + 1];
+            size_t i;
+            if (job) {
+                set_status("%s is still running", job->what);
+            } else if (
+                tree_current(&tree, &list, path, sel, &i) &&
+                prompt(k == 'a' ? "attr: " : "attr -R: ", cmd, sizeof(cmd))) {
+                job = attr_start(path, cmd, &list, i, k == 'A');
             }
             break;
-        case 'e':
-            spawn(path, editor, ents[sel].name, row);
+        }
+        case 'p': {
+            char archive[PATH_MAX];
+            size_t i;
+            if (job) {
+                set_status("%s is still running", job->what);
+            } else if (
+                tree_current(&tree, &list, path, sel, &i) &&
+                prompt("pack to: ", archive, sizeof(archive))) {
+                job = tar_start(path, archive, &list, i);
+            }
+            break;
+        }
+        case 'H': // FALLTHROUGH
+        case 'V': {
+            char manifest[PATH_MAX];
+            if (job) {
+                set_status("%s is still running", job->what);
+            } else if (prompt(
+                           k == 'H' ? "write manifest: " : "verify manifest: ",
+                           manifest,
+                           sizeof(manifest))) {
+                search_stop(&search, &list);
+                job = sum_start(path, manifest, &list, show_hidden, k == 'V');
+            }
+            break;
+        }
+        case 'e': {
+            struct treerow r = tree_row(&tree, &list, path, sel);
+            tree_name(&tree, &list, sel, name, PATH_MAX);
+            if (r.list->ents[r.i].cmp == CMP_ONLY_RIGHT) {
+                // would create it here rather than edit the compared one
+                set_status("%s: only in the compared directory", name);
+                break;
+            }
+            spawn(path, editor, name, row);
             fetch_dir = true;
             break;
-        case 'm':
-            ents[sel].is_selected = !ents[sel].is_selected;
-            draw_line(&ents[sel], true);
+        }
+        case 'm': {
+            struct treerow r = tree_row(&tree, &list, path, sel);
+            if (r.list != &list) {
+                set_status("only entries of %s can be marked", path);
+                break;
+            }
+            listing_mark(&list, path, r.i, !list.ents[r.i].is_selected);
+            anchor = sel;
+            draw_row(&tree, &list, path, sel, true);
             printf("\r");
+            redraw_header(&list, user_and_hostname, path);
+            break;
+        }
+        case 'M': {
+            size_t from = anchor < nrows ? anchor : sel;
+            size_t lo   = from < sel ? from : sel;
+            size_t hi   = from < sel ? sel : from;
+            for (size_t c = lo; c <= hi; ++c) {
+                struct treerow r = tree_row(&tree, &list, path, c);
+                if (r.list == &list) {
+                    listing_mark(&list, path, r.i, true);
+                }
+            }
+            anchor         = sel;
+            g_needs_redraw = true;
             break;
+        }
         case 'u':
-            for (size_t c = 0; c < n; c++) {
-                if (ents[c].is_selected)
-                    ents[c].is_selected = false;
+            for (size_t c = 0; c < list.n; c++) {
+                listing_mark(&list, path, c, false);
             }
             g_needs_redraw = true;
             break;
@@ -786,25 +10382,26 @@ main(int argc, char **argv)
             if (fd < 0) {
                 continue;
             }
-            for (size_t i = 0; i < n; ++i) {
-                if (ents[i].is_selected) {
-                    if (ents[i].type == TYPE_DIR) {
+            for (size_t i = 0; i < list.n; ++i) {
+                if (list.ents[i].is_selected) {
+                    if (list.ents[i].type == TYPE_DIR) {
                         nftw(
-                            ents[i].name,
+                            listing_name(&list, i),
                             delete_file,
                             32,
                             FTW_DEPTH | FTW_MOUNT | FTW_PHYS);
                     } else {
                         unlinkat(
                             fd,
-                            ents[i].name,
-                            ents[i].type == TYPE_DIR ? AT_REMOVEDIR : 0);
+                            listing_name(&list, i),
+                            list.ents[i].type == TYPE_DIR ? AT_REMOVEDIR : 0);
                     }
                 }
 
                 fetch_dir = true;
             }
             close(fd);
+            fsinfo_invalidate();
             break;
         }
         }